@@ -12,17 +12,40 @@
 #include <sys/time.h>
 #include <utime.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include "common.h"
 #include "error.h"
+#include "bufpool.h"
 
 #define PAGE_SIZE		4096
 #define DEFAULT_IO_SIZE		(PAGE_SIZE * 1024)		// 4M
 #define MAX_IO_SIZE		(PAGE_SIZE * 1024 * 128)	// 256M
 #define MIN_IO_SIZE		(PAGE_SIZE * 128)		// 512K
-#define MAX_IOCB_COUNT		8192
 #define SHARDING_SIZE		(1024 * 1024 * 1024 * 4L);	// 4G
 
+#define ENGINE_LIBAIO		0
+#define ENGINE_URING		1
+
+/* how a shard was copied, fastest first */
+#define COPY_PATH_CLONE		0	/* FICLONERANGE: extents shared, metadata only */
+#define COPY_PATH_CFR		1	/* copy_file_range: copied inside the kernel */
+#define COPY_PATH_URING		2
+#define COPY_PATH_LIBAIO	3
+#define COPY_PATH_BUFFERED	4	/* shard smaller than io_size */
+#define COPY_PATH_HOLE		5	/* nothing but holes in the shard */
+
+static const char *copy_path_name[] = {"reflink", "copy_file_range", "io_uring", "libaio", "buffered", "hole"};
+#define QUEUE_DEPTH_DEFAULT	64	/* io_size buffers in flight per shard */
+#define QUEUE_DEPTH_MAX		4096
+#define MAX_WORKERS		64
+#define URING_SQ_IDLE_MS	1000	/* SQPOLL thread idle time before it sleeps */
+
 typedef struct thread_sharding_info
 {
 	int	infd;
@@ -30,21 +53,47 @@ typedef struct thread_sharding_info
 	loff_t	offset;
 	size_t	size;
 	int64_t	io_size;
+	int	engine;		/* ENGINE_* */
+	int	sqpoll;		/* io_uring: kernel side submission polling */
+	int	queue_depth;	/* blocks in flight, memory is queue_depth * io_size */
+	int	kernel_copy;	/* try FICLONERANGE and copy_file_range before the aio engines */
+	int	path;		/* out: COPY_PATH_* of the aligned part of the shard */
+	int	sparse;		/* source has holes: copy its data extents only */
+	size_t	data_size;	/* out: bytes of data extents copied */
+	BUF_POOL	*buf_pool;	/* io_size buffers */
+	BUF_POOL	*iocb_pool;	/* struct iocb */
 } SHARDING_INFO;
 
+/* shards not copied yet, workers pop them in order */
+typedef struct shard_queue {
+	pthread_mutex_t	lock;
+	int		next;
+	int		count;
+	SHARDING_INFO	*sinfo;
+	int64_t		total_copy;	/* bytes of the shards done, for the progress */
+	int64_t		total_data;	/* bytes of data extents copied, holes excluded */
+	size_t		file_size;
+} SHARD_QUEUE;
+
+typedef struct copy_worker_info {
+	int		index;
+	const char	*src;
+	const char	*dst;
+	SHARD_QUEUE	*queue;
+	int		shards;		/* shards copied by this worker */
+} COPY_WORKER_INFO;
 
-void libaio_read_prepare(int fd, struct iocb **iocb_list, int iocb_list_len, loff_t io_size, loff_t offset, io_callback_t cb)
+
+void libaio_read_prepare(SHARDING_INFO *si, struct iocb **iocb_list, int iocb_list_len, loff_t offset, io_callback_t cb)
 {
 	struct iocb *iocb_ptr;
 	void *buf;
-	loff_t i;
+	loff_t i, io_size = si->io_size;
+	int fd = si->infd;
 
 	for (i = 0; i < iocb_list_len; ++i) {
-		if ((iocb_ptr = malloc(sizeof(struct iocb))) == NULL) {
-			ERR_SYS("malloc(%d) error", sizeof(struct iocb));
-		}
-		if (posix_memalign(&buf, PAGE_SIZE, io_size) != 0) {
-			ERR_QUIT("posix_memalign(align_size='%d', io_size='%d') error", PAGE_SIZE, io_size);
+		if ((iocb_ptr = bufpool_get(si->iocb_pool)) == NULL || (buf = bufpool_get(si->buf_pool)) == NULL) {
+			ERR_QUIT("buffer pool exhausted, [%ld] of [%d] iocbs prepared", i, iocb_list_len);
 		}
 		io_prep_pread(iocb_ptr, fd, buf, io_size, offset+i*io_size);
 		io_set_callback(iocb_ptr, cb);
@@ -52,153 +101,469 @@ void libaio_read_prepare(int fd, struct iocb **iocb_list, int iocb_list_len, lof
 	}
 }
 
-void file_sharding_aio_copy(void *arg)
+/*
+ * libaio engine: copy the first io_blocks io_size blocks of the shard through a
+ * sliding window of si->queue_depth iocbs and buffers. A completed read is
+ * turned into the write of the same buffer, a completed write into the read
+ * of the next block, so memory stays at queue_depth * io_size per shard.
+ */
+void libaio_copy(SHARDING_INFO *si, uint64_t io_blocks)
 {
-	SHARDING_INFO	*si = (SHARDING_INFO *)arg;
-	char		*buf;
-	ssize_t		n;
 	int		rfd, wfd;
-	uint64_t	io_blocks, last;
-	uint64_t	curpos, io_size;
-
-	struct io_event	*r_events, *r_event_ptr, *w_events, *w_event_ptr;
-	struct iocb	**r_iocb_list, **w_iocb_list;
-	struct iocb 	*rp, *wp;
-	uint64_t	iocb_list_len;
-	io_context_t	r_ctx, w_ctx;
+	uint64_t	io_size, next, written;
+	struct io_event	*events;
+	struct iocb	**iocb_list, **submit_list;
+	struct iocb 	*iocb;
+	io_context_t	ctx;
+	int		qd, done, nsubmit, j, ret;
+	void		*buf;
+	loff_t		offset;
 
 	rfd = si->infd;
 	wfd = si->outfd;
 	io_size = si->io_size;
+	qd = io_blocks < si->queue_depth ? io_blocks : si->queue_depth;
 
-	io_blocks = si->size / io_size;
-	last = si->size % io_size;	
-	iocb_list_len = io_blocks;	/* prepare libaio iocbs */
-
-	if (iocb_list_len > MAX_IOCB_COUNT) {
-		ERR_QUIT("iocb_list_len[%d] is too big, quit", iocb_list_len);
+	memset(&ctx, 0, sizeof(ctx));
+	if ((ret = io_setup(qd, &ctx)) != 0) {
+		ERR_QUIT("io_setup('%d') error: %s", qd, strerror(-ret));
+	}
+	if ((iocb_list = malloc(sizeof(struct iocb *) * qd)) == NULL
+		|| (submit_list = malloc(sizeof(struct iocb *) * qd)) == NULL) {
+		ERR_SYS("malloc(%d) error", sizeof(struct iocb *) * qd);
+	}
+	if ((events = malloc(sizeof(struct io_event) * qd)) == NULL) {
+		ERR_SYS("malloc() error");
+	}
+	/* the first window: reads of blocks [0, qd) */
+	libaio_read_prepare(si, iocb_list, qd, si->offset, NULL);
+	if ((ret = io_submit(ctx, qd, iocb_list)) != qd) {
+		ERR_QUIT("io_submit() error: %s", ret < 0 ? strerror(-ret) : "short submit");
 	}
-	//dbg("start copy: offset[%ld], size[%ld], io_size[%ld] ......", si->offset, si->size, io_size);
-	
-	if (iocb_list_len > 0) {	// libaio engine for PAGE_SIZE aligned data
-		int	alldone, done, j;
-
-		set_fl(rfd, O_DIRECT);
-		set_fl(wfd, O_DIRECT);
-		curpos = si->offset;
 
-		memset(&r_ctx, 0, sizeof(r_ctx));
-		if (io_setup(iocb_list_len, &r_ctx) != 0) {
-			ERR_SYS("io_setup('%d') error", iocb_list_len);
+	next = qd;
+	written = 0;
+	while (written < io_blocks) {
+		if ((done = io_getevents(ctx, 1, qd, events, NULL)) < 1) {
+			ERR_QUIT("io_getevents() error: %s", strerror(-done));
 		}
-		if ((r_iocb_list = malloc(sizeof(struct iocb *) * iocb_list_len)) == NULL) {
-			ERR_SYS("malloc(%d) error", sizeof(struct iocb *));
-		}
-		libaio_read_prepare(rfd, r_iocb_list, iocb_list_len, io_size, curpos, NULL);
-		if (io_submit(r_ctx, iocb_list_len, r_iocb_list) != iocb_list_len) {
-			ERR_SYS("io_submit() error");
+		for (j = 0, nsubmit = 0; j < done; j++) {
+			iocb = events[j].obj;
+			if (events[j].res2 != 0 || events[j].res != iocb->u.c.nbytes) {
+				ERR_QUIT("aio %s at offset[%lld] error: res[%ld]", iocb->aio_lio_opcode == IO_CMD_PREAD ? "pread" : "pwrite",
+					 iocb->u.c.offset, (long)events[j].res);
+			}
+			buf = iocb->u.c.buf;
+			offset = iocb->u.c.offset;
+			if (iocb->aio_lio_opcode == IO_CMD_PREAD) {
+				io_prep_pwrite(iocb, wfd, buf, io_size, offset);
+			}
+			else {
+				written++;
+				if (next >= io_blocks) {
+					continue;
+				}
+				io_prep_pread(iocb, rfd, buf, io_size, si->offset + next * io_size);
+				next++;
+			}
+			io_set_callback(iocb, NULL);
+			submit_list[nsubmit++] = iocb;
 		}
-		r_events = malloc(sizeof(struct io_event) * iocb_list_len);
-		if (r_events == NULL) {
-			ERR_SYS("malloc() error");
+		if (nsubmit > 0 && (ret = io_submit(ctx, nsubmit, submit_list)) != nsubmit) {
+			ERR_QUIT("io_submit() error: %s", ret < 0 ? strerror(-ret) : "short submit");
 		}
+	}
 
-		memset(&w_ctx, 0, sizeof(w_ctx));
-		if (io_setup(iocb_list_len, &w_ctx) != 0) {
-			ERR_SYS("io_setup('%d') error", iocb_list_len);
-		}
-		if ((w_iocb_list = malloc(sizeof(struct iocb *) * iocb_list_len)) == NULL) {
-			ERR_SYS("malloc(%d) error", sizeof(struct iocb *));
-		}
-		w_events = malloc(sizeof(struct io_event) * iocb_list_len);
-		if (w_events == NULL) {
-			ERR_SYS("malloc() error");
+	for (j = 0; j < qd; j++) {
+		bufpool_put(si->buf_pool, iocb_list[j]->u.c.buf);
+		bufpool_put(si->iocb_pool, iocb_list[j]);
+	}
+	free(iocb_list);
+	free(submit_list);
+	free(events);
+	io_destroy(ctx);
+}
+
+#ifdef HAVE_LIBURING
+/* user_data of an sqe: buffer index and direction */
+#define URING_DATA(idx, is_write)	(((uint64_t)(idx) << 1) | (is_write))
+
+typedef struct uring_buf {
+	char	*buf;
+	loff_t	offset;		/* file offset of the block in this buffer */
+	size_t	done;		/* bytes of the block read or written so far */
+} URING_BUF;
+
+/* queue the rest of the read or write of buffer 'idx', fds are the registered files 0 (in) and 1 (out) */
+static void uring_prep(struct io_uring *ring, URING_BUF *ub, int idx, int is_write, size_t io_size, int fixed_bufs)
+{
+	struct io_uring_sqe	*sqe;
+	char			*buf = ub->buf + ub->done;
+
+	if ((sqe = io_uring_get_sqe(ring)) == NULL) {
+		ERR_QUIT("io_uring_get_sqe() error: submission queue full");
+	}
+	if (is_write && fixed_bufs) {
+		io_uring_prep_write_fixed(sqe, 1, buf, io_size - ub->done, ub->offset + ub->done, idx);
+	} else if (is_write) {
+		io_uring_prep_write(sqe, 1, buf, io_size - ub->done, ub->offset + ub->done);
+	} else if (fixed_bufs) {
+		io_uring_prep_read_fixed(sqe, 0, buf, io_size - ub->done, ub->offset + ub->done, idx);
+	} else {
+		io_uring_prep_read(sqe, 0, buf, io_size - ub->done, ub->offset + ub->done);
+	}
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data64(sqe, URING_DATA(idx, is_write));
+}
+
+/*
+ * io_uring engine: copy the first io_blocks io_size blocks of the shard through
+ * si->queue_depth registered buffers, a buffer goes from its read to its write
+ * and back to the next read. Completions are reaped in batches, the SQEs they
+ * queue are submitted with one io_uring_submit(). Returns -1 if the ring can't
+ * be set up, before any I/O, so that the caller falls back to libaio.
+ */
+int uring_copy(SHARDING_INFO *si, uint64_t io_blocks)
+{
+	struct io_uring		ring;
+	struct io_uring_params	params;
+	struct io_uring_cqe	*cqe;
+	struct iovec		*iov;
+	URING_BUF		*ubs, *ub;
+	uint64_t		next, written, data;
+	int			qd, i, ret, files[2], fixed_bufs, is_write;
+	size_t			io_size = si->io_size;
+
+	qd = io_blocks < si->queue_depth ? io_blocks : si->queue_depth;
+	memset(&params, 0, sizeof(params));
+	if (si->sqpoll) {
+		params.flags = IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = URING_SQ_IDLE_MS;
+	}
+	if ((ret = io_uring_queue_init_params(qd, &ring, &params)) < 0 && si->sqpoll) {
+		dbg("io_uring SQPOLL unavailable: %s, without it", strerror(-ret));
+		memset(&params, 0, sizeof(params));
+		ret = io_uring_queue_init_params(qd, &ring, &params);
+	}
+	if (ret < 0) {
+		dbg("io_uring_queue_init() error: %s", strerror(-ret));
+		return -1;
+	}
+	files[0] = si->infd;
+	files[1] = si->outfd;
+	if ((ret = io_uring_register_files(&ring, files, 2)) < 0) {
+		dbg("io_uring_register_files() error: %s", strerror(-ret));
+		io_uring_queue_exit(&ring);
+		return -1;
+	}
+
+	if ((ubs = calloc(qd, sizeof(URING_BUF))) == NULL || (iov = calloc(qd, sizeof(struct iovec))) == NULL) {
+		ERR_SYS("calloc() error");
+	}
+	for (i = 0; i < qd; i++) {
+		if ((ubs[i].buf = bufpool_get(si->buf_pool)) == NULL) {
+			ERR_QUIT("buffer pool exhausted, [%d] of [%d] buffers", i, qd);
 		}
+		iov[i].iov_base = ubs[i].buf;
+		iov[i].iov_len = io_size;
+	}
+	/* registration is pinned memory, it may hit RLIMIT_MEMLOCK: plain buffers then */
+	fixed_bufs = 1;
+	if ((ret = io_uring_register_buffers(&ring, iov, qd)) < 0) {
+		dbg("io_uring_register_buffers() error: %s, unregistered buffers", strerror(-ret));
+		fixed_bufs = 0;
+	}
 
-		alldone = 0;
-		while (1) {
-			if ((done = io_getevents(r_ctx, 1, iocb_list_len - alldone, r_events + alldone, NULL)) < 1) {
-				ERR_SYS("io_getevents() error");
+	for (next = 0; next < qd; next++) {
+		ubs[next].offset = si->offset + next * io_size;
+		uring_prep(&ring, &ubs[next], next, 0, io_size, fixed_bufs);
+	}
+	if ((ret = io_uring_submit(&ring)) < 0) {
+		ERR_QUIT("io_uring_submit() error: %s", strerror(-ret));
+	}
+	written = 0;
+	while (written < io_blocks) {
+		if ((ret = io_uring_wait_cqe(&ring, &cqe)) < 0) {
+			ERR_QUIT("io_uring_wait_cqe() error: %s", strerror(-ret));
+		}
+		do {
+			data = io_uring_cqe_get_data64(cqe);
+			ret = cqe->res;
+			io_uring_cqe_seen(&ring, cqe);
+			i = data >> 1;
+			is_write = data & 1;
+			ub = &ubs[i];
+			if (ret <= 0) {
+				ERR_QUIT("io_uring %s at offset[%ld] error: %s", is_write ? "write" : "read",
+					 ub->offset, ret < 0 ? strerror(-ret) : "unexpected end of file");
 			}
-			for (j=0, r_event_ptr=r_events+alldone; j < done; ++j) {
-				if (r_event_ptr[j].res2 != 0) {
-					ERR_SYS("aio pread error()");
-				}
-				rp = r_event_ptr[j].obj;
-				wp = malloc(sizeof(struct iocb));
-				if (wp == NULL) {
-					ERR_SYS("malloc() error");
-				}
-				io_prep_pwrite(wp, wfd, rp->u.c.buf, rp->u.c.nbytes, rp->u.c.offset);
-				io_set_callback(wp, NULL);
-				w_iocb_list[j+alldone] = wp;
+			ub->done += ret;
+			if (ub->done < io_size) {	/* short read or write, queue the rest */
+				uring_prep(&ring, ub, i, is_write, io_size, fixed_bufs);
+				continue;
 			}
-			if (io_submit(w_ctx, done, w_iocb_list + alldone) != done) {
-				ERR_SYS("io_submit() error");
+			ub->done = 0;
+			if (!is_write) {
+				uring_prep(&ring, ub, i, 1, io_size, fixed_bufs);
 			}
-			//dbg("********************************* alldone:[%d]  done: [%d] ******************************", alldone, done);
-			alldone += done;
-			if (alldone == iocb_list_len) {
-				break;
+			else {
+				written++;
+				if (next < io_blocks) {
+					ub->offset = si->offset + next * io_size;
+					uring_prep(&ring, ub, i, 0, io_size, fixed_bufs);
+					next++;
+				}
 			}
+		} while (io_uring_peek_cqe(&ring, &cqe) == 0);
+		if ((ret = io_uring_submit(&ring)) < 0) {
+			ERR_QUIT("io_uring_submit() error: %s", strerror(-ret));
 		}
+	}
 
-		alldone = 0;
-		while (1) {
-			if ((done = io_getevents(w_ctx, 1, iocb_list_len - alldone, w_events + alldone, NULL)) < 1) {
-				ERR_SYS("io_getevents() error");
-			}
-			for (j=0, w_event_ptr=w_events+alldone; j < done; ++j) {
-				if (w_event_ptr[j].res2 != 0) {
-					ERR_SYS("aio pwrite error()");
+	if (fixed_bufs) {
+		io_uring_unregister_buffers(&ring);
+	}
+	io_uring_unregister_files(&ring);
+	io_uring_queue_exit(&ring);
+	for (i = 0; i < qd; i++) {
+		bufpool_put(si->buf_pool, ubs[i].buf);
+	}
+	free(ubs);
+	free(iov);
+	return 0;
+}
+#endif
+
+/* not supported between these two files, don't try again */
+static int copy_errno_unsupported(int err)
+{
+	return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV || err == EINVAL || err == ENOSYS || err == EBADF;
+}
+
+/*
+ * Copy paths found unsupported, shared by all copy workers: they're only
+ * accessed atomically. Workers racing on the first shards may each probe
+ * once more, which is harmless.
+ */
+static int	clone_broken = 0, cfr_broken = 0;
+#ifdef HAVE_LIBURING
+static int	uring_broken = 0;
+#endif
+
+/*
+ * Copy the whole shard in the kernel: share its extents with FICLONERANGE
+ * (XFS, btrfs, ...), else copy_file_range. Returns the COPY_PATH_* used, -1
+ * if neither works for these files and nothing was copied, so that the caller
+ * moves the data itself. Support is detected on the first shard.
+ */
+int kernel_copy(SHARDING_INFO *si)
+{
+	struct file_clone_range	fcr;
+	loff_t			in_off, out_off;
+	size_t			left;
+	ssize_t			n;
+
+	if (!__atomic_load_n(&clone_broken, __ATOMIC_RELAXED)) {
+		fcr.src_fd = si->infd;
+		fcr.src_offset = si->offset;
+		fcr.src_length = si->size;
+		fcr.dest_offset = si->offset;
+		if (ioctl(si->outfd, FICLONERANGE, &fcr) == 0) {
+			return COPY_PATH_CLONE;
+		}
+		if (!copy_errno_unsupported(errno)) {
+			ERR_SYS("ioctl(FICLONERANGE) at offset[%ld] error", si->offset);
+		}
+		DBG("FICLONERANGE unsupported: %s", strerror(errno));
+		__atomic_store_n(&clone_broken, 1, __ATOMIC_RELAXED);
+	}
+	if (!__atomic_load_n(&cfr_broken, __ATOMIC_RELAXED)) {
+		in_off = out_off = si->offset;
+		for (left = si->size; left > 0; left -= n) {
+			if ((n = copy_file_range(si->infd, &in_off, si->outfd, &out_off, left, 0)) < 0) {
+				if (left == si->size && copy_errno_unsupported(errno)) {
+					break;
 				}
+				ERR_SYS("copy_file_range() at offset[%ld] error", in_off);
 			}
-			alldone += done;
-			if (alldone == iocb_list_len) {
-				break;
+			if (n == 0) {
+				ERR_QUIT("copy_file_range() at offset[%ld]: unexpected end of file", in_off);
 			}
-		}	
-		for (j = 0; j < iocb_list_len; j++) {
-			io_callback_t cb  = (io_callback_t)w_events[j].data;
-			wp = w_events[j].obj;
-			if (cb) {
-				cb(w_ctx, wp, w_events[j].res, w_events[j].res2);
+		}
+		if (left == 0) {
+			return COPY_PATH_CFR;
+		}
+		DBG("copy_file_range unsupported: %s", strerror(errno));
+		__atomic_store_n(&cfr_broken, 1, __ATOMIC_RELAXED);
+	}
+	return -1;
+}
+
+/* copy [si->offset, si->offset + si->size), the offset is page aligned */
+void copy_extent(SHARDING_INFO *si)
+{
+	char		*buf;
+	ssize_t		n;
+	int		rfd, wfd;
+	uint64_t	io_blocks, last;
+	uint64_t	curpos, io_size;
+	uint64_t	iocb_list_len;	/* io_size blocks copied by the aio engine */
+
+	rfd = si->infd;
+	wfd = si->outfd;
+	io_size = si->io_size;
+
+	io_blocks = si->size / io_size;
+	last = si->size % io_size;	
+	iocb_list_len = io_blocks;
+	//dbg("start copy: offset[%ld], size[%ld], io_size[%ld] ......", si->offset, si->size, io_size);
+
+	if (si->kernel_copy) {
+		clear_fl(rfd, O_DIRECT);
+		clear_fl(wfd, O_DIRECT);
+		if ((si->path = kernel_copy(si)) >= 0) {
+			return;
+		}
+	}
+	
+	si->path = iocb_list_len > 0 ? COPY_PATH_LIBAIO : COPY_PATH_BUFFERED;
+	if (iocb_list_len > 0) {	// aio engine for PAGE_SIZE aligned data
+		set_fl(rfd, O_DIRECT);
+		set_fl(wfd, O_DIRECT);
+#ifdef HAVE_LIBURING
+		if (si->engine == ENGINE_URING && !__atomic_load_n(&uring_broken, __ATOMIC_RELAXED)) {
+			if (uring_copy(si, iocb_list_len) == 0) {
+				iocb_list_len = 0;
+				si->path = COPY_PATH_URING;
+			}
+			else {
+				dbg("io_uring unavailable, fall back to libaio");
+				__atomic_store_n(&uring_broken, 1, __ATOMIC_RELAXED);
 			}
-			free(wp->u.c.buf);
 		}
-		for (j = 0; j < iocb_list_len; j++) {
-			free(r_iocb_list[j]);
-			free(w_iocb_list[j]);
+#endif
+		if (iocb_list_len > 0) {
+			libaio_copy(si, iocb_list_len);
 		}
-		free(r_iocb_list);
-		free(w_iocb_list);
-		free(r_events);
-		free(w_events);
-		io_destroy(r_ctx);
-		io_destroy(w_ctx);
+		iocb_list_len = io_blocks;
 	}
 
 	if (last > 0) { /* the last no-memaligned must be use Buffer IO */
 		dbg("enter the last no-memaligned copy");
-		buf = malloc(io_size);
+		buf = bufpool_get(si->buf_pool);
 		if (NULL == buf) {
-			ERR_SYS("malloc(%d) error", io_size);
+			ERR_QUIT("buffer pool exhausted");
 		}
 		curpos = si->offset + io_size * iocb_list_len;
 		clear_fl(rfd, O_DIRECT);
 		clear_fl(wfd, O_DIRECT);
-		n = preadn(rfd, buf, io_size, curpos);
+		n = preadn(rfd, buf, last, curpos);
 		if (n < 0) {
 			ERR_SYS("preadn() error");
 		}
 		if (pwriten(wfd, buf, n, curpos) < 0) {
 			ERR_SYS("pwriten() error");
 		}
-		free(buf);
+		bufpool_put(si->buf_pool, buf);
 	}
 	//dbg("finish copy: offset[%ld], size[%ld], io_size[%ld] ......", si->offset, si->size, io_size);
 }
 
+/*
+ * Copy one shard. Of a sparse source only the data extents found with
+ * SEEK_DATA/SEEK_HOLE are copied, the holes stay holes in the destination
+ * that main() has already extended to the source size.
+ */
+void file_sharding_aio_copy(void *arg)
+{
+	SHARDING_INFO	*si = (SHARDING_INFO *)arg;
+	SHARDING_INFO	ext;
+	loff_t		data, hole, end;
+
+	if (!si->sparse) {
+		copy_extent(si);
+		si->data_size = si->size;
+		return;
+	}
+	si->path = COPY_PATH_HOLE;
+	si->data_size = 0;
+	ext = *si;
+	end = si->offset + si->size;
+	for (data = si->offset; data < end; data = hole) {
+		if ((data = lseek(si->infd, data, SEEK_DATA)) < 0) {
+			if (errno == ENXIO) {	/* holes up to the end of the file */
+				break;
+			}
+			ERR_SYS("lseek(SEEK_DATA) error");
+		}
+		if (data >= end) {
+			break;
+		}
+		if ((hole = lseek(si->infd, data, SEEK_HOLE)) < 0) {
+			ERR_SYS("lseek(SEEK_HOLE) error");
+		}
+		if (hole > end) {
+			hole = end;
+		}
+		/* extents start on a filesystem block, O_DIRECT wants a page */
+		ext.offset = data & ~((loff_t)PAGE_SIZE - 1);
+		ext.size = hole - ext.offset;
+		copy_extent(&ext);
+		si->path = ext.path;
+		si->data_size += ext.size;
+	}
+}
+
+/* next shard to copy, NULL when all are taken */
+SHARDING_INFO *shard_queue_pop(SHARD_QUEUE *sq)
+{
+	SHARDING_INFO	*si = NULL;
+
+	pthread_mutex_lock(&sq->lock);
+	if (sq->next < sq->count) {
+		si = &sq->sinfo[sq->next++];
+	}
+	pthread_mutex_unlock(&sq->lock);
+	return si;
+}
+
+/*
+ * Copy worker: shards are pulled from the queue until it is empty. Each worker
+ * opens its own src/dst descriptors, O_DIRECT is toggled per open file and
+ * must not change under another worker's I/O, and each shard copy sets up its
+ * own aio context or ring.
+ */
+void *copy_worker(void *arg)
+{
+	COPY_WORKER_INFO	*wi = (COPY_WORKER_INFO *)arg;
+	SHARD_QUEUE		*sq = wi->queue;
+	SHARDING_INFO		*si;
+	int			infd, outfd;
+
+	if ((infd = open(wi->src, O_RDONLY)) < 0) {
+		ERR_SYS("open('%s') error", wi->src);
+	}
+	if ((outfd = open(wi->dst, O_WRONLY)) < 0) {
+		ERR_SYS("open('%s') error", wi->dst);
+	}
+	while ((si = shard_queue_pop(sq)) != NULL) {
+		si->infd = infd;
+		si->outfd = outfd;
+		file_sharding_aio_copy(si);
+		wi->shards++;
+
+		pthread_mutex_lock(&sq->lock);
+		sq->total_copy += si->size;
+		sq->total_data += si->data_size;
+		dbg("worker[%d] sharding: [%ld] by [%s], copied: [%.2f MB] ---  [%2.2f%%]", wi->index, si - sq->sinfo,
+		    copy_path_name[si->path], (sq->total_copy*1.0)/(1024*1024), sq->total_copy*100.0/sq->file_size);
+		pthread_mutex_unlock(&sq->lock);
+	}
+	close(infd);
+	close(outfd);
+	return NULL;
+}
+
 void copy_file_attribute(char *src, char *dst)
 {
 	struct stat	s_st, d_st;
@@ -245,30 +610,85 @@ int main(int argc, char **argv)
 	int64_t		cmd_io_size, io_size, sharding_size;
 	int		opt;
 	int		keep_attr;
+	int		engine, sqpoll, queue_depth, pool_flags, nr_workers, kernel_copy, sparse;
+	SHARD_QUEUE	shard_queue;
+	COPY_WORKER_INFO	*winfo;
+	pthread_t	*ptid;
+	BUF_POOL	*buf_pool, *iocb_pool;
 	char		src[NAME_MAX], dst[NAME_MAX];
 	struct timeval	tv_begin, tv_end;
 	time_t		time_elapsed;
 
 	cmd_io_size = DEFAULT_IO_SIZE / 1024;
 	keep_attr = 0;
-	while ((opt = getopt(argc, argv, "i:k")) != -1)
+#ifdef HAVE_LIBURING
+	engine = ENGINE_URING;
+#else
+	engine = ENGINE_LIBAIO;
+#endif
+	sqpoll = 0;
+	queue_depth = QUEUE_DEPTH_DEFAULT;
+	pool_flags = 0;
+	nr_workers = 1;
+	kernel_copy = 1;
+	sparse = 0;
+	sharding_size = SHARDING_SIZE;
+	while ((opt = getopt(argc, argv, "e:Hi:knq:St:z:")) != -1)
         {
                 switch (opt)
                 {
+                        case 'e':
+				if (strcmp(optarg, "aio") == 0) {
+					engine = ENGINE_LIBAIO;
+				} else if (strcmp(optarg, "uring") == 0) {
+#ifndef HAVE_LIBURING
+					err_msg("built without liburing, io_uring engine unavailable, use libaio");
+#endif
+					engine = ENGINE_URING;
+				} else {
+					err_quit("invalid parameters: engine['%s'] must be aio or uring", optarg);
+				}
+				break;
+                        case 'H':
+				pool_flags |= BUFPOOL_HUGEPAGE;
+				break;
                         case 'i':
 				cmd_io_size = strtoul(optarg, NULL, 10);
 				break;
                         case 'k':
                                	keep_attr = 1;	
                                 break;
+                        case 'n':
+				kernel_copy = 0;
+				break;
+                        case 'q':
+				queue_depth = strtoul(optarg, NULL, 10);
+				if (queue_depth < 1 || queue_depth > QUEUE_DEPTH_MAX) {
+					err_quit("invalid parameters: queue_depth[%s] must be in [1, %d]", optarg, QUEUE_DEPTH_MAX);
+				}
+				break;
+                        case 'S':
+                                sqpoll = 1;
+                                break;
+                        case 't':
+				nr_workers = strtoul(optarg, NULL, 10);
+				if (nr_workers < 1 || nr_workers > MAX_WORKERS) {
+					err_quit("invalid parameters: workers[%s] must be in [1, %d]", optarg, MAX_WORKERS);
+				}
+				break;
+                        case 'z':
+				sharding_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+				if (sharding_size <= 0) {
+					err_quit("invalid parameters: sharding_size[%s] must be > 0", optarg);
+				}
+				break;
                         default:
-				err_quit("USAGE: %s [-i io_size(KB)] [-k] <src_file> <dst_file>", argv[0]);
+				err_quit("USAGE: %s [-t workers] [-z sharding_size(MB)] [-n] [-e aio|uring] [-S] [-q queue_depth] [-H] [-i io_size(KB)] [-k] <src_file> <dst_file>", argv[0]);
                 }
         }
 
 	/* transfer into KB(for io_size) and  MB(for sharding sharding_size) */
 	io_size = cmd_io_size * 1024;
-	sharding_size = SHARDING_SIZE;
 	if (io_size > MAX_IO_SIZE) {
 		dbg("cmdline io_size[%d KB] is great than [%d KB], set it to [%d KB]", cmd_io_size, MAX_IO_SIZE/1024, MAX_IO_SIZE/1024);
 		io_size = MAX_IO_SIZE;
@@ -278,7 +698,7 @@ int main(int argc, char **argv)
 	}
 
 	if (argc - optind != 2) {
-		err_quit("USAGE: %s [-i io_size(KB)] [-k] <src_file> <dst_file>", argv[0]);
+		err_quit("USAGE: %s [-t workers] [-z sharding_size(MB)] [-n] [-e aio|uring] [-S] [-q queue_depth] [-H] [-i io_size(KB)] [-k] <src_file> <dst_file>", argv[0]);
 	}
 	strncpy(src, argv[optind], sizeof(src));
 	strncpy(dst, argv[optind+1], sizeof(dst));
@@ -333,6 +753,13 @@ int main(int argc, char **argv)
 	if (ftruncate(outfd, 0) < 0) {
 		ERR_SYS("ftruncate() error");
 	}
+	/* fewer blocks than bytes: the source has holes, recreate them by sizing the destination first */
+	if (src_st.st_blocks * 512 < src_st.st_size) {
+		sparse = 1;
+		if (ftruncate(outfd, src_st.st_size) < 0) {
+			ERR_SYS("ftruncate() error");
+		}
+	}
 
 	file_size = src_st.st_size;
 	file_shardings = file_size / sharding_size;
@@ -346,6 +773,14 @@ int main(int argc, char **argv)
 		sinfo_counts = file_shardings;
 	}
 
+	if (nr_workers > sinfo_counts) {
+		nr_workers = sinfo_counts > 0 ? sinfo_counts : 1;
+	}
+	dbg("workers[%d], queue_depth[%d], aio memory: [%lld MB]", nr_workers, queue_depth, nr_workers * queue_depth * io_size / (1024 * 1024));
+	/* all I/O buffers and iocbs of the copy, allocated once, queue_depth per worker */
+	buf_pool = bufpool_create(io_size, PAGE_SIZE, nr_workers * queue_depth, pool_flags);
+	iocb_pool = bufpool_create(sizeof(struct iocb), 64, nr_workers * queue_depth, 0);
+
 	sinfo = malloc(sinfo_counts * sizeof(SHARDING_INFO));
 	if (sinfo == NULL) {
 		ERR_SYS("sinfo malloc() error");
@@ -358,6 +793,13 @@ int main(int argc, char **argv)
 		sinfo[i].offset = sharding_size * i;
 		sinfo[i].size = sharding_size;
 		sinfo[i].io_size = io_size;
+		sinfo[i].engine = engine;
+		sinfo[i].sqpoll = sqpoll;
+		sinfo[i].queue_depth = queue_depth;
+		sinfo[i].kernel_copy = kernel_copy;
+		sinfo[i].sparse = sparse;
+		sinfo[i].buf_pool = buf_pool;
+		sinfo[i].iocb_pool = iocb_pool;
 		if ((i == (sinfo_counts - 1)) && (file_lastsharding > 0)) {	// the last sharding less than the sharding_size 
 				sinfo[i].size = file_lastsharding;
 		}
@@ -366,12 +808,31 @@ int main(int argc, char **argv)
 	if (gettimeofday(&tv_begin, NULL) < 0) {
 		ERR_SYS("gettimeofday() error");
 	}
-	total_copy = 0;
-	for (i = 0; i < sinfo_counts; i++) {
-		file_sharding_aio_copy(&sinfo[i]);
-		total_copy += sinfo[i].size;
-		dbg("sharding: [%d], copied: [%.2f MB] ---  [%2.2f%%]", i, (total_copy*1.0)/(1024*1024), total_copy*100.0/file_size);
-	}	
+	memset(&shard_queue, 0, sizeof(shard_queue));
+	pthread_mutex_init(&shard_queue.lock, NULL);
+	shard_queue.count = sinfo_counts;
+	shard_queue.sinfo = sinfo;
+	shard_queue.file_size = file_size;
+	if ((winfo = calloc(nr_workers, sizeof(COPY_WORKER_INFO))) == NULL || (ptid = calloc(nr_workers, sizeof(pthread_t))) == NULL) {
+		ERR_SYS("calloc() error");
+	}
+	for (i = 0; i < nr_workers; i++) {
+		winfo[i].index = i;
+		winfo[i].src = src;
+		winfo[i].dst = dst;
+		winfo[i].queue = &shard_queue;
+		if (pthread_create(&ptid[i], NULL, copy_worker, &winfo[i]) != 0) {
+			ERR_QUIT("pthread_create() error");
+		}
+	}
+	for (i = 0; i < nr_workers; i++) {
+		pthread_join(ptid[i], NULL);
+		DBG("worker[%d]: shards[%d]", i, winfo[i].shards);
+	}
+	total_copy = shard_queue.total_copy;
+	pthread_mutex_destroy(&shard_queue.lock);
+	free(winfo);
+	free(ptid);
 	if (gettimeofday(&tv_end, NULL) < 0) {
 		ERR_SYS("gettimeofday() error");
 	}
@@ -380,7 +841,12 @@ int main(int argc, char **argv)
 		time_elapsed = 1;
 	}
 	dbg("Total copied: [%lld bytes], elapsed: [%lld secs],  Speed: [%.2f MB/s]", total_copy, time_elapsed, (total_copy*1.0)/(1024.0*1024.0)/(time_elapsed*1.0));
+	if (sparse) {
+		dbg("sparse source: [%lld bytes] of data extents copied", shard_queue.total_data);
+	}
 	free(sinfo);
+	bufpool_destroy(buf_pool);
+	bufpool_destroy(iocb_pool);
 	close(infd);
 	close(outfd);
 
@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "error.h"
+#include "bufpool.h"
+
+#define HUGEPAGE_SIZE	(2 * 1024 * 1024)
+
+/*
+ * Cache slot of the calling thread, -1 until its first pool call. The slot of
+ * an exited thread, with the buffers left in its caches, goes to the next new
+ * thread: only BUFPOOL_MAX_THREADS threads alive at once are a limit.
+ */
+static __thread int	bufpool_tid = -1;
+static int		bufpool_next_tid = 0;
+static int		bufpool_free_tids[BUFPOOL_MAX_THREADS];
+static int		bufpool_nr_free_tids = 0;
+static int		bufpool_tid_warned = 0;
+static pthread_mutex_t	bufpool_tid_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	bufpool_tid_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	bufpool_tid_key;
+
+/* thread exit, 'arg' is its slot + 1 */
+static void bufpool_tid_release(void *arg)
+{
+	pthread_mutex_lock(&bufpool_tid_lock);
+	bufpool_free_tids[bufpool_nr_free_tids++] = (int)(intptr_t)arg - 1;
+	pthread_mutex_unlock(&bufpool_tid_lock);
+}
+
+static void bufpool_tid_key_create(void)
+{
+	if (pthread_key_create(&bufpool_tid_key, bufpool_tid_release) != 0) {
+		ERR_SYS("pthread_key_create() error");
+	}
+}
+
+/* a free slot, or BUFPOOL_MAX_THREADS if all are taken: the thread then always uses the shared list */
+static int bufpool_tid_get(void)
+{
+	int	tid = BUFPOOL_MAX_THREADS;
+
+	pthread_once(&bufpool_tid_once, bufpool_tid_key_create);
+	pthread_mutex_lock(&bufpool_tid_lock);
+	if (bufpool_nr_free_tids > 0) {
+		tid = bufpool_free_tids[--bufpool_nr_free_tids];
+	}
+	else if (bufpool_next_tid < BUFPOOL_MAX_THREADS) {
+		tid = bufpool_next_tid++;
+	}
+	else if (!bufpool_tid_warned) {
+		bufpool_tid_warned = 1;
+		ERR_MSG("more than %d threads use buffer pools, the others have no cache", BUFPOOL_MAX_THREADS);
+	}
+	pthread_mutex_unlock(&bufpool_tid_lock);
+	if (tid < BUFPOOL_MAX_THREADS) {
+		pthread_setspecific(bufpool_tid_key, (void *)(intptr_t)(tid + 1));
+	}
+	return tid;
+}
+
+static BUFPOOL_CACHE *bufpool_cache(BUF_POOL *pool)
+{
+	if (bufpool_tid < 0) {
+		bufpool_tid = bufpool_tid_get();
+	}
+	if (bufpool_tid >= BUFPOOL_MAX_THREADS) {
+		return NULL;
+	}
+	return &pool->caches[bufpool_tid];
+}
+
+/*
+ * Create a pool of nr_bufs buffers of buf_size bytes, each aligned on 'align'
+ * (a power of 2, at least a page is used for buffers of a page or more). All
+ * buffers come from one mapping made here, so memory use is fixed for the
+ * life of the pool. BUFPOOL_HUGEPAGE tries MAP_HUGETLB first, then asks for
+ * transparent huge pages. BUFPOOL_POPULATE faults the pool in here, so that
+ * first touch places it on the NUMA node of the creating thread.
+ */
+BUF_POOL *bufpool_create(size_t buf_size, size_t align, int nr_bufs, int flags)
+{
+	BUF_POOL	*pool;
+	size_t		page_size = sysconf(_SC_PAGESIZE);
+	int		i, populate;
+
+	if (align < sizeof(void *)) {
+		align = sizeof(void *);
+	}
+	if (buf_size >= page_size && align < page_size) {
+		align = page_size;
+	}
+	if ((pool = calloc(1, sizeof(BUF_POOL))) == NULL) {
+		ERR_SYS("calloc() error");
+	}
+	pool->buf_size = (buf_size + align - 1) & ~(align - 1);
+	pool->nr_bufs = nr_bufs;
+	pool->map_size = (pool->buf_size * nr_bufs + page_size - 1) & ~(page_size - 1);
+
+	populate = flags & BUFPOOL_POPULATE ? MAP_POPULATE : 0;
+	pool->base = MAP_FAILED;
+	if (flags & BUFPOOL_HUGEPAGE) {
+		size_t	huge_size = (pool->map_size + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+
+		pool->base = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+		if (pool->base != MAP_FAILED) {
+			pool->map_size = huge_size;
+		} else {
+			DBG("mmap(MAP_HUGETLB, %ld) error, transparent huge pages", huge_size);
+		}
+	}
+	if (pool->base == MAP_FAILED) {
+		pool->base = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+		if (pool->base == MAP_FAILED) {
+			ERR_SYS("mmap(%ld) error", pool->map_size);
+		}
+		if (flags & BUFPOOL_HUGEPAGE) {
+			madvise(pool->base, pool->map_size, MADV_HUGEPAGE);
+		}
+	}
+
+	if ((pool->free_list = malloc(nr_bufs * sizeof(void *))) == NULL
+		|| (pool->caches = calloc(BUFPOOL_MAX_THREADS, sizeof(BUFPOOL_CACHE))) == NULL) {
+		ERR_SYS("malloc() error");
+	}
+	/* lowest addresses on top, handed out first */
+	for (i = 0; i < nr_bufs; i++) {
+		pool->free_list[i] = (char *)pool->base + (size_t)(nr_bufs - 1 - i) * pool->buf_size;
+	}
+	pool->nr_free = nr_bufs;
+	pthread_mutex_init(&pool->lock, NULL);
+	return pool;
+}
+
+/* a free buffer, from the calling thread's cache if it has one, NULL if the pool is exhausted */
+void *bufpool_get(BUF_POOL *pool)
+{
+	BUFPOOL_CACHE	*cache = bufpool_cache(pool);
+	void		*buf = NULL;
+
+	if (cache != NULL && cache->count > 0) {
+		return cache->bufs[--cache->count];
+	}
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nr_free > 0) {
+		buf = pool->free_list[--pool->nr_free];
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return buf;
+}
+
+/*
+ * Return a buffer, into the calling thread's cache while it has room. A
+ * thread's cached plus used buffers never exceed its own peak use, so a pool
+ * sized for the peak of every thread can't run dry.
+ */
+void bufpool_put(BUF_POOL *pool, void *buf)
+{
+	BUFPOOL_CACHE	*cache = bufpool_cache(pool);
+
+	if (buf == NULL) {
+		return;
+	}
+	if (cache != NULL && cache->count < BUFPOOL_CACHE_SIZE) {
+		cache->bufs[cache->count++] = buf;
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->free_list[pool->nr_free++] = buf;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* all buffers go away with the pool, whether they were put back or not */
+void bufpool_destroy(BUF_POOL *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+	munmap(pool->base, pool->map_size);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->free_list);
+	free(pool->caches);
+	free(pool);
+}
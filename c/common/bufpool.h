@@ -0,0 +1,36 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define BUFPOOL_HUGEPAGE	0x1	/* back the pool with huge pages when possible */
+#define BUFPOOL_POPULATE	0x2	/* fault all pages in at create, on the node of the calling thread */
+
+#define BUFPOOL_MAX_THREADS	256	/* live threads with a private cache, others use the shared list */
+#define BUFPOOL_CACHE_SIZE	16	/* buffers kept per thread */
+
+typedef struct bufpool_cache {
+	int	count;
+	void	*bufs[BUFPOOL_CACHE_SIZE];
+} BUFPOOL_CACHE;
+
+/* fixed number of fixed size buffers carved out of one mapping */
+typedef struct bufpool {
+	size_t		buf_size;	/* rounded up to the alignment */
+	int		nr_bufs;
+	void		*base;
+	size_t		map_size;
+
+	pthread_mutex_t	lock;		/* protects the shared free list */
+	int		nr_free;
+	void		**free_list;
+	BUFPOOL_CACHE	*caches;	/* BUFPOOL_MAX_THREADS per-thread caches, no lock */
+} BUF_POOL;
+
+BUF_POOL	*bufpool_create(size_t buf_size, size_t align, int nr_bufs, int flags);
+void		*bufpool_get(BUF_POOL *pool);
+void		bufpool_put(BUF_POOL *pool, void *buf);
+void		bufpool_destroy(BUF_POOL *pool);
+
+#endif
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
 #include "error.h"
 #include "common.h"
 
@@ -104,6 +107,56 @@ ssize_t pwriten(int fd, const void *ptr, size_t n, loff_t offset)
 	return (n - nleft);	/* return >= 0 */
 }
 
+/* bounce buffer of copy_rangen() when the kernel can't copy between the two files */
+#define COPY_BUF_SIZE	(1024 * 1024)
+
+/* Copy "n" bytes between two descriptors at the given offsets, in the kernel when possible */
+ssize_t copy_rangen(int infd, loff_t in_off, int outfd, loff_t out_off, size_t n)
+{
+	size_t nleft, len;
+	ssize_t ncopied;
+	char	*buf;
+
+	nleft = n;
+	while (nleft > 0) {
+		if ((ncopied = copy_file_range(infd, &in_off, outfd, &out_off, nleft, 0)) < 0) {
+			if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+				break;	/* not supported here, fall back to read/write */
+			if (nleft == n)
+				return (-1);	/* error, return -1 */
+			else
+				return (n - nleft);	/* error, return amount copied so far */
+		}
+		else if (ncopied == 0) {
+			return (n - nleft);	/* EOF */
+		}
+		nleft -= ncopied;
+	}
+	if (nleft == 0) {
+		return (n);
+	}
+
+	if ((buf = malloc(COPY_BUF_SIZE)) == NULL) {
+		return (n == nleft ? -1 : n - nleft);
+	}
+	while (nleft > 0) {
+		len = nleft < COPY_BUF_SIZE ? nleft : COPY_BUF_SIZE;
+		if ((ncopied = preadn(infd, buf, len, in_off)) <= 0) {
+			break;
+		}
+		if (pwriten(outfd, buf, ncopied, out_off) != ncopied) {
+			break;
+		}
+		nleft -= ncopied;
+		in_off += ncopied;
+		out_off += ncopied;
+	}
+	free(buf);
+	if (nleft == n && n > 0)
+		return (-1);
+	return (n - nleft);	/* return >= 0 */
+}
+
 int get_fl(int fd)
 {
 	int val;
@@ -5,6 +5,7 @@ ssize_t readn(int fd, void *ptr, size_t n);
 ssize_t writen(int fd, const void *ptr, size_t n);
 ssize_t preadn(int fd, void *ptr, size_t n, loff_t offset);
 ssize_t pwriten(int fd, const void *ptr, size_t n, loff_t offset);
+ssize_t copy_rangen(int infd, loff_t in_off, int outfd, loff_t out_off, size_t n);
 int	get_fl(int fd);
 void	set_fl(int fd, int flags);
 void	clear_fl(int fd, int flags);
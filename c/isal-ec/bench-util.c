@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <isa-l.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "error.h"
+#include "bench-util.h"
+
+char	isal_version[32];
+char	cpu_model[128];
+
+uint64_t now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* TSC, 0 where there is none: cycles per byte is then reported as 0 */
+uint64_t now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* "4,6,10" into vals, return the count */
+int parse_list(const char *arg, int *vals, char opt)
+{
+	const char	*s = arg;
+	char		*end;
+	int		n = 0;
+
+	while (*s != '\0') {
+		if (n == BENCH_MAX_LIST) {
+			err_quit("invalid parameters: more than %d values for '-%c'", BENCH_MAX_LIST, opt);
+		}
+		vals[n] = strtol(s, &end, 10);
+		if (end == s || (*end != ',' && *end != '\0') || vals[n] < 0) {
+			err_quit("invalid parameters: '-%c %s' must be a list like 4,6,10", opt, arg);
+		}
+		n++;
+		s = *end == ',' ? end + 1 : end;
+	}
+	return n;
+}
+
+/* isa-l version and cpu model, to tag results across releases and machines */
+void bench_env_init(void)
+{
+	FILE	*fp;
+	char	line[256], *s;
+
+#ifdef ISAL_MAJOR_VERSION
+	snprintf(isal_version, sizeof(isal_version), "%d.%d.%d", ISAL_MAJOR_VERSION, ISAL_MINOR_VERSION, ISAL_PATCH_VERSION);
+#else
+	snprintf(isal_version, sizeof(isal_version), "unknown");
+#endif
+	snprintf(cpu_model, sizeof(cpu_model), "unknown");
+	if ((fp = fopen("/proc/cpuinfo", "r")) == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "model name", 10) == 0 && (s = strchr(line, ':')) != NULL) {
+			for (s++; *s == ' '; s++)
+				;
+			s[strcspn(s, "\n\"")] = '\0';
+			snprintf(cpu_model, sizeof(cpu_model), "%s", s);
+			break;
+		}
+	}
+	fclose(fp);
+}
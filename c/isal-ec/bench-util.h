@@ -0,0 +1,16 @@
+#ifndef __BENCH_UTIL_H__
+#define __BENCH_UTIL_H__
+
+#include <stdint.h>
+
+#define BENCH_MAX_LIST		32	/* values of a '-x 1,2,3' list option */
+
+extern char	isal_version[32];
+extern char	cpu_model[128];
+
+uint64_t	now_ns(void);
+uint64_t	now_cycles(void);
+int	parse_list(const char *arg, int *vals, char opt);
+void	bench_env_init(void);
+
+#endif
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <libaio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <isa-l.h>
+
+#include "common.h"
+#include "error.h"
+#include "bufpool.h"
+#include "ec-table.h"
+#include "ec-frag.h"
+#include "ec-stats.h"
+#include "ec-aio.h"
+
+#define PAGE_SIZE	4096
+
+/* state of a ring slot */
+#define SLOT_FREE	0
+#define SLOT_READING	1	/* k preads in flight */
+#define SLOT_READ	2	/* data in, ready to encode */
+#define SLOT_WRITING	3	/* m pwrites in flight */
+
+/* one stripe buffer of the ring: k data + p parity slices, page aligned for O_DIRECT */
+typedef struct ec_aio_slot {
+	int64_t		stripe;
+	int		state;
+	int		pending;	/* iocbs in flight */
+	uint64_t	submit_ns;	/* ec_stat_now() of the io_submit */
+	int64_t		bytes;		/* of the iocbs in flight */
+	u8		*frag_ptrs[M_K_P_MAX];
+	struct iocb	iocbs[M_K_P_MAX];
+	struct iocb	*iocb_ptrs[M_K_P_MAX];
+} EC_AIO_SLOT;
+
+/* O_DIRECT where the filesystem allows it, buffered aio otherwise */
+static void ec_aio_direct(int fd, int on)
+{
+	int	val;
+
+	if ((val = fcntl(fd, F_GETFL, 0)) < 0) {
+		return;
+	}
+	val = on ? val | O_DIRECT : val & ~O_DIRECT;
+	if (fcntl(fd, F_SETFL, val) < 0) {
+		DBG("fcntl(O_DIRECT) not supported on fd[%d], buffered io", fd);
+	}
+}
+
+/*
+ * Reap at least 'min_nr' events of 'ctx', return the number of slots whose
+ * iocbs all completed. A blocking reap counts as queue wait, io latencies
+ * are counted from the io_submit of their slot.
+ */
+static int ec_aio_reap(io_context_t ctx, struct io_event *events, int min_nr, int max_nr, int is_read, EC_STAT_SET *stats)
+{
+	struct timespec	ts = {0, 0};
+	struct iocb	*iocb;
+	EC_AIO_SLOT	*slot;
+	uint64_t	t;
+	long		res;
+	int		i, n, done;
+
+	t = ec_stat_now();
+	if ((n = io_getevents(ctx, min_nr, max_nr, events, min_nr > 0 ? NULL : &ts)) < 0) {
+		ERR_QUIT("io_getevents() error: %s", strerror(-n));
+	}
+	if (min_nr > 0) {
+		t = ec_stat_add(stats, EC_STAT_QUEUE_WAIT, t, 0);
+	}
+	for (i = 0, done = 0; i < n; i++) {
+		slot = events[i].data;
+		iocb = events[i].obj;
+		res = (long)events[i].res;
+		if (res < 0 || events[i].res2 != 0) {
+			ERR_QUIT("aio %s of stripe[%ld] error: %s", is_read ? "pread" : "pwrite", slot->stripe, strerror(-res));
+		}
+		if (res < iocb->u.c.nbytes) {
+			if (!is_read) {
+				ERR_QUIT("aio pwrite of stripe[%ld] short: %ld of %lu", slot->stripe, res, iocb->u.c.nbytes);
+			}
+			/* end of the origin file: padding for the last stripe */
+			memset((u8 *)iocb->u.c.buf + res, 0, iocb->u.c.nbytes - res);
+		}
+		if (!is_read) {	/* slot iocb i writes fragment i */
+			ec_stat_hist_count(&stats->frag[(iocb - slot->iocbs) * EC_STAT_FRAG_OPS + EC_STAT_FRAG_WRITE],
+					   t - slot->submit_ns, res);
+		}
+		if (--slot->pending == 0) {
+			slot->state = is_read ? SLOT_READ : SLOT_FREE;
+			ec_stat_count(stats, is_read ? EC_STAT_READ : EC_STAT_WRITE, t - slot->submit_ns, slot->bytes);
+			done++;
+		}
+	}
+	return done;
+}
+
+/*
+ * Encode the origin 'fd' into the fragment files 'wfd' as a three stage
+ * pipeline over a ring of 'depth' stripe buffers: async reads of the next
+ * stripes, ec_encode_data of the oldest one read, async slice writes of the
+ * ones encoded before. Fills 'index' like the synchronous encoder, the stripe
+ * index and headers are left to the caller, the stages are counted in
+ * 'stats'. Returns the encode time (us).
+ */
+int64_t ec_aio_encode(int fd, const int *wfd, const EC_FRAG_HDR *hdr, const EC_ENC_TBLS *enc_tbls,
+		      EC_STRIPE_ENTRY *index, int depth, EC_STAT_SET *stats)
+{
+	int		i, k, p, m, su, nreq, direct, writing, ret;
+	int64_t		next_read, nr_filled, nr_encoded, nr_stripes, offset;
+	uint64_t	zero_csum, t;
+	EC_AIO_SLOT	*ring, *slot;
+	BUF_POOL	*pool;
+	EC_STRIPE_ENTRY	*entry;
+	io_context_t	r_ctx, w_ctx;
+	struct io_event	*events;
+
+	k = hdr->k;
+	p = hdr->p;
+	m = k + p;
+	su = hdr->stripe_unit;
+	nr_stripes = hdr->nr_stripes;
+	if (depth < EC_AIO_DEPTH_MIN) {
+		depth = EC_AIO_DEPTH_MIN;
+	}
+	if (depth > nr_stripes) {
+		depth = nr_stripes < EC_AIO_DEPTH_MIN ? EC_AIO_DEPTH_MIN : nr_stripes;
+	}
+
+	if ((ring = calloc(depth, sizeof(EC_AIO_SLOT))) == NULL) {
+		ERR_SYS("calloc() error");
+	}
+	pool = bufpool_create(su, PAGE_SIZE, depth * m, 0);
+	for (slot = ring; slot < ring + depth; slot++) {
+		for (i = 0; i < m; i++) {
+			if ((slot->frag_ptrs[i] = bufpool_get(pool)) == NULL) {
+				ERR_QUIT("buffer pool exhausted");
+			}
+			slot->iocb_ptrs[i] = &slot->iocbs[i];
+		}
+	}
+	if ((events = malloc(depth * m * sizeof(struct io_event))) == NULL) {
+		ERR_SYS("malloc() error");
+	}
+	memset(&r_ctx, 0, sizeof(r_ctx));
+	memset(&w_ctx, 0, sizeof(w_ctx));
+	if ((ret = io_setup(depth * k, &r_ctx)) != 0 || (ret = io_setup(depth * m, &w_ctx)) != 0) {
+		ERR_QUIT("io_setup('%d') error: %s", depth * m, strerror(-ret));
+	}
+
+	/* O_DIRECT needs page aligned slices, the header keeps them aligned if the stripe unit is */
+	direct = su % PAGE_SIZE == 0 && hdr->hdr_size % PAGE_SIZE == 0;
+	if (direct) {
+		ec_aio_direct(fd, 1);
+		for (i = 0; i < m; i++) {
+			ec_aio_direct(wfd[i], 1);
+		}
+	}
+	dbg("aio pipeline: depth[%d], stripe_unit[%d], O_DIRECT[%d]", depth, su, direct);
+
+	/* slots are filled and encoded in order, nr_filled/nr_encoded count them; holes take no slot */
+	writing = 0;
+	next_read = nr_filled = nr_encoded = 0;
+	zero_csum = ec_frag_zero_csum(hdr);
+	while (next_read < nr_stripes || nr_encoded < nr_filled || writing > 0) {
+		/* stage 1: keep every free slot reading the next stripe */
+		while (next_read < nr_stripes && ring[nr_filled % depth].state == SLOT_FREE) {
+			if (ec_stripe_is_hole(fd, hdr, next_read)) {	/* zero parity, nothing to do */
+				ec_frag_sparse_stripe(hdr, index, next_read, zero_csum);
+				next_read++;
+				continue;
+			}
+			slot = &ring[nr_filled % depth];
+			slot->stripe = next_read;
+			for (i = 0, nreq = 0; i < k; i++) {
+				offset = (next_read * k + i) * (int64_t)su;
+				if (offset >= hdr->orig_size) {	/* padding for the last stripe */
+					memset(slot->frag_ptrs[i], 0, su);
+					continue;
+				}
+				io_prep_pread(&slot->iocbs[nreq], fd, slot->frag_ptrs[i], su, offset);
+				slot->iocbs[nreq].data = slot;
+				nreq++;
+			}
+			slot->pending = nreq;
+			slot->bytes = (int64_t)nreq * su;
+			slot->submit_ns = ec_stat_now();
+			slot->state = SLOT_READING;
+			if ((ret = io_submit(r_ctx, nreq, slot->iocb_ptrs)) != nreq) {
+				ERR_QUIT("io_submit() read of stripe[%ld] error: %s", next_read, strerror(-ret));
+			}
+			next_read++;
+			nr_filled++;
+		}
+
+		/* stage 2: encode the oldest stripe read and queue its slices for writing */
+		slot = &ring[nr_encoded % depth];
+		if (nr_encoded < nr_filled && slot->state == SLOT_READ) {
+			t = ec_stat_now();
+			ec_encode_data(su, k, p, (u8 *)enc_tbls->g_tbls, slot->frag_ptrs, &slot->frag_ptrs[k]);
+			ec_stat_add(stats, EC_STAT_COMPUTE, t, (int64_t)k * su);
+			for (i = 0; i < m; i++) {
+				entry = &index[i * nr_stripes + slot->stripe];
+				entry->offset = EC_FRAG_STRIPE_OFFSET(hdr, slot->stripe);
+				entry->csum = ec_frag_csum(hdr, slot->frag_ptrs[i], su);
+				io_prep_pwrite(&slot->iocbs[i], wfd[i], slot->frag_ptrs[i], su, entry->offset);
+				slot->iocbs[i].data = slot;
+			}
+			slot->pending = m;
+			slot->bytes = (int64_t)m * su;
+			slot->submit_ns = ec_stat_now();
+			slot->state = SLOT_WRITING;
+			if ((ret = io_submit(w_ctx, m, slot->iocb_ptrs)) != m) {
+				ERR_QUIT("io_submit() write of stripe[%ld] error: %s", slot->stripe, strerror(-ret));
+			}
+			writing++;
+			nr_encoded++;
+			continue;
+		}
+
+		/* stage 3: wait for the stripe to encode, or for a slot to be written back */
+		if (nr_encoded < nr_filled && slot->state == SLOT_READING) {
+			ec_aio_reap(r_ctx, events, 1, depth * k, 1, stats);
+			writing -= ec_aio_reap(w_ctx, events, 0, depth * m, 0, stats);
+		}
+		else if (writing > 0) {
+			writing -= ec_aio_reap(w_ctx, events, 1, depth * m, 0, stats);
+		}
+	}
+
+	/* the stripe index and headers are written with plain pwrite */
+	if (direct) {
+		ec_aio_direct(fd, 0);
+		for (i = 0; i < m; i++) {
+			ec_aio_direct(wfd[i], 0);
+		}
+	}
+	io_destroy(r_ctx);
+	io_destroy(w_ctx);
+	free(events);
+	bufpool_destroy(pool);
+	free(ring);
+	stats->stripes = nr_encoded;
+	return stats->stage[EC_STAT_COMPUTE].sum_ns / 1000;
+}
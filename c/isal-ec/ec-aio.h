@@ -0,0 +1,16 @@
+#ifndef __EC_AIO_H__
+#define __EC_AIO_H__
+
+#include <stdint.h>
+
+#include "ec-table.h"
+#include "ec-frag.h"
+#include "ec-stats.h"
+
+#define EC_AIO_DEPTH_MIN	3	/* read N+1, encode N, write N-1 */
+#define EC_AIO_DEPTH_DEFAULT	4
+
+int64_t	ec_aio_encode(int fd, const int *wfd, const EC_FRAG_HDR *hdr, const EC_ENC_TBLS *enc_tbls,
+		      EC_STRIPE_ENTRY *index, int depth, EC_STAT_SET *stats);
+
+#endif
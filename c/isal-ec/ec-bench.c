@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <isa-l.h>
+
+#include "common.h"
+#include "error.h"
+#include "bufpool.h"
+#include "ec-table.h"
+#include "bench-util.h"
+
+#define BENCH_MAX_THREADS	1024
+#define BENCH_DATASET_DEFAULT	64	/* MB of origin data per (k, stripe unit) */
+#define BENCH_PASSES_DEFAULT	3
+
+#define OP_ENCODE	0
+#define OP_DECODE	1	/* recover the lost data fragments only */
+#define OP_REPAIR	2	/* regenerate every lost fragment, parity included */
+
+static const char *op_name[] = {"encode", "decode", "repair"};
+
+#define POS_FIRST	0	/* lose fragments 0.., data first */
+#define POS_LAST	1	/* lose fragments ..m-1, parity first */
+#define POS_MIXED	2	/* data from the front and parity from the end, data first */
+#define POS_RANDOM	3	/* seeded, the same patterns every run */
+#define POS_NR		4
+
+static const char *pos_name[POS_NR] = {"first", "last", "mixed", "random"};
+
+/* one measured configuration */
+typedef struct bench_run {
+	int		op;
+	int		k;
+	int		p;
+	int		su;
+	int		threads;
+	int		passes;
+	int64_t		nr_stripes;
+	u8		**slices;	/* in memory dataset: nr_stripes * (k + p) */
+	int		*fds;		/* '-D': fragment files, NULL in memory */
+	u8		*g_tbls;
+	int		rows;		/* outputs of ec_encode_data */
+	const u8	*src_index;	/* fragment of each of the k sources */
+	const u8	*out_index;	/* fragment of each output */
+	pthread_barrier_t	barrier;
+} BENCH_RUN;
+
+typedef struct bench_worker {
+	BENCH_RUN	*run;
+	int64_t		first;		/* stripes [first, first + nr) of the dataset */
+	int64_t		nr;
+	u8		*bufs[M_K_P_MAX];	/* '-D': slices read from the fragment files */
+	u8		*outs[M_K_P_MAX];
+	uint64_t	*lat;		/* ns of each stripe, passes * nr */
+	uint64_t	cycles;
+} BENCH_WORKER;
+
+/* fragment i is source/output i, filled by main() */
+static u8	identity[M_K_P_MAX];
+
+static int	is_csv;
+static int	nr_records;
+static void *bench_worker(void *arg)
+{
+	BENCH_WORKER	*w = (BENCH_WORKER *)arg;
+	BENCH_RUN	*r = w->run;
+	u8		*srcs[M_K_P_MAX];
+	int		i, m, pass;
+	int64_t		s, n;
+	uint64_t	t0, c0;
+
+	m = r->k + r->p;
+	pthread_barrier_wait(&r->barrier);
+	c0 = now_cycles();
+	for (pass = 0, n = 0; pass < r->passes; pass++) {
+		for (s = w->first; s < w->first + w->nr; s++, n++) {
+			t0 = now_ns();
+			for (i = 0; i < r->k; i++) {
+				if (r->fds == NULL) {
+					srcs[i] = r->slices[s * m + r->src_index[i]];
+				} else {
+					srcs[i] = w->bufs[i];
+					if (preadn(r->fds[r->src_index[i]], srcs[i], r->su, s * r->su) != r->su) {
+						ERR_SYS("preadn() error");
+					}
+				}
+			}
+			ec_encode_data(r->su, r->k, r->rows, r->g_tbls, srcs, w->outs);
+			for (i = 0; r->fds != NULL && i < r->rows; i++) {
+				if (pwriten(r->fds[r->out_index[i]], w->outs[i], r->su, s * r->su) != r->su) {
+					ERR_SYS("pwriten() error");
+				}
+			}
+			w->lat[n] = now_ns() - t0;
+		}
+	}
+	w->cycles = now_cycles() - c0;
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t	x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_report(const BENCH_RUN *r, const char *position, const u8 *frag_err_list, int nerrs,
+			 int64_t wall_ns, uint64_t *lat, int64_t nr_lat, uint64_t cycles)
+{
+	static const double	quantiles[] = {0.50, 0.90, 0.99, 0.999, 1.0};
+	double	pct[5], seconds, bytes;
+	int	i;
+
+	qsort(lat, nr_lat, sizeof(uint64_t), cmp_u64);
+	for (i = 0; i < 5; i++) {
+		pct[i] = lat[(int64_t)((nr_lat - 1) * quantiles[i])] / 1000.0;
+	}
+	seconds = wall_ns / 1e9;
+	bytes = (double)r->k * r->su * r->nr_stripes * r->passes;
+
+	if (is_csv) {
+		if (nr_records++ == 0) {
+			printf("isal,cpu,op,medium,k,p,stripe_unit,threads,position,nerrs,erasures,stripes,bytes,seconds,gbps,"
+			       "lat_p50_us,lat_p90_us,lat_p99_us,lat_p999_us,lat_max_us,cycles_per_byte\n");
+		}
+		printf("%s,\"%s\",%s,%s,%d,%d,%d,%d,%s,%d,", isal_version, cpu_model, op_name[r->op],
+		       r->fds ? "disk" : "memory", r->k, r->p, r->su, r->threads, position, nerrs);
+		for (i = 0; i < nerrs; i++) {
+			printf("%s%d", i ? "-" : "", frag_err_list[i]);
+		}
+		printf(",%ld,%.0f,%.6f,%.3f,%.2f,%.2f,%.2f,%.2f,%.2f,%.3f\n", r->nr_stripes * r->passes, bytes, seconds,
+		       bytes / seconds / 1e9, pct[0], pct[1], pct[2], pct[3], pct[4], cycles / bytes);
+	} else {
+		printf("%s    {\"op\": \"%s\", \"medium\": \"%s\", \"k\": %d, \"p\": %d, \"stripe_unit\": %d, \"threads\": %d, "
+		       "\"position\": \"%s\", \"nerrs\": %d, \"erasures\": [", nr_records++ ? ",\n" : "", op_name[r->op],
+		       r->fds ? "disk" : "memory", r->k, r->p, r->su, r->threads, position, nerrs);
+		for (i = 0; i < nerrs; i++) {
+			printf("%s%d", i ? ", " : "", frag_err_list[i]);
+		}
+		printf("], \"stripes\": %ld, \"bytes\": %.0f, \"seconds\": %.6f, \"gbps\": %.3f, "
+		       "\"lat_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}, "
+		       "\"cycles_per_byte\": %.3f}", r->nr_stripes * r->passes, bytes, seconds, bytes / seconds / 1e9,
+		       pct[0], pct[1], pct[2], pct[3], pct[4], cycles / bytes);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Untimed check of every stripe of a decode or repair: on disk the slices the
+ * workers wrote are read back, in memory they're recovered again into 'outs',
+ * and both must match the dataset. 'outs' are p scratch slices.
+ */
+static void bench_verify(const BENCH_RUN *r, u8 **outs)
+{
+	u8	*srcs[M_K_P_MAX];
+	int	i, m = r->k + r->p;
+	int64_t	s;
+
+	for (s = 0; s < r->nr_stripes; s++) {
+		if (r->fds != NULL) {
+			for (i = 0; i < r->rows; i++) {
+				if (preadn(r->fds[r->out_index[i]], outs[i], r->su, s * r->su) != r->su) {
+					ERR_SYS("preadn() error");
+				}
+			}
+		} else {
+			for (i = 0; i < r->k; i++) {
+				srcs[i] = r->slices[s * m + r->src_index[i]];
+			}
+			ec_encode_data(r->su, r->k, r->rows, r->g_tbls, srcs, outs);
+		}
+		for (i = 0; i < r->rows; i++) {
+			if (memcmp(outs[i], r->slices[s * m + r->out_index[i]], r->su) != 0) {
+				ERR_QUIT("%s of fragment[%d], stripe[%ld] mismatch", op_name[r->op], r->out_index[i], s);
+			}
+		}
+	}
+}
+
+/*
+ * Run one configuration on r->threads workers, each on its share of the
+ * stripes, and report it. GB/s counts origin data bytes over the wall time
+ * of all workers; latency is per stripe, I/O included on disk.
+ */
+static void bench_run(BENCH_RUN *r, BENCH_WORKER *workers, const char *position, const u8 *frag_err_list, int nerrs)
+{
+	pthread_t	ptid[BENCH_MAX_THREADS];
+	uint64_t	*lat, cycles, start;
+	int64_t		nr_lat, wall_ns;
+	int		i;
+
+	if (r->fds != NULL) {
+		/* cold cache: the reads of the run come from the device */
+		for (i = 0; i < r->k + r->p; i++) {
+			fdatasync(r->fds[i]);
+			posix_fadvise(r->fds[i], 0, 0, POSIX_FADV_DONTNEED);
+		}
+	}
+	if ((lat = malloc(r->nr_stripes * r->passes * sizeof(uint64_t))) == NULL) {
+		ERR_SYS("malloc() error");
+	}
+	pthread_barrier_init(&r->barrier, NULL, r->threads + 1);
+	for (i = 0, nr_lat = 0; i < r->threads; i++) {
+		workers[i].run = r;
+		workers[i].first = r->nr_stripes * i / r->threads;
+		workers[i].nr = r->nr_stripes * (i + 1) / r->threads - workers[i].first;
+		workers[i].lat = lat + nr_lat;
+		nr_lat += workers[i].nr * r->passes;
+		if (pthread_create(&ptid[i], NULL, bench_worker, &workers[i]) != 0) {
+			ERR_QUIT("pthread_create() error");
+		}
+	}
+	pthread_barrier_wait(&r->barrier);
+	start = now_ns();
+	for (i = 0, cycles = 0; i < r->threads; i++) {
+		pthread_join(ptid[i], NULL);
+		cycles += workers[i].cycles;
+	}
+	wall_ns = now_ns() - start;
+	pthread_barrier_destroy(&r->barrier);
+
+	if (r->op != OP_ENCODE) {
+		bench_verify(r, workers[0].outs);
+	}
+	bench_report(r, position, frag_err_list, nerrs, wall_ns, lat, nr_lat, cycles);
+	free(lat);
+}
+
+/* 'nerrs' distinct fragments of m at 'pos', data fragments first */
+static void bench_erasures(int pos, int m, int nerrs, unsigned int *seed, u8 *frag_err_list)
+{
+	u8	pick[M_K_P_MAX], t;
+	int	i, j;
+
+	for (i = 0; i < nerrs; i++) {
+		frag_err_list[i] = pos == POS_LAST ? m - nerrs + i : i;
+	}
+	if (pos == POS_MIXED) {
+		/* the first (nerrs + 1) / 2 data fragments, the rest from the last parity */
+		for (i = (nerrs + 1) / 2, j = m - 1; i < nerrs; i++, j--) {
+			frag_err_list[i] = j;
+		}
+		return;
+	}
+	if (pos != POS_RANDOM) {
+		return;
+	}
+	memcpy(pick, identity, m);
+	for (i = 0; i < nerrs; i++) {
+		j = i + rand_r(seed) % (m - i);
+		t = pick[i];
+		pick[i] = pick[j];
+		pick[j] = t;
+		frag_err_list[i] = pick[i];
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int		opt;
+	int		k_list[BENCH_MAX_LIST], p_list[BENCH_MAX_LIST], su_list[BENCH_MAX_LIST];
+	int		t_list[BENCH_MAX_LIST], e_list[BENCH_MAX_LIST];
+	int		nr_k, nr_p, nr_su, nr_t, nr_e, ki, pi, si, ti, ei;
+	int		i, j, k, p, m, su, pos, nr_pos, posi, passes, dataset_mb, nerrs, max_threads, fds[M_K_P_MAX];
+	int		pos_list[POS_NR];
+	u8		done_list[POS_NR][M_K_P_MAX];
+	char		*name, *save, pos_arg[64];
+	unsigned int	seed, pattern_seed;
+	int64_t		nr_stripes, s;
+	char		*dir = NULL, path[PATH_MAX];
+	u8		frag_err_list[M_K_P_MAX], *data;
+	u8		**slices;
+	BUF_POOL	*pool;
+	BENCH_RUN	run;
+	BENCH_WORKER	*workers;
+	const EC_ENC_TBLS	*enc_tbls;
+	EC_DEC_TBLS	*dec_tbls;
+
+	nr_k = parse_list("6", k_list, 'k');
+	nr_p = parse_list("3", p_list, 'p');
+	nr_su = parse_list("1024", su_list, 's');
+	nr_t = parse_list("1", t_list, 't');
+	nr_e = parse_list("1", e_list, 'e');
+	/* data only, parity first and both: decode and repair cost differ with the mix */
+	nr_pos = 3;
+	pos_list[0] = POS_FIRST;
+	pos_list[1] = POS_LAST;
+	pos_list[2] = POS_MIXED;
+	seed = 1;
+	dataset_mb = BENCH_DATASET_DEFAULT;
+	passes = BENCH_PASSES_DEFAULT;
+	is_csv = 0;
+        while ((opt = getopt(argc, argv, "D:e:E:i:k:o:p:R:s:S:t:")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'D':
+                                dir = optarg;
+                                break;
+                        case 'e':
+                                nr_e = parse_list(optarg, e_list, opt);
+                                break;
+                        case 'E':
+                                snprintf(pos_arg, sizeof(pos_arg), "%s", optarg);
+                                for (nr_pos = 0, name = strtok_r(pos_arg, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+                                        for (pos = 0; pos < POS_NR && strcmp(name, pos_name[pos]); pos++)
+                                                ;
+                                        if (pos == POS_NR || nr_pos == POS_NR) {
+                                                err_quit("invalid parameters: erasure positions['%s'] must be a list of first, last, mixed or random", optarg);
+                                        }
+                                        pos_list[nr_pos++] = pos;
+                                }
+                                break;
+                        case 'i':
+                                passes = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'k':
+                                nr_k = parse_list(optarg, k_list, opt);
+                                break;
+                        case 'o':
+                                if (strcmp(optarg, "csv") && strcmp(optarg, "json")) {
+                                        err_quit("invalid parameters: output['%s'] must be json or csv", optarg);
+                                }
+                                is_csv = strcmp(optarg, "csv") == 0;
+                                break;
+                        case 'p':
+                                nr_p = parse_list(optarg, p_list, opt);
+                                break;
+                        case 'R':
+                                seed = strtoul(optarg, NULL, 10);
+                                break;
+                        case 's':
+                                nr_su = parse_list(optarg, su_list, opt);
+                                break;
+                        case 'S':
+                                dataset_mb = strtoul(optarg, NULL, 10);
+                                break;
+                        case 't':
+                                nr_t = parse_list(optarg, t_list, opt);
+                                break;
+                        default:
+                		err_quit("USAGE: %s [-k k,..] [-p p,..] [-s stripe_unit(KB),..] [-t threads,..] [-e erasures,..] [-E first|last|mixed|random,..] [-R seed] [-S dataset(MB)] [-i passes] [-D dir] [-o json|csv]", argv[0]);
+				break;
+                }
+        }
+	if (passes < 1 || dataset_mb < 1 || nr_k < 1 || nr_p < 1 || nr_su < 1 || nr_t < 1 || nr_e < 1 || nr_pos < 1) {
+		err_quit("invalid parameters: passes[%d], dataset[%d] and every list must be non empty", passes, dataset_mb);
+	}
+	for (i = 0, max_threads = 0; i < nr_t; i++) {
+		if (t_list[i] < 1 || t_list[i] > BENCH_MAX_THREADS) {
+			err_quit("invalid parameters: threads[%d] must be 1..%d", t_list[i], BENCH_MAX_THREADS);
+		}
+		max_threads = t_list[i] > max_threads ? t_list[i] : max_threads;
+	}
+	if ((workers = calloc(max_threads, sizeof(BENCH_WORKER))) == NULL) {
+		ERR_SYS("calloc() error");
+	}
+
+	for (i = 0; i < M_K_P_MAX; i++) {
+		identity[i] = i;
+	}
+	bench_env_init();
+	ec_dec_cache_init(EC_DEC_CACHE_DEFAULT, NULL);
+	if (!is_csv) {
+		printf("{\"isal\": \"%s\", \"cpu\": \"%s\", \"dataset_mb\": %d, \"passes\": %d, \"seed\": %u,\n"
+		       "  \"results\": [\n", isal_version, cpu_model, dataset_mb, passes, seed);
+	}
+	for (ki = 0; ki < nr_k; ki++)
+	for (pi = 0; pi < nr_p; pi++) {
+		k = k_list[ki];
+		p = p_list[pi];
+		m = k + p;
+		if (m >= M_K_P_MAX || k < 1 || p < 1) {
+			err_quit("invalid parameters: (k+p)[%d] or k [%d] or p[%d] invalid", m, k, p);
+		}
+		if ((enc_tbls = ec_enc_tables_get(k, p)) == NULL) {
+			ERR_SYS("ec_enc_tables_get() error");
+		}
+		for (si = 0; si < nr_su; si++) {
+			su = su_list[si] * 1024;
+			if (su < 64 || su > INT_MAX / 2) {
+				err_quit("invalid parameters: stripe_unit[%d] invalid", su);
+			}
+			nr_stripes = (int64_t)dataset_mb * 1024 * 1024 / ((int64_t)k * su);
+			if (nr_stripes < 1) {
+				nr_stripes = 1;
+			}
+			dbg("k[%d], p[%d], stripe_unit[%d]: %ld stripes", k, p, su, nr_stripes);
+
+			/* the dataset: random origin data, parity filled in by the first encode */
+			pool = bufpool_create(su, 64, nr_stripes * m + max_threads * (k + p), 0);
+			if ((slices = malloc(nr_stripes * m * sizeof(u8 *))) == NULL) {
+				ERR_SYS("malloc() error");
+			}
+			for (s = 0; s < nr_stripes * m; s++) {
+				slices[s] = bufpool_get(pool);
+			}
+			pattern_seed = seed;
+			for (s = 0; s < nr_stripes; s++) {
+				for (i = 0; i < k; i++) {
+					data = slices[s * m + i];
+					for (j = 0; j + 4 <= su; j += 4) {
+						*(uint32_t *)(data + j) = rand_r(&pattern_seed);
+					}
+				}
+			}
+			for (i = 0; i < max_threads; i++) {
+				for (j = 0; j < k; j++) {
+					workers[i].bufs[j] = bufpool_get(pool);
+				}
+				for (j = 0; j < p; j++) {
+					workers[i].outs[j] = bufpool_get(pool);
+				}
+			}
+			for (i = 0; dir != NULL && i < m; i++) {
+				snprintf(path, sizeof(path), "%s/ec-bench.%d", dir, i);
+				if ((fds[i] = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
+					ERR_SYS("open('%s') error", path);
+				}
+				for (s = 0; i < k && s < nr_stripes; s++) {
+					if (pwriten(fds[i], slices[s * m + i], su, s * su) != su) {
+						ERR_SYS("pwriten() error");
+					}
+				}
+			}
+
+			for (ti = 0; ti < nr_t; ti++) {
+				memset(&run, 0, sizeof(run));
+				run.k = k;
+				run.p = p;
+				run.su = su;
+				run.threads = t_list[ti] < nr_stripes ? t_list[ti] : nr_stripes;
+				run.passes = passes;
+				run.nr_stripes = nr_stripes;
+				run.slices = slices;
+				run.fds = dir != NULL ? fds : NULL;
+
+				run.op = OP_ENCODE;
+				run.g_tbls = (u8 *)enc_tbls->g_tbls;
+				run.rows = p;
+				run.src_index = identity;
+				run.out_index = identity + k;
+				bench_run(&run, workers, "none", NULL, 0);
+				/* parity of the dataset, decode and repair are checked against it */
+				for (s = 0; ti == 0 && s < nr_stripes; s++) {
+					if (dir != NULL) {
+						for (i = 0; i < p; i++) {
+							if (preadn(fds[k + i], slices[s * m + k + i], su, s * su) != su) {
+								ERR_SYS("preadn() error");
+							}
+						}
+					} else {
+						ec_encode_data(su, k, p, (u8 *)enc_tbls->g_tbls, &slices[s * m], &slices[s * m + k]);
+					}
+				}
+
+				for (ei = 0; ei < nr_e; ei++) {
+					nerrs = e_list[ei];
+					if (nerrs < 1 || nerrs > p) {
+						continue;
+					}
+					for (posi = 0; posi < nr_pos; posi++) {
+						/* the same pattern for every thread count */
+						pattern_seed = seed + nerrs;
+						bench_erasures(pos_list[posi], m, nerrs, &pattern_seed, done_list[posi]);
+						/* the positions can give the same pattern for few erasures, run it once */
+						for (j = 0; j < posi && memcmp(done_list[j], done_list[posi], nerrs); j++)
+							;
+						if (j < posi) {
+							continue;
+						}
+						memcpy(frag_err_list, done_list[posi], nerrs);
+						if ((dec_tbls = ec_dec_cache_get(k, p, frag_err_list, nerrs)) == NULL) {
+							ERR_QUIT("no decode tables for %d erasures of k[%d], p[%d]", nerrs, k, p);
+						}
+						run.g_tbls = dec_tbls->g_tbls;
+						run.src_index = dec_tbls->decode_index;
+						run.out_index = dec_tbls->frag_err_list;
+						if (dec_tbls->nsrcerrs > 0) {
+							run.op = OP_DECODE;
+							run.rows = dec_tbls->nsrcerrs;
+							bench_run(&run, workers, pos_name[pos_list[posi]], dec_tbls->frag_err_list, nerrs);
+						}
+						run.op = OP_REPAIR;
+						run.rows = nerrs;
+						bench_run(&run, workers, pos_name[pos_list[posi]], dec_tbls->frag_err_list, nerrs);
+						ec_dec_cache_put(dec_tbls);
+					}
+				}
+			}
+
+			for (i = 0; dir != NULL && i < m; i++) {
+				close(fds[i]);
+				snprintf(path, sizeof(path), "%s/ec-bench.%d", dir, i);
+				unlink(path);
+			}
+			free(slices);
+			bufpool_destroy(pool);
+		}
+	}
+	if (!is_csv) {
+		printf("\n  ]\n}\n");
+	}
+	ec_dec_cache_release();
+	free(workers);
+	return 0;
+}
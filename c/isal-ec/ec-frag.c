@@ -0,0 +1,730 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <isa-l.h>
+
+#include "common.h"
+#include "error.h"
+#include "ec-table.h"
+#include "ec-frag.h"
+
+static uint32_t ec_crc32c(const void *buf, int len)
+{
+	return crc32_iscsi((unsigned char *)buf, len, 0xFFFFFFFF);
+}
+
+static uint32_t ec_frag_hdr_crc(const EC_FRAG_HDR *hdr)
+{
+	EC_FRAG_HDR	tmp;
+
+	tmp = *hdr;
+	tmp.hdr_crc = 0;
+	return ec_crc32c(&tmp, sizeof(tmp));
+}
+
+void ec_frag_hdr_init(EC_FRAG_HDR *hdr, int64_t orig_size, int k, int p, int frag_index,
+		      int stripe_unit, int64_t nr_stripes)
+{
+	memset(hdr, 0, sizeof(EC_FRAG_HDR));
+	memcpy(hdr->magic, EC_FRAG_MAGIC, sizeof(hdr->magic));
+	hdr->version = EC_FRAG_VERSION;
+	hdr->hdr_size = EC_FRAG_HDR_SIZE;
+	hdr->orig_size = orig_size;
+	hdr->k = k;
+	hdr->p = p;
+	hdr->matrix_type = EC_MATRIX_CAUCHY1;
+	hdr->frag_index = frag_index;
+	hdr->stripe_unit = stripe_unit;
+	hdr->csum_type = EC_CSUM_CRC32C;
+	hdr->nr_stripes = nr_stripes;
+	hdr->index_offset = EC_FRAG_STRIPE_OFFSET(hdr, nr_stripes);
+}
+
+int ec_frag_hdr_write(int fd, EC_FRAG_HDR *hdr)
+{
+	hdr->hdr_crc = ec_frag_hdr_crc(hdr);
+	if (pwriten(fd, hdr, sizeof(EC_FRAG_HDR), 0) != sizeof(EC_FRAG_HDR)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* read and validate the header, -1 if it isn't a fragment file of a known version */
+int ec_frag_hdr_read(int fd, EC_FRAG_HDR *hdr)
+{
+	if (preadn(fd, hdr, sizeof(EC_FRAG_HDR), 0) != sizeof(EC_FRAG_HDR)) {
+		return -1;
+	}
+	if (memcmp(hdr->magic, EC_FRAG_MAGIC, sizeof(hdr->magic)) != 0
+		|| hdr->version != EC_FRAG_VERSION || hdr->hdr_crc != ec_frag_hdr_crc(hdr)) {
+		return -1;
+	}
+	if (hdr->k < 1 || hdr->p < 1 || hdr->k + hdr->p >= M_K_P_MAX || hdr->frag_index >= hdr->k + hdr->p
+		|| hdr->hdr_size < sizeof(EC_FRAG_HDR) || hdr->stripe_unit == 0
+		|| hdr->matrix_type != EC_MATRIX_CAUCHY1
+		|| (hdr->csum_type != EC_CSUM_CRC32C && hdr->csum_type != EC_CSUM_CRC64)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* write the stripe index at hdr->index_offset, the header must be written after */
+int ec_frag_index_write(int fd, EC_FRAG_HDR *hdr, const EC_STRIPE_ENTRY *index)
+{
+	size_t	len = hdr->nr_stripes * sizeof(EC_STRIPE_ENTRY);
+
+	hdr->index_crc = ec_crc32c(index, len);
+	if (pwriten(fd, index, len, hdr->index_offset) != len) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Commit in place changes of all k + p fragments: the slices already written
+ * are synced before any index, and the indexes before any header, so until a
+ * fragment's header is written it still describes its old index and slices.
+ * The file is cut behind the index last. -1 with errno set on error.
+ */
+int ec_frag_commit(const int *fds, const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY *const *indexes)
+{
+	EC_FRAG_HDR	frag_hdr[M_K_P_MAX];
+	int		i, m = hdr->k + hdr->p;
+
+	for (i = 0; i < m; i++) {
+		if (fdatasync(fds[i]) < 0) {
+			return -1;
+		}
+	}
+	for (i = 0; i < m; i++) {
+		frag_hdr[i] = *hdr;
+		frag_hdr[i].frag_index = i;
+		if (ec_frag_index_write(fds[i], &frag_hdr[i], indexes[i]) < 0 || fdatasync(fds[i]) < 0) {
+			return -1;
+		}
+	}
+	for (i = 0; i < m; i++) {
+		if (ec_frag_hdr_write(fds[i], &frag_hdr[i]) < 0 || fdatasync(fds[i]) < 0) {
+			return -1;
+		}
+	}
+	for (i = 0; i < m; i++) {
+		if (ftruncate(fds[i], hdr->index_offset + hdr->nr_stripes * sizeof(EC_STRIPE_ENTRY)) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* read and check the stripe index, NULL on error, free() by the caller */
+EC_STRIPE_ENTRY *ec_frag_index_read(int fd, const EC_FRAG_HDR *hdr)
+{
+	EC_STRIPE_ENTRY	*index;
+	size_t		len = hdr->nr_stripes * sizeof(EC_STRIPE_ENTRY);
+
+	if ((index = malloc(len ? len : 1)) == NULL) {
+		ERR_SYS("malloc() error");
+	}
+	if (preadn(fd, index, len, hdr->index_offset) != len || ec_crc32c(index, len) != hdr->index_crc) {
+		free(index);
+		return NULL;
+	}
+	return index;
+}
+
+/* checksum of one stripe slice, as stored in the stripe index */
+uint64_t ec_frag_csum(const EC_FRAG_HDR *hdr, const unsigned char *buf, int len)
+{
+	if (hdr->csum_type == EC_CSUM_CRC64) {
+		return crc64_ecma_refl(0, buf, len);
+	}
+	return ec_crc32c(buf, len);
+}
+
+/* EC_CSUM_* of a '-C' name, -1 if unknown */
+int ec_frag_csum_type(const char *name)
+{
+	if (strcmp(name, "crc32c") == 0) {
+		return EC_CSUM_CRC32C;
+	}
+	if (strcmp(name, "crc64") == 0) {
+		return EC_CSUM_CRC64;
+	}
+	return -1;
+}
+
+/* 1 if the slice of 'stripe' in 'buf' matches its checksum in the fragment's stripe 'index' */
+int ec_frag_slice_ok(const EC_FRAG_HDR *hdr, const EC_STRIPE_ENTRY *index, int64_t stripe, const unsigned char *buf)
+{
+	return ec_frag_csum(hdr, buf, hdr->stripe_unit) == index[stripe].csum;
+}
+
+/* both headers describe the same object layout, the per fragment fields aside */
+static int ec_frag_hdr_same(const EC_FRAG_HDR *a, const EC_FRAG_HDR *b)
+{
+	return a->version == b->version && a->hdr_size == b->hdr_size && a->orig_size == b->orig_size
+		&& a->k == b->k && a->p == b->p && a->matrix_type == b->matrix_type
+		&& a->stripe_unit == b->stripe_unit && a->csum_type == b->csum_type
+		&& a->nr_stripes == b->nr_stripes && a->index_offset == b->index_offset;
+}
+
+/*
+ * Open 'prefix.N' for all fragments of an object. The layout shared by most
+ * valid headers is returned in 'hdr' (the first one on a tie), fragments that
+ * are missing or whose header doesn't match it, e.g. left behind by an
+ * interrupted append, get fds[i] = -1. Returns the number of lost fragments,
+ * -1 if none is valid.
+ */
+int ec_frag_open_all(const char *prefix, int flags, int *fds, EC_FRAG_HDR *hdr)
+{
+	char		tmpname[PATH_MAX];
+	EC_FRAG_HDR	hdrs[M_K_P_MAX];
+	int		i, j, m, nerrs, best, votes, best_votes;
+
+	m = M_K_P_MAX;
+	for (i = 0; i < m; i++) {
+		snprintf(tmpname, sizeof(tmpname), "%s.%d", prefix, i);
+		if ((fds[i] = open(tmpname, flags)) < 0) {
+			DBG("open('%s') error, skip it....", tmpname);
+			continue;
+		}
+		if (ec_frag_hdr_read(fds[i], &hdrs[i]) < 0 || hdrs[i].frag_index != i) {
+			ERR_MSG("'%s' has no valid fragment header, skip it....", tmpname);
+			close(fds[i]);
+			fds[i] = -1;
+			continue;
+		}
+		if (m == M_K_P_MAX) {
+			m = hdrs[i].k + hdrs[i].p;
+		}
+	}
+	for (i = 0, best = -1, best_votes = 0; i < m; i++) {
+		if (fds[i] < 0) {
+			continue;
+		}
+		for (j = 0, votes = 0; j < m; j++) {
+			votes += fds[j] >= 0 && ec_frag_hdr_same(&hdrs[i], &hdrs[j]);
+		}
+		if (votes > best_votes) {
+			best = i;
+			best_votes = votes;
+		}
+	}
+	if (best < 0) {
+		return -1;
+	}
+	*hdr = hdrs[best];
+	/* the first header may have set another m than the chosen layout's */
+	for (i = m; i < hdr->k + hdr->p; i++) {
+		fds[i] = -1;
+	}
+	if (m < hdr->k + hdr->p) {
+		m = hdr->k + hdr->p;
+	}
+	for (i = 0, nerrs = 0; i < m; i++) {
+		if (fds[i] >= 0 && (i >= hdr->k + hdr->p || !ec_frag_hdr_same(&hdrs[i], hdr))) {
+			ERR_MSG("'%s.%d' header doesn't match the other fragments, skip it....", prefix, i);
+			close(fds[i]);
+			fds[i] = -1;
+		}
+		if (fds[i] < 0 && i < hdr->k + hdr->p) {
+			nerrs++;
+		}
+	}
+	return nerrs;
+}
+
+/* stripe index of the first fragment whose index is valid, NULL if none, free() by the caller */
+EC_STRIPE_ENTRY *ec_frag_index_read_any(const int *fds, const EC_FRAG_HDR *hdr)
+{
+	EC_STRIPE_ENTRY	*index;
+	int		i;
+
+	for (i = 0; i < hdr->k + hdr->p; i++) {
+		if (fds[i] >= 0 && (index = ec_frag_index_read(fds[i], hdr)) != NULL) {
+			return index;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Stripe index of every open fragment, each checked against the fragment's
+ * own header: slices can only be verified against their own fragment's
+ * checksums. A fragment whose index can't be read is closed and counted
+ * lost (fds[i] = -1). Returns the number of indexes read.
+ */
+int ec_frag_indexes_read(int *fds, const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY **indexes)
+{
+	EC_FRAG_HDR	frag_hdr;
+	int		i, nr;
+
+	for (i = 0, nr = 0; i < hdr->k + hdr->p; i++) {
+		indexes[i] = NULL;
+		if (fds[i] < 0) {
+			continue;
+		}
+		if (ec_frag_hdr_read(fds[i], &frag_hdr) < 0 || (indexes[i] = ec_frag_index_read(fds[i], &frag_hdr)) == NULL) {
+			ERR_MSG("fragment[%d] has no valid stripe index, taken as lost", i);
+			close(fds[i]);
+			fds[i] = -1;
+			continue;
+		}
+		nr++;
+	}
+	return nr;
+}
+
+/*
+ * 1 if the origin range of 'stripe' holds no data (SEEK_DATA), so that it needs
+ * neither read nor encode: its parity is zero. 0 if it has data or the
+ * filesystem can't tell. Uses the file offset of 'fd'.
+ */
+int ec_stripe_is_hole(int fd, const EC_FRAG_HDR *hdr, int64_t stripe)
+{
+	int64_t	begin, data;
+
+	begin = stripe * hdr->k * hdr->stripe_unit;
+	if ((data = lseek(fd, begin, SEEK_DATA)) < 0) {
+		return errno == ENXIO;	/* nothing but holes up to the end of the file */
+	}
+	return data >= begin + (int64_t)hdr->k * hdr->stripe_unit;
+}
+
+/* checksum of an all-zero slice, the one of every sparse stripe */
+uint64_t ec_frag_zero_csum(const EC_FRAG_HDR *hdr)
+{
+	unsigned char	*zero;
+	uint64_t	csum;
+
+	if ((zero = calloc(1, hdr->stripe_unit)) == NULL) {
+		ERR_SYS("calloc() error");
+	}
+	csum = ec_frag_csum(hdr, zero, hdr->stripe_unit);
+	free(zero);
+	return csum;
+}
+
+/* record 'stripe' as sparse in the m fragment indexes, nothing is written for it */
+void ec_frag_sparse_stripe(const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY *index, int64_t stripe, uint64_t zero_csum)
+{
+	EC_STRIPE_ENTRY	*entry;
+	int		i;
+
+	for (i = 0; i < hdr->k + hdr->p; i++) {
+		entry = &index[i * hdr->nr_stripes + stripe];
+		entry->offset = EC_FRAG_STRIPE_OFFSET(hdr, stripe);
+		entry->flags = EC_STRIPE_SPARSE;
+		entry->csum = zero_csum;
+	}
+}
+
+/*
+ * Map the origin file 'fd' read-only, so that the encoder reads its data
+ * slices in place instead of copying them into private buffers. Pages are
+ * faulted in as the stripes are encoded, 'advice' (MADV_SEQUENTIAL for a
+ * single pass) drives readahead ahead of them and lets the kernel drop the
+ * pages behind, so the file streams through the page cache instead of being
+ * read whole before the first stripe. Huge pages are asked for, the
+ * filesystem may not back a file mapping with them. NULL if 'fd' can't be
+ * mapped, the caller falls back to preadn.
+ */
+unsigned char *ec_origin_map(int fd, int64_t size, int advice)
+{
+	void	*map;
+
+	if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		DBG("mmap(%ld) of fd[%d] error, preadn the origin", size, fd);
+		return NULL;
+	}
+	madvise(map, size, advice);
+#ifdef MADV_HUGEPAGE
+	madvise(map, size, MADV_HUGEPAGE);
+#endif
+	return map;
+}
+
+void ec_origin_unmap(unsigned char *map, int64_t size)
+{
+	if (map != NULL) {
+		munmap(map, size);
+	}
+}
+
+/*
+ * Point srcs[0..k) at the data slices of 'stripe' in the origin mapping. A
+ * slice cut by the end of the file is copied into pad[i] and zero padded,
+ * one past the end is all zeros in pad[i]: the mapping can't be read there.
+ */
+void ec_origin_stripe(const unsigned char *map, const EC_FRAG_HDR *hdr, int64_t stripe,
+		      unsigned char **pad, unsigned char **srcs)
+{
+	int	i, su;
+	int64_t	offset, n;
+
+	su = hdr->stripe_unit;
+	for (i = 0; i < hdr->k; i++) {
+		offset = (stripe * hdr->k + i) * su;
+		n = hdr->orig_size - offset;
+		if (n >= su) {
+			srcs[i] = (unsigned char *)map + offset;
+			continue;
+		}
+		if (n < 0) {
+			n = 0;
+		}
+		memcpy(pad[i], map + offset, n);
+		memset(pad[i] + n, 0, su - n);
+		srcs[i] = pad[i];
+	}
+}
+
+/*
+ * Recover the data slices of 'stripe' after a slice read for it failed its
+ * checksum. The slice of every open fragment is read into bufs[i] and
+ * verified, the lost and the corrupt ones are the erasures of this stripe
+ * alone, decoded with tables of their own. 'bufs' are m slice buffers, the
+ * k data slices are left in bufs[0..k). Returns the number of corrupt
+ * slices, -1 if the stripe has more than p erasures or on read error.
+ */
+int ec_stripe_recover(const int *fds, const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY *const *indexes,
+		      int64_t stripe, unsigned char **bufs)
+{
+	int		i, k, p, m, su, nerrs, nbad;
+	u8		frag_err_list[M_K_P_MAX];
+	u8		*recover_srcs[M_K_P_MAX], *recover_outp[M_K_P_MAX];
+	EC_DEC_TBLS	*dec_tbls;
+
+	k = hdr->k;
+	p = hdr->p;
+	m = k + p;
+	su = hdr->stripe_unit;
+	for (i = 0, nerrs = 0, nbad = 0; i < m; i++) {
+		if (fds[i] < 0) {
+			frag_err_list[nerrs++] = i;
+			continue;
+		}
+		if (preadn(fds[i], bufs[i], su, indexes[i][stripe].offset) != su) {
+			return -1;
+		}
+		if (!ec_frag_slice_ok(hdr, indexes[i], stripe, bufs[i])) {
+			ERR_MSG("fragment[%d], stripe[%ld]: checksum mismatch, decoded as an erasure", i, stripe);
+			frag_err_list[nerrs++] = i;
+			nbad++;
+		}
+	}
+	if (nerrs > p) {
+		ERR_MSG("stripe[%ld]: %d slices lost or corrupt, more than p[%d]", stripe, nerrs, p);
+		return -1;
+	}
+	if (nerrs == 0) {	/* the bad slice read back fine */
+		return 0;
+	}
+	/* lost data slices only, parity isn't needed for the output */
+	if ((dec_tbls = ec_dec_cache_get(k, p, frag_err_list, nerrs)) == NULL) {
+		return -1;
+	}
+	if (dec_tbls->nsrcerrs > 0) {
+		for (i = 0; i < k; i++) {
+			recover_srcs[i] = bufs[dec_tbls->decode_index[i]];
+		}
+		for (i = 0; i < dec_tbls->nsrcerrs; i++) {
+			recover_outp[i] = bufs[dec_tbls->frag_err_list[i]];
+		}
+		ec_encode_data(su, k, dec_tbls->nsrcerrs, dec_tbls->g_tbls, recover_srcs, recover_outp);
+	}
+	ec_dec_cache_put(dec_tbls);
+	return nbad;
+}
+
+/*
+ * Reassemble stripes [stripe, stripe + nr) of the origin file into 'outfd'
+ * straight from the data fragments, parity isn't touched. The data is copied
+ * in the kernel (copy_file_range) where the filesystem allows it, with no
+ * user space buffer. All data fragments must be present. Sparse stripes of
+ * 'index' (any fragment's, may be NULL) are skipped, 'outfd' must already
+ * have the origin size for them to read back as zeros.
+ */
+int ec_copy_stripes(const int *fds, const EC_FRAG_HDR *hdr, const EC_STRIPE_ENTRY *index,
+		    int64_t stripe, int64_t nr, int outfd)
+{
+	int		i, k, su;
+	int64_t		s, offset, n;
+
+	k = hdr->k;
+	su = hdr->stripe_unit;
+	for (s = stripe; s < stripe + nr; s++) {
+		if (index != NULL && (index[s].flags & EC_STRIPE_SPARSE)) {
+			continue;
+		}
+		/* trim the padding of the last stripe */
+		for (i = 0; i < k; i++) {
+			offset = (s * k + i) * su;
+			if (offset >= hdr->orig_size) {
+				break;
+			}
+			n = hdr->orig_size - offset < su ? hdr->orig_size - offset : su;
+			if (copy_rangen(fds[i], EC_FRAG_SLICE_OFFSET(hdr, index, s), outfd, offset, n) != n) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read [offset, offset + len) of the origin file into 'buf' from an open
+ * fragment set. Only the slices covering the range are read, with preadn
+ * at their offsets in 'index' (any fragment's, may be NULL); the k decode
+ * sources of a slice are read only when its data fragment is lost. Returns the bytes read (short at the
+ * end of the file) or -1 on error.
+ */
+int64_t ec_read_range(const int *fds, const EC_FRAG_HDR *hdr, const EC_STRIPE_ENTRY *index,
+		      int64_t offset, int64_t len, u8 *buf)
+{
+	int		k, p, m, su, frag, row, i, nerrs;
+	int64_t		pos, done, chunk, stripe, slice_off, n;
+	u8		frag_err_list[M_K_P_MAX];
+	u8		*recover_srcs[M_K_P_MAX], *recover_outp;
+	EC_DEC_TBLS	*dec_tbls = NULL;
+
+	if (offset < 0 || len < 0) {
+		return -1;
+	}
+	if (offset >= hdr->orig_size) {
+		return 0;
+	}
+	if (len > hdr->orig_size - offset) {
+		len = hdr->orig_size - offset;
+	}
+	k = hdr->k;
+	p = hdr->p;
+	m = k + p;
+	su = hdr->stripe_unit;
+	memset(recover_srcs, 0, sizeof(recover_srcs));
+
+	for (pos = offset, done = 0; done < len; pos += n, done += n) {
+		chunk = pos / su;
+		stripe = chunk / k;
+		frag = chunk % k;
+		n = su - pos % su;
+		if (n > len - done) {
+			n = len - done;
+		}
+		slice_off = EC_FRAG_SLICE_OFFSET(hdr, index, stripe) + pos % su;
+		if (fds[frag] >= 0) {
+			if (preadn(fds[frag], buf + done, n, slice_off) != n) {
+				goto err;
+			}
+			continue;
+		}
+
+		/* lost data fragment: decode just these n bytes from the same range of k sources */
+		if (dec_tbls == NULL) {
+			for (i = 0, nerrs = 0; i < m; i++) {
+				if (fds[i] < 0) {
+					frag_err_list[nerrs++] = i;
+				}
+			}
+			if ((dec_tbls = ec_dec_cache_get(k, p, frag_err_list, nerrs)) == NULL) {
+				goto err;
+			}
+			for (i = 0; i < k; i++) {
+				if ((recover_srcs[i] = malloc(su)) == NULL) {
+					ERR_SYS("malloc() error");
+				}
+			}
+		}
+		for (i = 0; i < k; i++) {
+			if (preadn(fds[dec_tbls->decode_index[i]], recover_srcs[i], n, slice_off) != n) {
+				goto err;
+			}
+		}
+		for (row = 0; dec_tbls->frag_err_list[row] != frag; row++)
+			;
+		recover_outp = buf + done;
+		ec_encode_data(n, k, 1, &dec_tbls->g_tbls[row * k * 32], recover_srcs, &recover_outp);
+	}
+	ec_dec_cache_put(dec_tbls);
+	for (i = 0; i < k; i++) {
+		free(recover_srcs[i]);
+	}
+	return done;
+err:
+	ec_dec_cache_put(dec_tbls);
+	for (i = 0; i < k; i++) {
+		free(recover_srcs[i]);
+	}
+	return -1;
+}
+
+#define CRC32C_POLY_REFL	0x82F63B78ULL
+#define CRC64_ECMA_POLY_REFL	0xC96C5795D7870F42ULL
+
+/* a * b modulo the CRC polynomial, in 'width' reflected bits: the top bit is x^0 */
+static uint64_t crc_multmodp(uint64_t a, uint64_t b, uint64_t poly, int width)
+{
+	uint64_t	m = (uint64_t)1 << (width - 1), prod = 0;
+
+	for (;;) {
+		if (a & m) {
+			prod ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ poly : b >> 1;
+	}
+	return prod;
+}
+
+/* the linear part 'crc' of a CRC followed by 'nbytes' zero bytes: crc * x^(8 * nbytes) */
+static uint64_t crc_zeros(uint64_t crc, int64_t nbytes, uint64_t poly, int width)
+{
+	uint64_t	sq = (uint64_t)1 << (width - 1 - 8);	/* x^8 */
+
+	while (nbytes > 0) {
+		if (nbytes & 1) {
+			crc = crc_multmodp(sq, crc, poly, width);
+		}
+		if ((nbytes >>= 1) > 0) {
+			sq = crc_multmodp(sq, sq, poly, width);
+		}
+	}
+	return crc;
+}
+
+/*
+ * Checksum of a slice after 'n' bytes at 'off' changed by 'delta' (old ^ new),
+ * from its old checksum. A CRC is affine: crc(new) ^ crc(old) only depends on
+ * D, the delta in a zero slice. The zeros before 'delta' add nothing, those
+ * after it shift its CRC; only the 'n' bytes are summed. 'zero' holds at
+ * least 'n' zero bytes.
+ */
+static uint64_t ec_frag_csum_update(const EC_FRAG_HDR *hdr, uint64_t csum, const u8 *delta, int off, int n,
+				    const u8 *zero)
+{
+	uint64_t	lin = ec_frag_csum(hdr, delta, n) ^ ec_frag_csum(hdr, zero, n);
+	int64_t		after = hdr->stripe_unit - off - n;
+
+	if (hdr->csum_type == EC_CSUM_CRC64) {
+		return csum ^ crc_zeros(lin, after, CRC64_ECMA_POLY_REFL, 64);
+	}
+	return csum ^ crc_zeros(lin, after, CRC32C_POLY_REFL, 32);
+}
+
+/*
+ * Overwrite [offset, offset + len) of the origin with 'buf' in place. Per
+ * data slice touched only the changed range of it and the same range of the
+ * p parity slices are read and written: with the data delta (old ^ new),
+ * ec_encode_data_update gives the parity deltas, xored into the old parity.
+ * indexes[i] is the stripe index of fragment i, its checksums and sparse
+ * flags are updated; the caller commits them with ec_frag_commit(). All
+ * fragments must be present and the range must lie within the origin.
+ * Returns 0 or -1.
+ */
+int ec_update_range(const int *fds, const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY *const *indexes,
+		    int64_t offset, int64_t len, const u8 *buf)
+{
+	int		k, p, m, su, frag, i, j, off, ret;
+	int64_t		pos, done, chunk, stripe, slice_off, n, bufsz;
+	u8		*delta, *zero, *parity[M_K_P_MAX], *pdelta[M_K_P_MAX];
+	EC_STRIPE_ENTRY	*entry;
+	const EC_ENC_TBLS	*enc_tbls;
+
+	if (offset < 0 || len < 0 || offset + len > hdr->orig_size) {
+		return -1;
+	}
+	k = hdr->k;
+	p = hdr->p;
+	m = k + p;
+	su = hdr->stripe_unit;
+	for (i = 0; i < m; i++) {
+		if (fds[i] < 0 || indexes[i] == NULL) {
+			return -1;
+		}
+	}
+	if ((enc_tbls = ec_enc_tables_get(k, p)) == NULL) {
+		return -1;
+	}
+	/* no chunk is longer than the range or a slice: the buffers scale with the bytes changed */
+	bufsz = len < su ? (len > 0 ? len : 1) : su;
+	if ((delta = malloc(bufsz)) == NULL || (zero = calloc(1, bufsz)) == NULL) {
+		ERR_SYS("malloc() error");
+	}
+	for (i = 0; i < p; i++) {
+		if ((parity[i] = malloc(bufsz)) == NULL || (pdelta[i] = malloc(bufsz)) == NULL) {
+			ERR_SYS("malloc() error");
+		}
+	}
+
+	ret = -1;
+	for (pos = offset, done = 0; done < len; pos += n, done += n) {
+		chunk = pos / su;
+		stripe = chunk / k;
+		frag = chunk % k;
+		off = pos % su;
+		n = su - off;
+		if (n > len - done) {
+			n = len - done;
+		}
+		slice_off = indexes[frag][stripe].offset + off;
+
+		/* a sparse slice reads back as zeros, the delta is then the new data */
+		if (preadn(fds[frag], delta, n, slice_off) != n) {
+			goto out;
+		}
+		for (j = 0; j < n; j++) {
+			delta[j] ^= buf[done + j];
+		}
+		for (i = 0; i < p; i++) {
+			memset(pdelta[i], 0, n);
+		}
+		ec_encode_data_update(n, k, p, frag, (u8 *)enc_tbls->g_tbls, delta, pdelta);
+
+		if (pwriten(fds[frag], buf + done, n, slice_off) != n) {
+			goto out;
+		}
+		for (i = 0; i < p; i++) {
+			if (preadn(fds[k + i], parity[i], n, slice_off) != n) {
+				goto out;
+			}
+			for (j = 0; j < n; j++) {
+				parity[i][j] ^= pdelta[i][j];
+			}
+			if (pwriten(fds[k + i], parity[i], n, slice_off) != n) {
+				goto out;
+			}
+		}
+
+		/* the stripe now has data: it can't stay a hole */
+		for (i = 0; i < m; i++) {
+			indexes[i][stripe].flags &= ~EC_STRIPE_SPARSE;
+		}
+		entry = &indexes[frag][stripe];
+		entry->csum = ec_frag_csum_update(hdr, entry->csum, delta, off, n, zero);
+		for (i = 0; i < p; i++) {
+			entry = &indexes[k + i][stripe];
+			entry->csum = ec_frag_csum_update(hdr, entry->csum, pdelta[i], off, n, zero);
+		}
+	}
+	ret = 0;
+out:
+	free(delta);
+	free(zero);
+	for (i = 0; i < p; i++) {
+		free(parity[i]);
+		free(pdelta[i]);
+	}
+	return ret;
+}
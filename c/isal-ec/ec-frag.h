@@ -0,0 +1,85 @@
+#ifndef __EC_FRAG_H__
+#define __EC_FRAG_H__
+
+#include <stdint.h>
+
+#include "libec.h"	/* EC_CSUM_* */
+
+/*
+ * Fragment file layout:
+ *   [ header, EC_FRAG_HDR_SIZE bytes ][ stripe 0 slice ] ... [ stripe n-1 slice ][ stripe index ]
+ * Every slice is stripe_unit bytes, data starts page aligned. That's the
+ * layout of an encode; an append writes its slices past the old index, so
+ * a slice is where its index entry says.
+ */
+#define EC_FRAG_MAGIC		"ISALECFR"
+#define EC_FRAG_VERSION		1
+#define EC_FRAG_HDR_SIZE	4096
+
+#define EC_MATRIX_CAUCHY1	1
+
+typedef struct ec_frag_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	hdr_size;	/* offset of the first stripe slice */
+	uint64_t	orig_size;	/* size of the origin file, padding excluded */
+	uint32_t	k;
+	uint32_t	p;
+	uint32_t	matrix_type;	/* EC_MATRIX_* */
+	uint32_t	frag_index;	/* this file is fragment 'frag_index' of k + p */
+	uint32_t	stripe_unit;	/* bytes of this fragment per stripe */
+	uint32_t	csum_type;	/* EC_CSUM_* of the slices in the stripe index */
+	uint64_t	nr_stripes;
+	uint64_t	index_offset;	/* stripe index, after the last slice */
+	uint32_t	index_crc;	/* crc32c of the stripe index */
+	uint32_t	hdr_crc;	/* crc32c of this header with hdr_crc = 0 */
+} __attribute__((packed)) EC_FRAG_HDR;
+
+typedef struct ec_stripe_index_entry {
+	uint64_t	offset;		/* slice offset in the fragment file */
+	uint32_t	flags;
+	uint32_t	reserved;
+	uint64_t	csum;		/* checksum of the slice */
+} __attribute__((packed)) EC_STRIPE_ENTRY;
+
+/* flags of a stripe index entry */
+#define EC_STRIPE_SPARSE	0x1	/* origin stripe is a hole: slice not written, reads back as zeros */
+
+/* stripe units of a mapped origin are rounded to it, slices then start on a huge page */
+#define EC_MAP_HUGEPAGE		(2 * 1024 * 1024)
+
+#define EC_FRAG_STRIPE_OFFSET(hdr, stripe)	((hdr)->hdr_size + (int64_t)(stripe) * (hdr)->stripe_unit)
+/* slice offset of 'stripe' from a stripe index, the encode layout without one */
+#define EC_FRAG_SLICE_OFFSET(hdr, index, stripe)	\
+	((index) != NULL ? (int64_t)(index)[stripe].offset : EC_FRAG_STRIPE_OFFSET(hdr, stripe))
+
+void	ec_frag_hdr_init(EC_FRAG_HDR *hdr, int64_t orig_size, int k, int p, int frag_index,
+			 int stripe_unit, int64_t nr_stripes);
+int	ec_frag_hdr_write(int fd, EC_FRAG_HDR *hdr);
+int	ec_frag_hdr_read(int fd, EC_FRAG_HDR *hdr);
+int	ec_frag_index_write(int fd, EC_FRAG_HDR *hdr, const EC_STRIPE_ENTRY *index);
+int	ec_frag_commit(const int *fds, const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY *const *indexes);
+EC_STRIPE_ENTRY	*ec_frag_index_read(int fd, const EC_FRAG_HDR *hdr);
+uint64_t	ec_frag_csum(const EC_FRAG_HDR *hdr, const unsigned char *buf, int len);
+int	ec_frag_csum_type(const char *name);
+int	ec_frag_slice_ok(const EC_FRAG_HDR *hdr, const EC_STRIPE_ENTRY *index, int64_t stripe, const unsigned char *buf);
+int	ec_frag_open_all(const char *prefix, int flags, int *fds, EC_FRAG_HDR *hdr);
+EC_STRIPE_ENTRY	*ec_frag_index_read_any(const int *fds, const EC_FRAG_HDR *hdr);
+int	ec_frag_indexes_read(int *fds, const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY **indexes);
+int	ec_stripe_is_hole(int fd, const EC_FRAG_HDR *hdr, int64_t stripe);
+uint64_t	ec_frag_zero_csum(const EC_FRAG_HDR *hdr);
+void	ec_frag_sparse_stripe(const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY *index, int64_t stripe, uint64_t zero_csum);
+unsigned char	*ec_origin_map(int fd, int64_t size, int advice);
+void	ec_origin_unmap(unsigned char *map, int64_t size);
+void	ec_origin_stripe(const unsigned char *map, const EC_FRAG_HDR *hdr, int64_t stripe,
+			 unsigned char **pad, unsigned char **srcs);
+int	ec_stripe_recover(const int *fds, const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY *const *indexes,
+			  int64_t stripe, unsigned char **bufs);
+int	ec_copy_stripes(const int *fds, const EC_FRAG_HDR *hdr, const EC_STRIPE_ENTRY *index,
+			int64_t stripe, int64_t nr, int outfd);
+int64_t	ec_read_range(const int *fds, const EC_FRAG_HDR *hdr, const EC_STRIPE_ENTRY *index,
+		      int64_t offset, int64_t len, unsigned char *buf);
+int	ec_update_range(const int *fds, const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY *const *indexes,
+			int64_t offset, int64_t len, const unsigned char *buf);
+
+#endif
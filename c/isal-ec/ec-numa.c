@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "error.h"
+#include "ec-numa.h"
+
+#define EC_NUMA_SYSFS	"/sys/devices/system/node"
+
+/* add the cpus of a sysfs cpulist ("0-3,8-11") that the process may run on */
+static void ec_numa_add_cpus(EC_NUMA_TOPO *topo, const char *list, const cpu_set_t *allowed)
+{
+	const char	*s = list;
+	char		*end;
+	long		first, last, cpu;
+
+	while (*s != '\0' && *s != '\n') {
+		first = last = strtol(s, &end, 10);
+		if (end == s) {
+			break;
+		}
+		if (*end == '-') {
+			s = end + 1;
+			last = strtol(s, &end, 10);
+		}
+		for (cpu = first; cpu <= last && topo->nr_cpus < EC_NUMA_MAX_CPUS; cpu++) {
+			if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, allowed)) {
+				topo->cpus[topo->nr_cpus++] = cpu;
+			}
+		}
+		s = *end == ',' ? end + 1 : end;
+	}
+}
+
+/*
+ * Read the node to cpu mapping from sysfs, restricted to the affinity mask
+ * of the process (taskset, cgroups). Without sysfs nodes, all usable cpus
+ * are one node.
+ */
+void ec_numa_topo_init(EC_NUMA_TOPO *topo)
+{
+	cpu_set_t	allowed;
+	char		path[128], list[4096];
+	FILE		*fp;
+	int		node, cpu;
+
+	memset(topo, 0, sizeof(EC_NUMA_TOPO));
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		ERR_SYS("sched_getaffinity() error");
+	}
+	for (node = 0; node < 4 * EC_NUMA_MAX_NODES && topo->nr_nodes < EC_NUMA_MAX_NODES; node++) {
+		snprintf(path, sizeof(path), EC_NUMA_SYSFS "/node%d/cpulist", node);
+		if ((fp = fopen(path, "r")) == NULL) {
+			continue;
+		}
+		if (fgets(list, sizeof(list), fp) != NULL) {
+			topo->node_first[topo->nr_nodes] = topo->nr_cpus;
+			ec_numa_add_cpus(topo, list, &allowed);
+			topo->node_nr[topo->nr_nodes] = topo->nr_cpus - topo->node_first[topo->nr_nodes];
+			if (topo->node_nr[topo->nr_nodes] > 0) {
+				topo->node_id[topo->nr_nodes++] = node;
+			}
+		}
+		fclose(fp);
+	}
+	if (topo->nr_nodes > 0) {
+		return;
+	}
+
+	DBG("no NUMA nodes in '%s', one node", EC_NUMA_SYSFS);
+	for (cpu = 0; cpu < CPU_SETSIZE && topo->nr_cpus < EC_NUMA_MAX_CPUS; cpu++) {
+		if (CPU_ISSET(cpu, &allowed)) {
+			topo->cpus[topo->nr_cpus++] = cpu;
+		}
+	}
+	topo->nr_nodes = 1;
+	topo->node_nr[0] = topo->nr_cpus;
+}
+
+void ec_numa_topo_report(const EC_NUMA_TOPO *topo)
+{
+	int	i;
+
+	msg("numa: nodes[%d], cpus[%d]", topo->nr_nodes, topo->nr_cpus);
+	for (i = 0; i < topo->nr_nodes; i++) {
+		msg("numa: node[%d]: cpus[%d], first cpu[%d], last cpu[%d]", topo->node_id[i], topo->node_nr[i],
+		    topo->cpus[topo->node_first[i]], topo->cpus[topo->node_first[i] + topo->node_nr[i] - 1]);
+	}
+}
+
+/*
+ * cpu of 'worker': workers are dealt round robin over the nodes, so that any
+ * number of them spreads the memory bandwidth over all sockets, then over
+ * the cpus of their node. Its sysfs node goes into 'node'.
+ */
+int ec_numa_worker_cpu(const EC_NUMA_TOPO *topo, int worker, int *node)
+{
+	int	n;
+
+	n = worker % topo->nr_nodes;
+	*node = topo->node_id[n];
+	return topo->cpus[topo->node_first[n] + (worker / topo->nr_nodes) % topo->node_nr[n]];
+}
+
+/* pin the calling thread to 'cpu', its first-touch allocations then come from the cpu's node */
+int ec_numa_pin(int cpu)
+{
+	cpu_set_t	set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
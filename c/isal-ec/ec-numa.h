@@ -0,0 +1,22 @@
+#ifndef __EC_NUMA_H__
+#define __EC_NUMA_H__
+
+#define EC_NUMA_MAX_NODES	64
+#define EC_NUMA_MAX_CPUS	1024
+
+/* usable cpus grouped by NUMA node, nodes without a usable cpu are left out */
+typedef struct ec_numa_topo {
+	int	nr_nodes;
+	int	nr_cpus;
+	int	node_id[EC_NUMA_MAX_NODES];	/* sysfs node number */
+	int	node_first[EC_NUMA_MAX_NODES];	/* first cpu of the node in cpus[] */
+	int	node_nr[EC_NUMA_MAX_NODES];	/* cpus of the node */
+	int	cpus[EC_NUMA_MAX_CPUS];
+} EC_NUMA_TOPO;
+
+void	ec_numa_topo_init(EC_NUMA_TOPO *topo);
+void	ec_numa_topo_report(const EC_NUMA_TOPO *topo);
+int	ec_numa_worker_cpu(const EC_NUMA_TOPO *topo, int worker, int *node);
+int	ec_numa_pin(int cpu);
+
+#endif
@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "common.h"
+#include "error.h"
+#include "ec-stats.h"
+
+static const char *stage_name[EC_STAT_STAGES] = {"read", "compute", "tables", "write", "queue_wait"};
+static const char *frag_op_name[EC_STAT_FRAG_OPS] = {"read", "write"};
+
+EC_STATS *ec_stats_create(const char *tool, const char *op, int nr_workers, int m)
+{
+	EC_STATS	*stats;
+	int		i;
+	size_t		len;
+
+	if ((stats = calloc(1, sizeof(EC_STATS))) == NULL) {
+		ERR_SYS("calloc() error");
+	}
+	stats->tool = tool;
+	stats->op = op;
+	stats->nr_workers = nr_workers;
+	stats->m = m;
+	/* one cache line aligned set per worker, they never share a line */
+	if (posix_memalign((void **)&stats->workers, 64, nr_workers * sizeof(EC_STAT_SET)) != 0) {
+		ERR_QUIT("posix_memalign() error");
+	}
+	memset(stats->workers, 0, nr_workers * sizeof(EC_STAT_SET));
+	/* and so are their fragment histograms, each padded to whole lines */
+	len = (m * EC_STAT_FRAG_OPS * sizeof(EC_STAT_HIST) + 63) & ~63;
+	for (i = 0; i < nr_workers; i++) {
+		if (posix_memalign((void **)&stats->workers[i].frag, 64, len) != 0) {
+			ERR_QUIT("posix_memalign() error");
+		}
+		memset(stats->workers[i].frag, 0, len);
+	}
+	stats->start_ns = ec_stat_now();
+	return stats;
+}
+
+void ec_stats_destroy(EC_STATS *stats)
+{
+	int	i;
+
+	if (stats == NULL) {
+		return;
+	}
+	for (i = 0; i < stats->nr_workers; i++) {
+		free(stats->workers[i].frag);
+	}
+	free(stats->workers);
+	free(stats);
+}
+
+/* the job is over: wall time from ec_stats_create() */
+void ec_stats_done(EC_STATS *stats)
+{
+	stats->wall_ns = ec_stat_now() - stats->start_ns;
+}
+
+static void hist_merge(EC_STAT_HIST *dst, const EC_STAT_HIST *src)
+{
+	int	b;
+
+	dst->count += src->count;
+	dst->bytes += src->bytes;
+	dst->sum_ns += src->sum_ns;
+	if (src->max_ns > dst->max_ns) {
+		dst->max_ns = src->max_ns;
+	}
+	for (b = 0; b < EC_STAT_BUCKETS; b++) {
+		dst->bucket[b] += src->bucket[b];
+	}
+}
+
+/* upper bound of the bucket holding quantile 'q', never above the max seen */
+static uint64_t hist_quantile(const EC_STAT_HIST *hist, double q)
+{
+	uint64_t	rank, seen, bound;
+	int		b;
+
+	if (hist->count == 0) {
+		return 0;
+	}
+	rank = q * hist->count;
+	if (rank < 1) {
+		rank = 1;
+	}
+	for (b = 0, seen = 0; b < EC_STAT_BUCKETS - 1; b++) {
+		if ((seen += hist->bucket[b]) >= rank) {
+			break;
+		}
+	}
+	bound = 2ULL << b;
+	return bound < hist->max_ns ? bound : hist->max_ns;
+}
+
+/* all workers' counters of a stage, or of one fragment io if 'frag' >= 0 */
+static void stats_sum(const EC_STATS *stats, int stage, int frag, int op, EC_STAT_HIST *sum)
+{
+	int	i;
+
+	memset(sum, 0, sizeof(EC_STAT_HIST));
+	for (i = 0; i < stats->nr_workers; i++) {
+		hist_merge(sum, frag < 0 ? &stats->workers[i].stage[stage] : &stats->workers[i].frag[frag * EC_STAT_FRAG_OPS + op]);
+	}
+}
+
+/* time a worker spent working, waiting for work excluded */
+static uint64_t worker_busy_ns(const EC_STAT_SET *set)
+{
+	uint64_t	busy;
+	int		s;
+
+	for (s = 0, busy = 0; s < EC_STAT_STAGES; s++) {
+		if (s != EC_STAT_QUEUE_WAIT) {
+			busy += set->stage[s].sum_ns;
+		}
+	}
+	return busy;
+}
+
+/* busiest worker over the mean, 1.0 when the work is evenly spread */
+static double stats_imbalance(const EC_STATS *stats)
+{
+	uint64_t	busy, max, total;
+	int		i;
+
+	for (i = 0, max = 0, total = 0; i < stats->nr_workers; i++) {
+		busy = worker_busy_ns(&stats->workers[i]);
+		total += busy;
+		if (busy > max) {
+			max = busy;
+		}
+	}
+	return total ? (double)max * stats->nr_workers / total : 1.0;
+}
+
+void ec_stats_report(const EC_STATS *stats)
+{
+	EC_STAT_HIST	sum;
+	int		s;
+
+	for (s = 0; s < EC_STAT_STAGES; s++) {
+		stats_sum(stats, s, -1, 0, &sum);
+		if (sum.count == 0) {
+			continue;
+		}
+		dbg("stage[%s]: count[%lu], bytes[%lu], total[%lu us], mean[%lu us], p99[%lu us], max[%lu us]",
+		    stage_name[s], sum.count, sum.bytes, sum.sum_ns / 1000, sum.sum_ns / sum.count / 1000,
+		    hist_quantile(&sum, 0.99) / 1000, sum.max_ns / 1000);
+	}
+	dbg("workers[%d]: wall[%lu us], imbalance[%.2f]", stats->nr_workers, stats->wall_ns / 1000, stats_imbalance(stats));
+}
+
+/* write to 'path.tmp' and rename, a scraper never reads half a file; "-" is stdout */
+static FILE *stats_open(const char *path, char *tmp, int len)
+{
+	if (strcmp(path, "-") == 0) {
+		return stdout;
+	}
+	snprintf(tmp, len, "%s.tmp", path);
+	return fopen(tmp, "w");
+}
+
+static int stats_close(FILE *fp, const char *path, const char *tmp)
+{
+	int	ret;
+
+	if (fp == stdout) {
+		return fflush(fp) == 0 ? 0 : -1;
+	}
+	ret = ferror(fp) ? -1 : 0;
+	if (fclose(fp) != 0 || ret < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static void json_hist(FILE *fp, const EC_STAT_HIST *hist)
+{
+	int	b, last;
+
+	fprintf(fp, "{\"count\": %lu, \"bytes\": %lu, \"sum_ns\": %lu, \"mean_ns\": %lu, "
+		"\"p50_ns\": %lu, \"p90_ns\": %lu, \"p99_ns\": %lu, \"max_ns\": %lu, \"buckets\": [",
+		hist->count, hist->bytes, hist->sum_ns, hist->count ? hist->sum_ns / hist->count : 0,
+		hist_quantile(hist, 0.5), hist_quantile(hist, 0.9), hist_quantile(hist, 0.99), hist->max_ns);
+	/* bucket b is [2^b, 2^(b+1)) ns, trailing empty ones left out */
+	for (last = EC_STAT_BUCKETS - 1; last >= 0 && hist->bucket[last] == 0; last--)
+		;
+	for (b = 0; b <= last; b++) {
+		fprintf(fp, "%s%lu", b ? ", " : "", hist->bucket[b]);
+	}
+	fprintf(fp, "]}");
+}
+
+int ec_stats_write_json(const EC_STATS *stats, const char *path)
+{
+	EC_STAT_HIST	sum;
+	const EC_STAT_SET	*set;
+	char		tmp[PATH_MAX];
+	FILE		*fp;
+	int		i, s, op;
+
+	if ((fp = stats_open(path, tmp, sizeof(tmp))) == NULL) {
+		return -1;
+	}
+	fprintf(fp, "{\"tool\": \"%s\", \"op\": \"%s\", \"m\": %d, \"workers\": %d, \"wall_ns\": %lu, \"imbalance\": %.3f,\n",
+		stats->tool, stats->op, stats->m, stats->nr_workers, stats->wall_ns, stats_imbalance(stats));
+	fprintf(fp, "  \"stages\": {");
+	for (s = 0; s < EC_STAT_STAGES; s++) {
+		stats_sum(stats, s, -1, 0, &sum);
+		fprintf(fp, "%s\n    \"%s\": ", s ? "," : "", stage_name[s]);
+		json_hist(fp, &sum);
+	}
+	fprintf(fp, "\n  },\n  \"per_worker\": [");
+	for (i = 0; i < stats->nr_workers; i++) {
+		set = &stats->workers[i];
+		fprintf(fp, "%s\n    {\"worker\": %d, \"stripes\": %ld, \"busy_ns\": %lu, \"stages\": {",
+			i ? "," : "", i, set->stripes, worker_busy_ns(set));
+		for (s = 0; s < EC_STAT_STAGES; s++) {
+			fprintf(fp, "%s\n      \"%s\": ", s ? "," : "", stage_name[s]);
+			json_hist(fp, &set->stage[s]);
+		}
+		fprintf(fp, "\n    }}");
+	}
+	fprintf(fp, "\n  ],\n  \"per_fragment\": [");
+	for (i = 0; i < stats->m; i++) {
+		fprintf(fp, "%s\n    {\"fragment\": %d", i ? "," : "", i);
+		for (op = 0; op < EC_STAT_FRAG_OPS; op++) {
+			stats_sum(stats, 0, i, op, &sum);
+			fprintf(fp, ", \"%s\": ", frag_op_name[op]);
+			json_hist(fp, &sum);
+		}
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n  ]\n}\n");
+	return stats_close(fp, path, tmp);
+}
+
+/*
+ * Prometheus text format, for the textfile collector of node_exporter.
+ * Stage latencies are histograms over all workers, the per worker and
+ * per fragment series are plain counters to keep the cardinality low.
+ */
+int ec_stats_write_prom(const EC_STATS *stats, const char *path)
+{
+	EC_STAT_HIST	sum;
+	char		tmp[PATH_MAX], labels[128];
+	FILE		*fp;
+	uint64_t	cumul;
+	int		i, s, b, op;
+
+	if ((fp = stats_open(path, tmp, sizeof(tmp))) == NULL) {
+		return -1;
+	}
+	snprintf(labels, sizeof(labels), "tool=\"%s\",op=\"%s\"", stats->tool, stats->op);
+
+	fprintf(fp, "# HELP ec_stage_seconds Latency of the stages of the encode/decode hot path.\n"
+		"# TYPE ec_stage_seconds histogram\n");
+	for (s = 0; s < EC_STAT_STAGES; s++) {
+		stats_sum(stats, s, -1, 0, &sum);
+		for (b = 0, cumul = 0; b < EC_STAT_BUCKETS - 1; b++) {
+			cumul += sum.bucket[b];
+			fprintf(fp, "ec_stage_seconds_bucket{%s,stage=\"%s\",le=\"%g\"} %lu\n",
+				labels, stage_name[s], (double)(2ULL << b) / 1e9, cumul);
+		}
+		fprintf(fp, "ec_stage_seconds_bucket{%s,stage=\"%s\",le=\"+Inf\"} %lu\n", labels, stage_name[s], sum.count);
+		fprintf(fp, "ec_stage_seconds_sum{%s,stage=\"%s\"} %.9f\n", labels, stage_name[s], sum.sum_ns / 1e9);
+		fprintf(fp, "ec_stage_seconds_count{%s,stage=\"%s\"} %lu\n", labels, stage_name[s], sum.count);
+	}
+	fprintf(fp, "# HELP ec_stage_bytes_total Bytes through each stage.\n# TYPE ec_stage_bytes_total counter\n");
+	for (s = 0; s < EC_STAT_STAGES; s++) {
+		stats_sum(stats, s, -1, 0, &sum);
+		fprintf(fp, "ec_stage_bytes_total{%s,stage=\"%s\"} %lu\n", labels, stage_name[s], sum.bytes);
+	}
+
+	fprintf(fp, "# HELP ec_worker_stage_seconds_total Time of each worker in each stage.\n"
+		"# TYPE ec_worker_stage_seconds_total counter\n");
+	for (i = 0; i < stats->nr_workers; i++) {
+		for (s = 0; s < EC_STAT_STAGES; s++) {
+			fprintf(fp, "ec_worker_stage_seconds_total{%s,worker=\"%d\",stage=\"%s\"} %.9f\n",
+				labels, i, stage_name[s], stats->workers[i].stage[s].sum_ns / 1e9);
+		}
+	}
+	fprintf(fp, "# HELP ec_worker_stripes_total Stripes done by each worker.\n# TYPE ec_worker_stripes_total counter\n");
+	for (i = 0; i < stats->nr_workers; i++) {
+		fprintf(fp, "ec_worker_stripes_total{%s,worker=\"%d\"} %ld\n", labels, i, stats->workers[i].stripes);
+	}
+
+	fprintf(fp, "# HELP ec_fragment_io_seconds_total Io time on each fragment file.\n"
+		"# TYPE ec_fragment_io_seconds_total counter\n");
+	for (i = 0; i < stats->m; i++) {
+		for (op = 0; op < EC_STAT_FRAG_OPS; op++) {
+			stats_sum(stats, 0, i, op, &sum);
+			fprintf(fp, "ec_fragment_io_seconds_total{%s,fragment=\"%d\",io=\"%s\"} %.9f\n",
+				labels, i, frag_op_name[op], sum.sum_ns / 1e9);
+		}
+	}
+	fprintf(fp, "# HELP ec_fragment_io_bytes_total Bytes of io on each fragment file.\n"
+		"# TYPE ec_fragment_io_bytes_total counter\n");
+	for (i = 0; i < stats->m; i++) {
+		for (op = 0; op < EC_STAT_FRAG_OPS; op++) {
+			stats_sum(stats, 0, i, op, &sum);
+			fprintf(fp, "ec_fragment_io_bytes_total{%s,fragment=\"%d\",io=\"%s\"} %lu\n",
+				labels, i, frag_op_name[op], sum.bytes);
+		}
+	}
+	fprintf(fp, "# HELP ec_fragment_io_max_seconds Slowest io on each fragment file.\n"
+		"# TYPE ec_fragment_io_max_seconds gauge\n");
+	for (i = 0; i < stats->m; i++) {
+		for (op = 0; op < EC_STAT_FRAG_OPS; op++) {
+			stats_sum(stats, 0, i, op, &sum);
+			fprintf(fp, "ec_fragment_io_max_seconds{%s,fragment=\"%d\",io=\"%s\"} %.9f\n",
+				labels, i, frag_op_name[op], sum.max_ns / 1e9);
+		}
+	}
+
+	fprintf(fp, "# HELP ec_wall_seconds Wall time of the job.\n# TYPE ec_wall_seconds gauge\n"
+		"ec_wall_seconds{%s} %.9f\n", labels, stats->wall_ns / 1e9);
+	fprintf(fp, "# HELP ec_worker_imbalance_ratio Busiest worker over the mean, 1 is even.\n"
+		"# TYPE ec_worker_imbalance_ratio gauge\nec_worker_imbalance_ratio{%s} %.3f\n", labels, stats_imbalance(stats));
+	return stats_close(fp, path, tmp);
+}
+
+/* end of the job: report the stages, export them to 'json' and 'prom' if not NULL */
+void ec_stats_export(EC_STATS *stats, const char *json, const char *prom)
+{
+	ec_stats_done(stats);
+	ec_stats_report(stats);
+	if (json != NULL && ec_stats_write_json(stats, json) < 0) {
+		ERR_MSG("write stats to '%s' error", json);
+	}
+	if (prom != NULL && ec_stats_write_prom(stats, prom) < 0) {
+		ERR_MSG("write stats to '%s' error", prom);
+	}
+}
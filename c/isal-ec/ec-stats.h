@@ -0,0 +1,92 @@
+#ifndef __EC_STATS_H__
+#define __EC_STATS_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/* stages of the encode/decode hot path */
+#define EC_STAT_READ		0	/* origin or fragment reads */
+#define EC_STAT_COMPUTE		1	/* ec_encode_data, of an encode or a decode */
+#define EC_STAT_TABLES		2	/* encode/decode table setup */
+#define EC_STAT_WRITE		3	/* fragment or output writes */
+#define EC_STAT_QUEUE_WAIT	4	/* waiting for work: stripe queue, aio completions */
+#define EC_STAT_STAGES		5
+
+/* io of one fragment file */
+#define EC_STAT_FRAG_READ	0
+#define EC_STAT_FRAG_WRITE	1
+#define EC_STAT_FRAG_OPS	2
+
+/* log2 latency histogram: bucket b counts [2^b, 2^(b+1)) ns, the last one all above */
+#define EC_STAT_BUCKETS		40
+
+typedef struct ec_stat_hist {
+	uint64_t	count;
+	uint64_t	bytes;
+	uint64_t	sum_ns;
+	uint64_t	max_ns;
+	uint64_t	bucket[EC_STAT_BUCKETS];
+} EC_STAT_HIST;
+
+/* counters of one worker, only that worker updates them: no lock, no atomic */
+typedef struct ec_stat_set {
+	EC_STAT_HIST	stage[EC_STAT_STAGES];
+	EC_STAT_HIST	*frag;		/* m * EC_STAT_FRAG_OPS, by fragment index */
+	int64_t		stripes;
+} __attribute__((aligned(64))) EC_STAT_SET;
+
+typedef struct ec_stats {
+	const char	*tool;
+	const char	*op;		/* encode, decode, ... */
+	int		nr_workers;
+	int		m;
+	uint64_t	start_ns;
+	uint64_t	wall_ns;	/* set by ec_stats_done() */
+	EC_STAT_SET	*workers;
+} EC_STATS;
+
+static inline uint64_t ec_stat_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void ec_stat_hist_count(EC_STAT_HIST *hist, uint64_t ns, int64_t bytes)
+{
+	int	b;
+
+	b = 63 - __builtin_clzll(ns | 1);
+	hist->count++;
+	hist->bytes += bytes;
+	hist->sum_ns += ns;
+	if (ns > hist->max_ns) {
+		hist->max_ns = ns;
+	}
+	hist->bucket[b < EC_STAT_BUCKETS ? b : EC_STAT_BUCKETS - 1]++;
+}
+
+/* count an event of 'bytes' that started at 'start', return its end to time the next stage from */
+static inline uint64_t ec_stat_hist_add(EC_STAT_HIST *hist, uint64_t start, int64_t bytes)
+{
+	uint64_t	now;
+
+	now = ec_stat_now();
+	ec_stat_hist_count(hist, now - start, bytes);
+	return now;
+}
+
+#define ec_stat_add(set, st, start, bytes)		ec_stat_hist_add(&(set)->stage[st], start, bytes)
+#define ec_stat_count(set, st, ns, bytes)		ec_stat_hist_count(&(set)->stage[st], ns, bytes)
+#define ec_stat_frag_add(set, f, op, start, bytes)	ec_stat_hist_add(&(set)->frag[(f) * EC_STAT_FRAG_OPS + (op)], start, bytes)
+
+EC_STATS	*ec_stats_create(const char *tool, const char *op, int nr_workers, int m);
+void	ec_stats_destroy(EC_STATS *stats);
+void	ec_stats_done(EC_STATS *stats);
+void	ec_stats_report(const EC_STATS *stats);
+int	ec_stats_write_json(const EC_STATS *stats, const char *path);
+int	ec_stats_write_prom(const EC_STATS *stats, const char *path);
+void	ec_stats_export(EC_STATS *stats, const char *json, const char *prom);
+
+#endif
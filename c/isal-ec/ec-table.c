@@ -0,0 +1,610 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <isa-l.h>
+
+#include "common.h"
+#include "error.h"
+#include "ec-table.h"
+#include "ec-tables-builtin.h"
+
+#define EC_DEC_CACHE_BUCKETS	64
+#define EC_DEC_CACHE_MAGIC	0x54444345	/* "ECDT" */
+#define EC_DEC_CACHE_VERSION	2	/* 2: crc32c trailer */
+#define EC_DEC_CACHE_FILE_MAX	(64 * 1024 * 1024)
+
+/*
+ * Messages of the tables and the decode cache. The tools print them on
+ * stderr; built into libec (LIBEC) they go to the ec_set_log() hook of
+ * the caller, nothing is printed without one.
+ */
+static void (*ec_table_log)(const char *msg);
+
+void ec_table_set_log(void (*log)(const char *msg))
+{
+	ec_table_log = log;
+}
+
+#ifdef LIBEC
+static void ec_table_msg(int with_errno, const char *fmt, ...)
+{
+	char	buf[512];
+	int	n, error = errno;
+	va_list	ap;
+
+	if (ec_table_log == NULL) {
+		return;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (with_errno && n >= 0 && n < sizeof(buf)) {
+		snprintf(buf + n, sizeof(buf) - n, ": %s", strerror(error));
+	}
+	ec_table_log(buf);
+}
+
+#define TBL_DBG(fmt, args...)	ec_table_msg(0, fmt, ## args)
+#define TBL_MSG(fmt, args...)	ec_table_msg(0, fmt, ## args)
+#define TBL_RET(fmt, args...)	ec_table_msg(1, fmt, ## args)
+#else
+#define TBL_DBG(fmt, args...)	dbg(fmt, ## args)
+#define TBL_MSG(fmt, args...)	ERR_MSG(fmt, ## args)
+#define TBL_RET(fmt, args...)	ERR_RET(fmt, ## args)
+#endif
+
+int gf_gen_decode_matrix_simple(u8 * encode_matrix,
+                                u8 * decode_matrix,
+                                u8 * invert_matrix,
+                                u8 * temp_matrix,
+                                u8 * decode_index, u8 * frag_err_list, int nerrs, int k,
+                                int m)
+{
+        int i, j, p, r;
+        int nsrcerrs = 0;
+        u8 s, *b = temp_matrix;
+        u8 frag_in_err[M_K_P_MAX];
+
+        memset(frag_in_err, 0, sizeof(frag_in_err));
+
+        // Order the fragments in erasure for easier sorting
+        for (i = 0; i < nerrs; i++) {
+                if (frag_err_list[i] < k)
+                        nsrcerrs++;
+                frag_in_err[frag_err_list[i]] = 1;
+        }
+
+        // Construct b (matrix that encoded remaining frags) by removing erased rows
+        for (i = 0, r = 0; i < k; i++, r++) {
+                while (frag_in_err[r])
+                        r++;
+                for (j = 0; j < k; j++)
+                        b[k * i + j] = encode_matrix[k * r + j];
+                decode_index[i] = r;
+        }
+
+        // Invert matrix to get recovery matrix
+        if (gf_invert_matrix(b, invert_matrix, k) < 0)
+                return -1;
+
+        // Get decode matrix with only wanted recovery rows
+        for (i = 0; i < nerrs; i++) {
+                if (frag_err_list[i] < k)       // A src err
+                        for (j = 0; j < k; j++)
+                                decode_matrix[k * i + j] =
+                                    invert_matrix[k * frag_err_list[i] + j];
+        }
+
+        // For non-src (parity) erasures need to multiply encode matrix * invert
+        for (p = 0; p < nerrs; p++) {
+                if (frag_err_list[p] >= k) {    // A parity err
+                        for (i = 0; i < k; i++) {
+                                s = 0;
+                                for (j = 0; j < k; j++)
+                                        s ^= gf_mul(invert_matrix[j * k + i],
+                                                    encode_matrix[k * frag_err_list[p] + j]);
+                                decode_matrix[k * p + i] = s;
+                        }
+                }
+        }
+        return 0;
+}
+
+/*
+ * Encode tables depend only on (k, p). The encode matrices of the standard
+ * profiles are generated at build time by gen-ec-tables. g_tbls are always
+ * built by ec_init_tables() at run time, their layout follows the isa-l code
+ * path of this CPU. Each profile is built once per process on first use and
+ * shared by all threads. NULL with errno ENOMEM if it can't be allocated.
+ */
+typedef struct ec_encode_tables_node {
+	EC_ENC_TBLS	tbls;
+	struct ec_encode_tables_node	*next;
+} EC_ENC_TBLS_NODE;
+
+static pthread_mutex_t	enc_tbls_lock = PTHREAD_MUTEX_INITIALIZER;
+static EC_ENC_TBLS_NODE	*enc_tbls_list;
+
+const EC_ENC_TBLS *ec_enc_tables_get(int k, int p)
+{
+	EC_ENC_TBLS_NODE	*node;
+	const u8		*builtin = NULL;
+	u8			*encode_matrix = NULL;
+	void			*g_tbls;
+	int			i;
+
+	pthread_mutex_lock(&enc_tbls_lock);
+	for (node = enc_tbls_list; node != NULL; node = node->next) {
+		if (node->tbls.k == k && node->tbls.p == p) {
+			pthread_mutex_unlock(&enc_tbls_lock);
+			return &node->tbls;
+		}
+	}
+	for (i = 0; i < sizeof(ec_builtin_enc_tbls) / sizeof(ec_builtin_enc_tbls[0]); i++) {
+		if (ec_builtin_enc_tbls[i].k == k && ec_builtin_enc_tbls[i].p == p) {
+			builtin = ec_builtin_enc_tbls[i].encode_matrix;
+		}
+	}
+	node = malloc(sizeof(EC_ENC_TBLS_NODE));
+	if (builtin == NULL) {
+		encode_matrix = malloc((k + p) * k);
+	}
+	if (node == NULL || (builtin == NULL && encode_matrix == NULL) || posix_memalign(&g_tbls, 64, k * p * 32) != 0) {
+		pthread_mutex_unlock(&enc_tbls_lock);
+		free(node);
+		free(encode_matrix);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (builtin != NULL) {
+		encode_matrix = (u8 *)builtin;
+	}
+	else {
+		gf_gen_cauchy1_matrix(encode_matrix, k + p, k);
+	}
+	// Initialize g_tbls from encode matrix
+	ec_init_tables(k, p, &encode_matrix[k * k], g_tbls);
+	node->tbls.k = k;
+	node->tbls.p = p;
+	node->tbls.encode_matrix = encode_matrix;
+	node->tbls.g_tbls = g_tbls;
+	node->next = enc_tbls_list;
+	enc_tbls_list = node;
+	pthread_mutex_unlock(&enc_tbls_lock);
+	TBL_DBG("generated encode tables for k[%d], p[%d]", k, p);
+
+	return &node->tbls;
+}
+
+/*
+ * In-process LRU cache of decode tables keyed by (k, p, sorted frag_err_list).
+ * Entries handed out by ec_dec_cache_get() are pinned by a reference count,
+ * an evicted entry is freed by its last ec_dec_cache_put().
+ * With a cache file, the decode matrices are loaded at init and saved at
+ * release, so repeated erasure patterns skip the matrix inversion across runs.
+ */
+static struct {
+	pthread_mutex_t	lock;
+	int		max_entries;
+	int		nr_entries;
+	int		dirty;
+	char		path[PATH_MAX];
+	EC_DEC_TBLS	*lru_head;	/* most recently used */
+	EC_DEC_TBLS	*lru_tail;
+	EC_DEC_TBLS	*bucket[EC_DEC_CACHE_BUCKETS];
+} dec_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.max_entries = EC_DEC_CACHE_DEFAULT,
+};
+
+static unsigned int dec_cache_hash(int k, int p, const u8 *frag_err_list, int nerrs)
+{
+	unsigned int	h;
+	int		i;
+
+	h = (k * 31 + p) * 31 + nerrs;
+	for (i = 0; i < nerrs; i++) {
+		h = h * 31 + frag_err_list[i];
+	}
+	return h % EC_DEC_CACHE_BUCKETS;
+}
+
+static void dec_tbls_free(EC_DEC_TBLS *tbls)
+{
+	free(tbls->decode_matrix);
+	free(tbls->g_tbls);
+	free(tbls);
+}
+
+static EC_DEC_TBLS *dec_tbls_alloc(int k, int p, const u8 *frag_err_list, int nerrs)
+{
+	EC_DEC_TBLS	*tbls;
+
+	tbls = malloc(sizeof(EC_DEC_TBLS));
+	if (tbls == NULL) {
+		return NULL;
+	}
+	memset(tbls, 0, sizeof(EC_DEC_TBLS));
+	tbls->k = k;
+	tbls->p = p;
+	tbls->nerrs = nerrs;
+	memcpy(tbls->frag_err_list, frag_err_list, nerrs);
+	for (tbls->nsrcerrs = 0; tbls->nsrcerrs < nerrs && frag_err_list[tbls->nsrcerrs] < k; tbls->nsrcerrs++)
+		;
+	tbls->decode_matrix = malloc(k * nerrs);
+	tbls->g_tbls = malloc(k * nerrs * 32);
+	if (tbls->decode_matrix == NULL || tbls->g_tbls == NULL) {
+		dec_tbls_free(tbls);
+		return NULL;
+	}
+	return tbls;
+}
+
+/* build decode_index and decode_matrix from scratch, NULL if not decodable or errno ENOMEM */
+static EC_DEC_TBLS *dec_tbls_generate(int k, int p, const u8 *frag_err_list, int nerrs)
+{
+	EC_DEC_TBLS	*tbls;
+	const EC_ENC_TBLS	*enc_tbls;
+	u8		*invert_matrix, *temp_matrix;
+	int		m = k + p, ret;
+
+	if ((tbls = dec_tbls_alloc(k, p, frag_err_list, nerrs)) == NULL
+		|| (enc_tbls = ec_enc_tables_get(k, p)) == NULL) {
+		goto nomem;
+	}
+	invert_matrix = malloc(m * k);
+	temp_matrix = malloc(m * k);
+	if (invert_matrix == NULL || temp_matrix == NULL) {
+		free(invert_matrix);
+		free(temp_matrix);
+		goto nomem;
+	}
+	ret = gf_gen_decode_matrix_simple((u8 *)enc_tbls->encode_matrix, tbls->decode_matrix, invert_matrix, temp_matrix,
+					  tbls->decode_index, tbls->frag_err_list, nerrs, k, m);
+	free(invert_matrix);
+	free(temp_matrix);
+	if (ret != 0) {
+		dec_tbls_free(tbls);
+		return NULL;
+	}
+	ec_init_tables(k, nerrs, tbls->decode_matrix, tbls->g_tbls);
+	return tbls;
+nomem:
+	if (tbls != NULL) {
+		dec_tbls_free(tbls);
+	}
+	errno = ENOMEM;
+	return NULL;
+}
+
+static void dec_cache_lru_unlink(EC_DEC_TBLS *tbls)
+{
+	if (tbls->lru_prev) tbls->lru_prev->lru_next = tbls->lru_next;
+	else dec_cache.lru_head = tbls->lru_next;
+	if (tbls->lru_next) tbls->lru_next->lru_prev = tbls->lru_prev;
+	else dec_cache.lru_tail = tbls->lru_prev;
+	tbls->lru_prev = tbls->lru_next = NULL;
+}
+
+static void dec_cache_lru_push(EC_DEC_TBLS *tbls)
+{
+	tbls->lru_prev = NULL;
+	tbls->lru_next = dec_cache.lru_head;
+	if (dec_cache.lru_head) dec_cache.lru_head->lru_prev = tbls;
+	dec_cache.lru_head = tbls;
+	if (dec_cache.lru_tail == NULL) dec_cache.lru_tail = tbls;
+}
+
+static EC_DEC_TBLS *dec_cache_lookup(int k, int p, const u8 *frag_err_list, int nerrs)
+{
+	EC_DEC_TBLS	*tbls;
+
+	tbls = dec_cache.bucket[dec_cache_hash(k, p, frag_err_list, nerrs)];
+	for (; tbls != NULL; tbls = tbls->hash_next) {
+		if (tbls->k == k && tbls->p == p && tbls->nerrs == nerrs
+			&& memcmp(tbls->frag_err_list, frag_err_list, nerrs) == 0) {
+			return tbls;
+		}
+	}
+	return NULL;
+}
+
+static void dec_cache_remove(EC_DEC_TBLS *tbls)
+{
+	EC_DEC_TBLS	**pp;
+
+	pp = &dec_cache.bucket[dec_cache_hash(tbls->k, tbls->p, tbls->frag_err_list, tbls->nerrs)];
+	for (; *pp != NULL; pp = &(*pp)->hash_next) {
+		if (*pp == tbls) {
+			*pp = tbls->hash_next;
+			break;
+		}
+	}
+	dec_cache_lru_unlink(tbls);
+	tbls->hash_next = NULL;
+	tbls->cached = 0;
+	dec_cache.nr_entries--;
+	if (tbls->refcnt == 0) {
+		dec_tbls_free(tbls);
+	}
+}
+
+/* insert as most recently used, evict from the LRU tail beyond max_entries */
+static void dec_cache_insert(EC_DEC_TBLS *tbls)
+{
+	unsigned int	h;
+
+	h = dec_cache_hash(tbls->k, tbls->p, tbls->frag_err_list, tbls->nerrs);
+	tbls->hash_next = dec_cache.bucket[h];
+	dec_cache.bucket[h] = tbls;
+	tbls->cached = 1;
+	dec_cache_lru_push(tbls);
+	dec_cache.nr_entries++;
+	while (dec_cache.nr_entries > dec_cache.max_entries) {
+		dec_cache_remove(dec_cache.lru_tail);
+	}
+}
+
+/*
+ * An entry is used to index frags[] by the decoders: all fragments < k + p,
+ * the erasures strictly ascending, the decode sources distinct and not erased.
+ */
+static int dec_cache_entry_ok(int k, int p, const u8 *frag_err_list, int nerrs, const u8 *decode_index)
+{
+	u8	used[M_K_P_MAX];
+	int	i;
+
+	memset(used, 0, sizeof(used));
+	for (i = 0; i < nerrs; i++) {
+		if (frag_err_list[i] >= k + p || (i > 0 && frag_err_list[i] <= frag_err_list[i - 1])) {
+			return 0;
+		}
+		used[frag_err_list[i]] = 1;
+	}
+	for (i = 0; i < k; i++) {
+		if (decode_index[i] >= k + p || used[decode_index[i]]) {
+			return 0;
+		}
+		used[decode_index[i]] = 1;
+	}
+	return 1;
+}
+
+/*
+ * File layout: magic, version, nr_entries (uint32 each), then per entry
+ * k, p, nerrs (u8 each), frag_err_list, decode_index, decode_matrix, and a
+ * crc32c of all the bytes before it at the end.
+ */
+static void dec_cache_load(const char *path)
+{
+	int		fd, i, k, p, nerrs, nr_bad;
+	struct stat	st;
+	uint32_t	hdr[3], crc;
+	u8		*buf, *cur, *end, *frag_err_list, *decode_index, *decode_matrix;
+	EC_DEC_TBLS	*tbls;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		TBL_DBG("open('%s') error, start with an empty decode cache", path);
+		return;
+	}
+	buf = NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(hdr) + sizeof(crc) || st.st_size > EC_DEC_CACHE_FILE_MAX
+		|| (buf = malloc(st.st_size)) == NULL || readn(fd, buf, st.st_size) != st.st_size) {
+		goto bad;
+	}
+	end = buf + st.st_size - sizeof(crc);
+	memcpy(hdr, buf, sizeof(hdr));
+	memcpy(&crc, end, sizeof(crc));
+	if (hdr[0] != EC_DEC_CACHE_MAGIC || hdr[1] != EC_DEC_CACHE_VERSION
+		|| crc32_iscsi(buf, end - buf, 0xFFFFFFFF) != crc) {
+		goto bad;
+	}
+	/* the file is saved MRU first, fill from the LRU end to keep the order */
+	cur = buf + sizeof(hdr);
+	for (i = 0, nr_bad = 0; i < hdr[2]; i++) {
+		if (end - cur < 3) {
+			break;
+		}
+		k = cur[0];
+		p = cur[1];
+		nerrs = cur[2];
+		cur += 3;
+		if (k < 1 || p < 1 || k + p >= M_K_P_MAX || nerrs < 1 || nerrs > p
+			|| end - cur < nerrs + k + k * nerrs) {
+			break;
+		}
+		frag_err_list = cur;
+		decode_index = frag_err_list + nerrs;
+		decode_matrix = decode_index + k;
+		cur = decode_matrix + k * nerrs;
+		if (!dec_cache_entry_ok(k, p, frag_err_list, nerrs, decode_index)) {
+			nr_bad++;
+			continue;
+		}
+		if (dec_cache.nr_entries >= dec_cache.max_entries
+			|| dec_cache_lookup(k, p, frag_err_list, nerrs) != NULL) {
+			continue;
+		}
+		if ((tbls = dec_tbls_alloc(k, p, frag_err_list, nerrs)) == NULL) {
+			break;
+		}
+		memcpy(tbls->decode_index, decode_index, k);
+		memcpy(tbls->decode_matrix, decode_matrix, k * nerrs);
+		ec_init_tables(k, nerrs, tbls->decode_matrix, tbls->g_tbls);
+		dec_cache_insert(tbls);
+		/* keep file order: move the new entry behind the older ones */
+		dec_cache_lru_unlink(tbls);
+		tbls->lru_prev = dec_cache.lru_tail;
+		if (dec_cache.lru_tail) dec_cache.lru_tail->lru_next = tbls;
+		else dec_cache.lru_head = tbls;
+		dec_cache.lru_tail = tbls;
+	}
+	if (nr_bad > 0) {
+		TBL_MSG("'%s': [%d] invalid decode tables dropped", path, nr_bad);
+	}
+	free(buf);
+	close(fd);
+	TBL_DBG("loaded [%d] decode tables from '%s'", dec_cache.nr_entries, path);
+	return;
+bad:
+	TBL_MSG("'%s' isn't a valid decode cache file, ignore it", path);
+	free(buf);
+	close(fd);
+}
+
+static void dec_cache_save(const char *path)
+{
+	int		fd;
+	size_t		size;
+	uint32_t	hdr[3], crc;
+	u8		*buf, *cur;
+	char		tmpname[PATH_MAX + 8];
+	EC_DEC_TBLS	*tbls;
+
+	/* built in memory, the crc goes at the end */
+	size = sizeof(hdr) + sizeof(crc);
+	for (tbls = dec_cache.lru_head; tbls != NULL; tbls = tbls->lru_next) {
+		size += 3 + tbls->nerrs + tbls->k + tbls->k * tbls->nerrs;
+	}
+	if ((buf = malloc(size)) == NULL) {
+		TBL_RET("malloc() error, decode cache isn't saved");
+		return;
+	}
+	hdr[0] = EC_DEC_CACHE_MAGIC;
+	hdr[1] = EC_DEC_CACHE_VERSION;
+	hdr[2] = dec_cache.nr_entries;
+	memcpy(buf, hdr, sizeof(hdr));
+	cur = buf + sizeof(hdr);
+	for (tbls = dec_cache.lru_head; tbls != NULL; tbls = tbls->lru_next) {
+		*cur++ = tbls->k;
+		*cur++ = tbls->p;
+		*cur++ = tbls->nerrs;
+		memcpy(cur, tbls->frag_err_list, tbls->nerrs);
+		cur += tbls->nerrs;
+		memcpy(cur, tbls->decode_index, tbls->k);
+		cur += tbls->k;
+		memcpy(cur, tbls->decode_matrix, tbls->k * tbls->nerrs);
+		cur += tbls->k * tbls->nerrs;
+	}
+	crc = crc32_iscsi(buf, cur - buf, 0xFFFFFFFF);
+	memcpy(cur, &crc, sizeof(crc));
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", path);
+	if ((fd = open(tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+		TBL_RET("open('%s') error, decode cache isn't saved", tmpname);
+		free(buf);
+		return;
+	}
+	if (writen(fd, buf, size) != size) {
+		TBL_RET("writen('%s') error, decode cache isn't saved", tmpname);
+		close(fd);
+		unlink(tmpname);
+		free(buf);
+		return;
+	}
+	free(buf);
+	close(fd);
+	if (rename(tmpname, path) < 0) {
+		TBL_RET("rename('%s', '%s') error", tmpname, path);
+		unlink(tmpname);
+	}
+}
+
+/* set the LRU bound and an optional cache file (NULL: in-process only) */
+void ec_dec_cache_init(int max_entries, const char *path)
+{
+	pthread_mutex_lock(&dec_cache.lock);
+	if (max_entries > 0) {
+		dec_cache.max_entries = max_entries;
+	}
+	while (dec_cache.nr_entries > dec_cache.max_entries) {
+		dec_cache_remove(dec_cache.lru_tail);
+	}
+	if (path != NULL) {
+		strncpy(dec_cache.path, path, sizeof(dec_cache.path) - 1);
+		dec_cache_load(path);
+	}
+	pthread_mutex_unlock(&dec_cache.lock);
+}
+
+/*
+ * Get the decode tables for an erasure pattern, the list needn't be sorted.
+ * Returns NULL if the pattern isn't decodable or on allocation failure (errno
+ * ENOMEM), release with ec_dec_cache_put().
+ */
+EC_DEC_TBLS *ec_dec_cache_get(int k, int p, const u8 *frag_err_list, int nerrs)
+{
+	u8		sorted[M_K_P_MAX], t;
+	int		i, j;
+	EC_DEC_TBLS	*tbls;
+
+	if (nerrs < 1 || nerrs > p) {
+		return NULL;
+	}
+	memcpy(sorted, frag_err_list, nerrs);
+	for (i = 1; i < nerrs; i++) {
+		for (j = i; j > 0 && sorted[j - 1] > sorted[j]; j--) {
+			t = sorted[j];
+			sorted[j] = sorted[j - 1];
+			sorted[j - 1] = t;
+		}
+	}
+
+	pthread_mutex_lock(&dec_cache.lock);
+	if ((tbls = dec_cache_lookup(k, p, sorted, nerrs)) != NULL) {
+		dec_cache_lru_unlink(tbls);
+		dec_cache_lru_push(tbls);
+		tbls->refcnt++;
+		pthread_mutex_unlock(&dec_cache.lock);
+		return tbls;
+	}
+	pthread_mutex_unlock(&dec_cache.lock);
+
+	/* miss: generate without the lock, a racing duplicate stays uncached and is freed by its put */
+	if ((tbls = dec_tbls_generate(k, p, sorted, nerrs)) == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&dec_cache.lock);
+	if (dec_cache_lookup(k, p, sorted, nerrs) == NULL) {
+		dec_cache_insert(tbls);
+		dec_cache.dirty = 1;
+	}
+	tbls->refcnt++;
+	pthread_mutex_unlock(&dec_cache.lock);
+	return tbls;
+}
+
+void ec_dec_cache_put(EC_DEC_TBLS *tbls)
+{
+	if (tbls == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&dec_cache.lock);
+	if (--tbls->refcnt == 0 && !tbls->cached) {
+		dec_tbls_free(tbls);
+	}
+	pthread_mutex_unlock(&dec_cache.lock);
+}
+
+/* save to the cache file if new patterns were generated, then drop all unpinned entries */
+void ec_dec_cache_release(void)
+{
+	pthread_mutex_lock(&dec_cache.lock);
+	if (dec_cache.path[0] != '\0' && dec_cache.dirty) {
+		dec_cache_save(dec_cache.path);
+		dec_cache.dirty = 0;
+	}
+	while (dec_cache.lru_tail != NULL) {
+		dec_cache_remove(dec_cache.lru_tail);
+	}
+	pthread_mutex_unlock(&dec_cache.lock);
+}
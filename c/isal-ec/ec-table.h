@@ -0,0 +1,49 @@
+#ifndef __EC_TABLE_H__
+#define __EC_TABLE_H__
+
+#define M_K_P_MAX	255
+#define EC_DEC_CACHE_DEFAULT	64	/* max erasure patterns kept in the decode cache */
+
+typedef unsigned char u8;
+
+/* encode matrix and g_tbls for one (k, p), shared read-only and never freed */
+typedef struct ec_encode_tables {
+	int		k;
+	int		p;
+	const u8	*encode_matrix;	/* (k + p) * k, cauchy1 */
+	const u8	*g_tbls;	/* k * p * 32, 64 bytes aligned */
+} EC_ENC_TBLS;
+
+/* decode matrix and g_tbls for one (k, p, sorted frag_err_list) */
+typedef struct ec_decode_tables {
+	int		k;
+	int		p;
+	int		nerrs;
+	int		nsrcerrs;	/* lost data fragments, they come first in frag_err_list */
+	u8		frag_err_list[M_K_P_MAX];
+	u8		decode_index[M_K_P_MAX];
+	u8		*decode_matrix;	/* nerrs * k */
+	u8		*g_tbls;	/* nerrs * k * 32, row r recovers frag_err_list[r] */
+
+	/* cache bookkeeping */
+	int		refcnt;
+	int		cached;
+	struct ec_decode_tables	*lru_prev;
+	struct ec_decode_tables	*lru_next;
+	struct ec_decode_tables	*hash_next;
+} EC_DEC_TBLS;
+
+int	gf_gen_decode_matrix_simple(u8 *encode_matrix, u8 *decode_matrix, u8 *invert_matrix,
+				    u8 *temp_matrix, u8 *decode_index, u8 *frag_err_list, int nerrs, int k, int m);
+
+const EC_ENC_TBLS	*ec_enc_tables_get(int k, int p);
+
+void	ec_dec_cache_init(int max_entries, const char *path);
+EC_DEC_TBLS	*ec_dec_cache_get(int k, int p, const u8 *frag_err_list, int nerrs);
+void	ec_dec_cache_put(EC_DEC_TBLS *tbls);
+void	ec_dec_cache_release(void);
+
+/* where the messages of a libec build (LIBEC) go, see ec_set_log() */
+void	ec_table_set_log(void (*log)(const char *msg));
+
+#endif
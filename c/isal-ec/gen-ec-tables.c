@@ -0,0 +1,54 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <isa-l.h>
+
+#include "ec-table.h"
+
+/*
+ * Print the encode matrix of the standard (k, p) profiles as C arrays, the
+ * Makefile writes them to ec-tables-builtin.h. g_tbls aren't baked: their
+ * layout depends on the isa-l code path picked at run time for the CPU.
+ */
+static const int profiles[][2] = {
+	{ 6, 3 },
+	{ 10, 4 },
+	{ 12, 4 },
+};
+
+static void print_array(const char *name, const u8 *a, int len)
+{
+	int	i;
+
+	printf("static const u8 %s[%d] = {", name, len);
+	for (i = 0; i < len; i++) {
+		printf("%s0x%02x,", (i % 16) ? " " : "\n\t", a[i]);
+	}
+	printf("\n};\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	u8	encode_matrix[M_K_P_MAX * M_K_P_MAX];
+	char	name[64];
+	int	i, k, p, nr_profiles;
+
+	nr_profiles = sizeof(profiles) / sizeof(profiles[0]);
+	printf("/* generated by gen-ec-tables, don't edit */\n");
+	printf("#ifndef __EC_TABLES_BUILTIN_H__\n#define __EC_TABLES_BUILTIN_H__\n\n");
+	for (i = 0; i < nr_profiles; i++) {
+		k = profiles[i][0];
+		p = profiles[i][1];
+		gf_gen_cauchy1_matrix(encode_matrix, k + p, k);
+		snprintf(name, sizeof(name), "ec_builtin_%d_%d_matrix", k, p);
+		print_array(name, encode_matrix, (k + p) * k);
+	}
+	printf("static const EC_ENC_TBLS ec_builtin_enc_tbls[] = {\n");
+	for (i = 0; i < nr_profiles; i++) {
+		k = profiles[i][0];
+		p = profiles[i][1];
+		printf("\t{ %d, %d, ec_builtin_%d_%d_matrix, NULL },\n", k, p, k, p);
+	}
+	printf("};\n\n#endif\n");
+
+	return 0;
+}
@@ -0,0 +1,525 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <isa-l.h>
+
+#include "common.h"
+#include "error.h"
+#include "bufpool.h"
+#include "ec-table.h"
+#include "bench-util.h"
+
+#define K_DEFAULT	6
+#define P_DEFAULT	3
+#define LEN_MIN_DEFAULT	(4 * 1024)
+#define LEN_MAX_DEFAULT	(64 * 1024 * 1024)
+#define BUDGET_DEFAULT	100	/* ms of calls per measurement */
+
+/*
+ * The per-ISA entry points isa-l dispatches between. They are weak so that
+ * the benchmark links against any isa-l build: a variant the library
+ * doesn't export is NULL and reported as missing.
+ */
+#define WEAK	__attribute__((weak))
+WEAK void ec_encode_data_base(int, int, int, u8 *, u8 **, u8 **);
+WEAK void ec_encode_data_sse(int, int, int, u8 *, u8 **, u8 **);
+WEAK void ec_encode_data_avx(int, int, int, u8 *, u8 **, u8 **);
+WEAK void ec_encode_data_avx2(int, int, int, u8 *, u8 **, u8 **);
+WEAK void ec_encode_data_avx2_gfni(int, int, int, u8 *, u8 **, u8 **);
+WEAK void ec_encode_data_avx512(int, int, int, u8 *, u8 **, u8 **);
+WEAK void ec_encode_data_avx512_gfni(int, int, int, u8 *, u8 **, u8 **);
+WEAK void ec_encode_data_update_base(int, int, int, int, u8 *, u8 *, u8 **);
+WEAK void ec_encode_data_update_sse(int, int, int, int, u8 *, u8 *, u8 **);
+WEAK void ec_encode_data_update_avx(int, int, int, int, u8 *, u8 *, u8 **);
+WEAK void ec_encode_data_update_avx2(int, int, int, int, u8 *, u8 *, u8 **);
+WEAK void ec_encode_data_update_avx2_gfni(int, int, int, int, u8 *, u8 *, u8 **);
+WEAK void ec_encode_data_update_avx512(int, int, int, int, u8 *, u8 *, u8 **);
+WEAK void ec_encode_data_update_avx512_gfni(int, int, int, int, u8 *, u8 *, u8 **);
+/* the g_tbls layouts: 32 bytes per coefficient for base..avx512, 8 for the gfni kernels */
+WEAK void ec_init_tables_base(int, int, u8 *, u8 *);
+WEAK void ec_init_tables_gfni(int, int, u8 *, u8 *);
+WEAK void gf_vect_mad_base(int, int, int, u8 *, u8 *, u8 *);
+WEAK void gf_vect_mad_sse(int, int, int, u8 *, u8 *, u8 *);
+WEAK void gf_vect_mad_avx(int, int, int, u8 *, u8 *, u8 *);
+WEAK void gf_vect_mad_avx2(int, int, int, u8 *, u8 *, u8 *);
+WEAK void gf_vect_mad_avx512(int, int, int, u8 *, u8 *, u8 *);
+WEAK void gf_vect_dot_prod_base(int, int, u8 *, u8 **, u8 *);
+WEAK void gf_vect_dot_prod_sse(int, int, u8 *, u8 **, u8 *);
+WEAK void gf_vect_dot_prod_avx(int, int, u8 *, u8 **, u8 *);
+WEAK void gf_vect_dot_prod_avx2(int, int, u8 *, u8 **, u8 *);
+WEAK void gf_vect_dot_prod_avx512(int, int, u8 *, u8 **, u8 *);
+WEAK int xor_gen_base(int, int, void **);
+WEAK int xor_gen_sse(int, int, void **);
+WEAK int xor_gen_avx(int, int, void **);
+WEAK int xor_gen_avx512(int, int, void **);
+WEAK int pq_gen_base(int, int, void **);
+WEAK int pq_gen_sse(int, int, void **);
+WEAK int pq_gen_avx(int, int, void **);
+WEAK int pq_gen_avx2(int, int, void **);
+WEAK int pq_gen_avx512(int, int, void **);
+
+typedef void	(*ENCODE_FN)(int, int, int, u8 *, u8 **, u8 **);
+typedef void	(*UPDATE_FN)(int, int, int, int, u8 *, u8 *, u8 **);
+typedef void	(*MAD_FN)(int, int, int, u8 *, u8 *, u8 *);
+typedef void	(*DOT_FN)(int, int, u8 *, u8 **, u8 *);
+typedef int	(*GEN_FN)(int, int, void **);
+
+/* kernel families */
+#define GF_ENCODE	0	/* ec_encode_data: k sources into p parity */
+#define GF_UPDATE	1	/* ec_encode_data_update: one source into p parity */
+#define GF_MAD		2	/* gf_vect_mad: one source into one parity */
+#define GF_DOT		3	/* gf_vect_dot_prod: k sources into one parity */
+#define GF_XOR		4	/* xor_gen: k sources into one xor parity */
+#define GF_PQ		5	/* pq_gen: k sources into p and q */
+#define GF_FAMILIES	6
+
+static const char *family_name[GF_FAMILIES] = {"encode", "update", "mad", "dot", "xor", "pq"};
+
+/* ISA levels, best last; "dispatch" is the library's own choice */
+#define ISA_DISPATCH	0
+#define ISA_BASE	1
+#define ISA_SSE		2
+#define ISA_AVX		3
+#define ISA_AVX2	4
+#define ISA_AVX2_GFNI	5
+#define ISA_AVX512	6
+#define ISA_AVX512_GFNI	7
+#define ISA_LEVELS	8
+
+static const char *isa_name[ISA_LEVELS] = {"dispatch", "base", "sse", "avx", "avx2", "avx2_gfni", "avx512", "avx512_gfni"};
+
+#define IS_GFNI(isa)	((isa) == ISA_AVX2_GFNI || (isa) == ISA_AVX512_GFNI)
+
+typedef void	(*GF_FN)(void);
+
+/* entry point of each family at each ISA level, NULL where isa-l has none */
+static GF_FN	kernels[GF_FAMILIES][ISA_LEVELS] = {
+	[GF_ENCODE] = {(GF_FN)ec_encode_data, (GF_FN)ec_encode_data_base, (GF_FN)ec_encode_data_sse,
+		       (GF_FN)ec_encode_data_avx, (GF_FN)ec_encode_data_avx2, (GF_FN)ec_encode_data_avx2_gfni,
+		       (GF_FN)ec_encode_data_avx512, (GF_FN)ec_encode_data_avx512_gfni},
+	[GF_UPDATE] = {(GF_FN)ec_encode_data_update, (GF_FN)ec_encode_data_update_base, (GF_FN)ec_encode_data_update_sse,
+		       (GF_FN)ec_encode_data_update_avx, (GF_FN)ec_encode_data_update_avx2,
+		       (GF_FN)ec_encode_data_update_avx2_gfni, (GF_FN)ec_encode_data_update_avx512,
+		       (GF_FN)ec_encode_data_update_avx512_gfni},
+	[GF_MAD] = {(GF_FN)gf_vect_mad, (GF_FN)gf_vect_mad_base, (GF_FN)gf_vect_mad_sse, (GF_FN)gf_vect_mad_avx,
+		    (GF_FN)gf_vect_mad_avx2, NULL, (GF_FN)gf_vect_mad_avx512, NULL},
+	[GF_DOT] = {(GF_FN)gf_vect_dot_prod, (GF_FN)gf_vect_dot_prod_base, (GF_FN)gf_vect_dot_prod_sse,
+		    (GF_FN)gf_vect_dot_prod_avx, (GF_FN)gf_vect_dot_prod_avx2, NULL, (GF_FN)gf_vect_dot_prod_avx512, NULL},
+	[GF_XOR] = {(GF_FN)xor_gen, (GF_FN)xor_gen_base, (GF_FN)xor_gen_sse, (GF_FN)xor_gen_avx, NULL, NULL,
+		    (GF_FN)xor_gen_avx512, NULL},
+	[GF_PQ] = {(GF_FN)pq_gen, (GF_FN)pq_gen_base, (GF_FN)pq_gen_sse, (GF_FN)pq_gen_avx, (GF_FN)pq_gen_avx2, NULL,
+		   (GF_FN)pq_gen_avx512, NULL},
+};
+
+/* buffers and tables shared by all measurements */
+typedef struct gf_bench {
+	int	k;
+	int	p;
+	u8	*srcs[M_K_P_MAX];
+	u8	*outs[M_K_P_MAX];
+	void	*vects[M_K_P_MAX];	/* xor/pq: k sources then the parity */
+	u8	*g_tbls;		/* k * p * 32, by ec_init_tables: the dispatched kernel's layout */
+	u8	*g_tbls_base;		/* 32 bytes layout, NULL if it can't be built */
+	u8	*g_tbls_gfni;		/* gfni layout, NULL if it can't be built */
+	int64_t	l1, l2, llc;		/* data cache sizes, 0 if unknown */
+} GF_BENCH;
+
+static int	is_csv;
+static int	nr_records;
+
+/* can this CPU run 'isa'? Calling a variant it can't would be SIGILL */
+static int isa_supported(int isa)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	switch (isa) {
+	case ISA_SSE:
+		return __builtin_cpu_supports("sse4.1");
+	case ISA_AVX:
+		return __builtin_cpu_supports("avx");
+	case ISA_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case ISA_AVX2_GFNI:
+		return isa_supported(ISA_AVX2) && __builtin_cpu_supports("gfni");
+	case ISA_AVX512:
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+			&& __builtin_cpu_supports("avx512vl");
+	case ISA_AVX512_GFNI:
+		return isa_supported(ISA_AVX512) && __builtin_cpu_supports("gfni");
+	}
+	return 1;
+#else
+	return isa <= ISA_BASE;
+#endif
+}
+
+/* the level isa-l picks for 'family': the best one it exports that the CPU runs */
+static int isa_expected(int family)
+{
+	int	isa;
+
+	for (isa = ISA_LEVELS - 1; isa > ISA_BASE; isa--) {
+		if (kernels[family][isa] != NULL && isa_supported(isa)) {
+			break;
+		}
+	}
+	return isa;
+}
+
+/* 1 if 'name' is in the comma separated 'list', any name matches a NULL list */
+static int name_in_list(const char *list, const char *name)
+{
+	const char	*s;
+	size_t		len = strlen(name);
+
+	for (s = list; s != NULL; s = strchr(s, ',') ? strchr(s, ',') + 1 : NULL) {
+		if (strncmp(s, name, len) == 0 && (s[len] == ',' || s[len] == '\0')) {
+			return 1;
+		}
+	}
+	return list == NULL;
+}
+
+static void gf_bench_caches(GF_BENCH *gb)
+{
+	char	path[128], type[32];
+	FILE	*fp;
+	int	i, level;
+	long	size;
+	char	unit;
+
+	for (i = 0; i < 8; i++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+		if ((fp = fopen(path, "r")) == NULL) {
+			break;
+		}
+		level = fscanf(fp, "%d", &level) == 1 ? level : 0;
+		fclose(fp);
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+		if ((fp = fopen(path, "r")) == NULL || fscanf(fp, "%31s", type) != 1) {
+			type[0] = '\0';
+		}
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+		unit = 'K';
+		if ((fp = fopen(path, "r")) == NULL || fscanf(fp, "%ld%c", &size, &unit) < 1) {
+			size = 0;
+		}
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		size *= unit == 'M' ? 1024 * 1024 : unit == 'G' ? 1024 * 1024 * 1024 : 1024;
+		if (strcmp(type, "Instruction") == 0) {
+			continue;
+		}
+		if (level == 1) {
+			gb->l1 = size;
+		} else if (level == 2) {
+			gb->l2 = size;
+		} else if (size > gb->llc) {
+			gb->llc = size;
+		}
+	}
+	dbg("caches: L1d[%ld], L2[%ld], LLC[%ld]", gb->l1, gb->l2, gb->llc);
+}
+
+/* bytes a call of 'family' reads and writes, and where they fit */
+static int64_t working_set(const GF_BENCH *gb, int family, int64_t len)
+{
+	switch (family) {
+	case GF_ENCODE:
+		return (gb->k + gb->p) * len;
+	case GF_UPDATE:
+		return (1 + gb->p) * len;
+	case GF_MAD:
+		return 2 * len;
+	case GF_PQ:
+		return (gb->k + 2) * len;
+	}
+	return (gb->k + 1) * len;
+}
+
+static const char *regime(const GF_BENCH *gb, int64_t ws)
+{
+	if (ws <= gb->l1) {
+		return "L1";
+	}
+	if (ws <= gb->l2) {
+		return "L2";
+	}
+	if (ws <= gb->llc) {
+		return "LLC";
+	}
+	return "DRAM";
+}
+
+/* source bytes of one call, the unit of GB/s and cycles per byte */
+static int64_t source_bytes(const GF_BENCH *gb, int family, int64_t len)
+{
+	return family == GF_UPDATE || family == GF_MAD ? len : gb->k * len;
+}
+
+/*
+ * g_tbls in the layout the variant reads, NULL if it can't be built here.
+ * mad and dot always read the 32 bytes layout, ec_encode_data* the one of
+ * their kernel: a forced variant fed another layout computes garbage.
+ */
+static u8 *gf_tables(const GF_BENCH *gb, int family, int isa)
+{
+	if (family == GF_MAD || family == GF_DOT) {
+		return gb->g_tbls_base;
+	}
+	if (isa == ISA_DISPATCH) {
+		return gb->g_tbls;
+	}
+	return IS_GFNI(isa) ? gb->g_tbls_gfni : gb->g_tbls_base;
+}
+
+static void gf_call(GF_BENCH *gb, int family, GF_FN fn, u8 *g_tbls, int len)
+{
+	switch (family) {
+	case GF_ENCODE:
+		((ENCODE_FN)fn)(len, gb->k, gb->p, g_tbls, gb->srcs, gb->outs);
+		break;
+	case GF_UPDATE:
+		((UPDATE_FN)fn)(len, gb->k, gb->p, 0, g_tbls, gb->srcs[0], gb->outs);
+		break;
+	case GF_MAD:
+		((MAD_FN)fn)(len, gb->k, 0, g_tbls, gb->srcs[0], gb->outs[0]);
+		break;
+	case GF_DOT:
+		((DOT_FN)fn)(len, gb->k, g_tbls, gb->srcs, gb->outs[0]);
+		break;
+	case GF_XOR:
+		((GEN_FN)fn)(gb->k + 1, len, gb->vects);
+		break;
+	case GF_PQ:
+		((GEN_FN)fn)(gb->k + 2, len, gb->vects);
+		break;
+	}
+}
+
+/* call 'fn' for 'budget_ns' after a warm up call, return GB/s */
+static double gf_measure(GF_BENCH *gb, int family, int isa, int64_t len, int64_t budget_ns)
+{
+	GF_FN		fn = kernels[family][isa];
+	u8		*g_tbls = gf_tables(gb, family, isa);
+	uint64_t	start, cycles, calls;
+	double		seconds, bytes, gbps;
+	int64_t		ws;
+
+	gf_call(gb, family, fn, g_tbls, len);
+	cycles = now_cycles();
+	start = now_ns();
+	calls = 0;
+	do {
+		gf_call(gb, family, fn, g_tbls, len);
+		calls++;
+	} while (now_ns() - start < budget_ns);
+	seconds = (now_ns() - start) / 1e9;
+	cycles = now_cycles() - cycles;
+	bytes = (double)source_bytes(gb, family, len) * calls;
+	gbps = bytes / seconds / 1e9;
+	ws = working_set(gb, family, len);
+
+	if (is_csv) {
+		if (nr_records++ == 0) {
+			printf("isal,cpu,kernel,variant,k,p,len,working_set,regime,calls,seconds,gbps,cycles_per_byte\n");
+		}
+		printf("%s,\"%s\",%s,%s,%d,%d,%ld,%ld,%s,%lu,%.6f,%.3f,%.3f\n", isal_version, cpu_model, family_name[family],
+		       isa_name[isa], gb->k, gb->p, len, ws, regime(gb, ws), calls, seconds, gbps, cycles / bytes);
+	} else {
+		printf("%s    {\"kernel\": \"%s\", \"variant\": \"%s\", \"len\": %ld, \"working_set\": %ld, \"regime\": \"%s\", "
+		       "\"calls\": %lu, \"seconds\": %.6f, \"gbps\": %.3f, \"cycles_per_byte\": %.3f}",
+		       nr_records++ ? ",\n" : "", family_name[family], isa_name[isa], len, ws, regime(gb, ws),
+		       calls, seconds, gbps, cycles / bytes);
+	}
+	fflush(stdout);
+	return gbps;
+}
+
+int main(int argc, char **argv)
+{
+	int		opt;
+	int		i, j, k, p, family, isa, closest, budget_ms;
+	int64_t		len, len_min, len_max;
+	double		gbps[ISA_LEVELS], gap, best_gap;
+	char		*endptr, *kernel_list = NULL, *variant_list = NULL;
+	unsigned int	seed = 1;
+	u8		*encode_matrix;
+	BUF_POOL	*pool;
+	GF_BENCH	gb;
+	int		expected[GF_FAMILIES], measured[GF_FAMILIES];
+
+	k = K_DEFAULT;
+	p = P_DEFAULT;
+	len_min = LEN_MIN_DEFAULT;
+	len_max = LEN_MAX_DEFAULT;
+	budget_ms = BUDGET_DEFAULT;
+	is_csv = 0;
+        while ((opt = getopt(argc, argv, "k:K:o:p:s:T:V:")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'k':
+                                k = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'K':
+                                kernel_list = optarg;
+                                break;
+                        case 'o':
+                                if (strcmp(optarg, "csv") && strcmp(optarg, "json")) {
+                                        err_quit("invalid parameters: output['%s'] must be json or csv", optarg);
+                                }
+                                is_csv = strcmp(optarg, "csv") == 0;
+                                break;
+                        case 'p':
+                                p = strtoul(optarg, NULL, 10);
+                                break;
+                        case 's':
+                                len_min = strtoll(optarg, &endptr, 10) * 1024;
+                                len_max = *endptr == ':' ? strtoll(endptr + 1, &endptr, 10) * 1024 : len_min;
+                                if (*endptr != '\0') {
+                                        err_quit("invalid parameters: size['%s'] must be min:max (KB)", optarg);
+                                }
+                                break;
+                        case 'T':
+                                budget_ms = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'V':
+                                variant_list = optarg;
+                                break;
+                        default:
+                		err_quit("USAGE: %s [-k k] [-p p] [-s min:max(KB)] [-K encode,update,mad,dot,xor,pq] [-V dispatch,base,sse,avx,avx2,avx2_gfni,avx512,avx512_gfni] [-T ms] [-o json|csv]", argv[0]);
+				break;
+                }
+        }
+	if (k + p >= M_K_P_MAX || k < 1 || p < 2) {
+		err_quit("invalid parameters: (k+p)[%d] or k [%d] or p[%d] invalid, pq needs p >= 2", k + p, k, p);
+	}
+	if (len_min < 64 || len_max < len_min || len_max > INT_MAX || budget_ms < 1) {
+		err_quit("invalid parameters: size[%ld:%ld] or time[%d] invalid", len_min, len_max, budget_ms);
+	}
+
+	memset(&gb, 0, sizeof(gb));
+	gb.k = k;
+	gb.p = p;
+	gf_bench_caches(&gb);
+	bench_env_init();
+
+	/* random sources, the parity buffers are only written */
+	pool = bufpool_create(len_max, 64, k + p, 0);
+	for (i = 0; i < k + p; i++) {
+		if ((gb.srcs[i] = bufpool_get(pool)) == NULL) {
+			ERR_QUIT("buffer pool exhausted");
+		}
+	}
+	for (i = 0; i < k; i++) {
+		for (j = 0; j + 4 <= len_max; j += 4) {
+			*(uint32_t *)(gb.srcs[i] + j) = rand_r(&seed);
+		}
+		gb.vects[i] = gb.srcs[i];
+	}
+	for (i = 0; i < p; i++) {
+		gb.outs[i] = gb.srcs[k + i];
+		gb.vects[k + i] = gb.outs[i];
+	}
+	if ((encode_matrix = malloc((k + p) * k)) == NULL || posix_memalign((void **)&gb.g_tbls, 64, k * p * 32) != 0
+		|| posix_memalign((void **)&gb.g_tbls_base, 64, k * p * 32) != 0
+		|| posix_memalign((void **)&gb.g_tbls_gfni, 64, k * p * 32) != 0) {
+		ERR_SYS("malloc() error");
+	}
+	gf_gen_cauchy1_matrix(encode_matrix, k + p, k);
+	ec_init_tables(k, p, &encode_matrix[k * k], gb.g_tbls);
+	/* an isa-l without gfni kernels has a single layout, the one of ec_init_tables */
+	if (ec_init_tables_base != NULL) {
+		ec_init_tables_base(k, p, &encode_matrix[k * k], gb.g_tbls_base);
+	} else if (kernels[GF_ENCODE][ISA_AVX2_GFNI] == NULL && kernels[GF_ENCODE][ISA_AVX512_GFNI] == NULL) {
+		memcpy(gb.g_tbls_base, gb.g_tbls, k * p * 32);
+	} else {
+		free(gb.g_tbls_base);
+		gb.g_tbls_base = NULL;
+	}
+	if (ec_init_tables_gfni != NULL) {
+		ec_init_tables_gfni(k, p, &encode_matrix[k * k], gb.g_tbls_gfni);
+	} else {
+		free(gb.g_tbls_gfni);
+		gb.g_tbls_gfni = NULL;
+	}
+
+	if (!is_csv) {
+		printf("{\"isal\": \"%s\", \"cpu\": \"%s\", \"k\": %d, \"p\": %d, \"l1d\": %ld, \"l2\": %ld, \"llc\": %ld,\n"
+		       "  \"results\": [\n", isal_version, cpu_model, k, p, gb.l1, gb.l2, gb.llc);
+	}
+	for (family = 0; family < GF_FAMILIES; family++) {
+		expected[family] = isa_expected(family);
+		measured[family] = -1;
+		if (!name_in_list(kernel_list, family_name[family])) {
+			continue;
+		}
+		for (len = len_min; len <= len_max; len *= 2) {
+			/* forced variants: only those asked for and runnable here */
+			for (isa = 0; isa < ISA_LEVELS; isa++) {
+				gbps[isa] = -1;
+				if (kernels[family][isa] == NULL || !name_in_list(variant_list, isa_name[isa])) {
+					continue;
+				}
+				if (!isa_supported(isa)) {
+					dbg("%s_%s not supported by this cpu, skipped", family_name[family], isa_name[isa]);
+					continue;
+				}
+				if (family != GF_XOR && family != GF_PQ && gf_tables(&gb, family, isa) == NULL) {
+					dbg("%s_%s: no g_tbls in its layout, skipped", family_name[family], isa_name[isa]);
+					continue;
+				}
+				gbps[isa] = gf_measure(&gb, family, isa, len, budget_ms * 1000000L);
+			}
+			/* the variant the dispatcher behaves like, at the smallest (compute bound) size */
+			if (len != len_min || gbps[ISA_DISPATCH] < 0) {
+				continue;
+			}
+			for (isa = ISA_BASE, closest = -1, best_gap = 0; isa < ISA_LEVELS; isa++) {
+				gap = gbps[isa] - gbps[ISA_DISPATCH];
+				gap = gap < 0 ? -gap : gap;
+				if (gbps[isa] >= 0 && (closest < 0 || gap < best_gap)) {
+					closest = isa;
+					best_gap = gap;
+				}
+			}
+			measured[family] = closest;
+		}
+	}
+
+	/* which kernel isa-l dispatches to: by cpu features, and by the closest measured variant */
+	if (!is_csv) {
+		printf("\n  ],\n  \"dispatch\": {");
+	}
+	for (family = 0, j = 0; family < GF_FAMILIES; family++) {
+		if (!name_in_list(kernel_list, family_name[family])) {
+			continue;
+		}
+		if (is_csv) {
+			msg("%s: dispatched to %s, closest measured %s", family_name[family], isa_name[expected[family]],
+			    measured[family] < 0 ? "none" : isa_name[measured[family]]);
+		} else {
+			printf("%s\"%s\": {\"expected\": \"%s\", \"closest_measured\": \"%s\"}", j++ ? ", " : "",
+			       family_name[family], isa_name[expected[family]],
+			       measured[family] < 0 ? "none" : isa_name[measured[family]]);
+		}
+	}
+	if (!is_csv) {
+		printf("}\n}\n");
+	}
+	free(encode_matrix);
+	free(gb.g_tbls);
+	free(gb.g_tbls_base);
+	free(gb.g_tbls_gfni);
+	bufpool_destroy(pool);
+	return 0;
+}
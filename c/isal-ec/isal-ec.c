@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <limits.h>
 #include <libaio.h>
@@ -16,12 +17,17 @@
 
 #include "common.h"
 #include "error.h"
+#include "bufpool.h"
+#include "ec-table.h"
+#include "ec-frag.h"
+#include "ec-aio.h"
+#include "ec-stats.h"
+#include "libec.h"
 
-#define M_K_P_MAX	255
 #define K_DEFAULT	6
 #define P_DEFAULT	3
-
-typedef unsigned char u8;
+#define STRIPE_UNIT_DEFAULT	(1024 * 1024)	// 1M per fragment
+#define RANGE_BUF_SIZE	(4 * 1024 * 1024)
 
 typedef struct erasure_code_buf_info {
 	int		m;
@@ -35,17 +41,11 @@ typedef struct erasure_code_buf_info {
         unsigned char	frag_err_list[M_K_P_MAX];
 	int		nerrs;
       	unsigned char	*recover_frag_ptrs[M_K_P_MAX];
-	
-	// Coefficient matrices
-	unsigned char	*encode_matrix;
-	unsigned char	*decode_matrix;
-	unsigned char 	*invert_matrix;
-	unsigned char	*temp_matrix;
-	unsigned char	*g_tbls;
-	unsigned char	decode_index[M_K_P_MAX];
+	BUF_POOL	*pool;		/* frag_ptrs and recover_outp come from it */
 } EC_BUF_INFO;
 
-EC_BUF_INFO* alloc_ec_buf(int m, int k, int p, int frag_len)
+/* m + p buffers of frag_len from 'pool', it must be created for at least frag_len */
+EC_BUF_INFO* alloc_ec_buf(BUF_POOL *pool, int m, int k, int p, int frag_len)
 {
 	int	i;
 	EC_BUF_INFO	*ebi;
@@ -60,30 +60,20 @@ EC_BUF_INFO* alloc_ec_buf(int m, int k, int p, int frag_len)
 	ebi->p = p;
 	ebi->frag_len = frag_len;
 	ebi->nerrs = 0;
-	
-        // Allocate coding matrices
-        ebi->encode_matrix = malloc(m * k);
-        ebi->decode_matrix = malloc(m * k);
-        ebi->invert_matrix = malloc(m * k);
-        ebi->temp_matrix = malloc(m * k);
-        ebi->g_tbls = malloc(k * p * 32);
-
-        if (ebi->encode_matrix == NULL || ebi->decode_matrix == NULL || ebi->invert_matrix == NULL
-		|| ebi->temp_matrix == NULL || ebi->g_tbls == NULL) {
-		ERR_SYS("malloc() error");
-        }
+	ebi->pool = pool;
+
 	// alloc for frag
 	for (i = 0; i < m; i++) {
-		ebi->frag_ptrs[i] = malloc(ebi->frag_len);
+		ebi->frag_ptrs[i] = bufpool_get(pool);
 		if (ebi->frag_ptrs[i] == NULL) {
-			ERR_SYS("malloc() error");
+			ERR_QUIT("buffer pool exhausted");
 		}
 	}
 	// alloc for recover_outp
 	for (i = 0; i < p; i++) {
-		ebi->recover_outp[i] = malloc(ebi->frag_len);
+		ebi->recover_outp[i] = bufpool_get(pool);
 		if (ebi->recover_outp[i] == NULL) {
-			ERR_SYS("malloc() error");
+			ERR_QUIT("buffer pool exhausted");
 		}
 	}
 	return ebi;
@@ -96,21 +86,11 @@ void release_ec_buf(EC_BUF_INFO *ebi)
 	if (ebi == NULL) {
 		return;
 	}
-	if (ebi->encode_matrix) free(ebi->encode_matrix);
-	if (ebi->decode_matrix) free(ebi->decode_matrix);
-	if (ebi->invert_matrix) free(ebi->invert_matrix);
-	if (ebi->temp_matrix) free(ebi->temp_matrix);
-	if (ebi->g_tbls) free(ebi->g_tbls);
-
 	for (i = 0; i < ebi->m; i++) {
-		if (ebi->frag_ptrs[i] != NULL) {
-			free(ebi->frag_ptrs[i]);
-		}
+		bufpool_put(ebi->pool, ebi->frag_ptrs[i]);
 	}
 	for (i = 0; i < ebi->p; i++) {
-		if (ebi->recover_outp[i] != NULL) {
-			free(ebi->recover_outp[i]);
-		}
+		bufpool_put(ebi->pool, ebi->recover_outp[i]);
 	}
 	free(ebi);
 
@@ -118,104 +98,367 @@ void release_ec_buf(EC_BUF_INFO *ebi)
 }
 
 
-static int gf_gen_decode_matrix_simple(u8 * encode_matrix,
-                                       u8 * decode_matrix,
-                                       u8 * invert_matrix,
-                                       u8 * temp_matrix,
-                                       u8 * decode_index, u8 * frag_err_list, int nerrs, int k,
-                                       int m)
+int64_t time_since(struct timeval *tvold)
 {
-        int i, j, p, r;
-        int nsrcerrs = 0;
-        u8 s, *b = temp_matrix;
-        u8 frag_in_err[M_K_P_MAX];
-
-        memset(frag_in_err, 0, sizeof(frag_in_err));
-
-        // Order the fragments in erasure for easier sorting
-        for (i = 0; i < nerrs; i++) {
-                if (frag_err_list[i] < k)
-                        nsrcerrs++;
-                frag_in_err[frag_err_list[i]] = 1;
-        }
+	struct timeval	tvnow;
+	int64_t		gap;
 
-        // Construct b (matrix that encoded remaining frags) by removing erased rows
-        for (i = 0, r = 0; i < k; i++, r++) {
-                while (frag_in_err[r])
-                        r++;
-                for (j = 0; j < k; j++)
-                        b[k * i + j] = encode_matrix[k * r + j];
-                decode_index[i] = r;
-        }
+	gettimeofday(&tvnow, NULL);
+	gap = (int64_t)(tvnow.tv_sec - tvold->tv_sec)*1000*1000 + (tvnow.tv_usec - tvold->tv_usec);
 
-        // Invert matrix to get recovery matrix
-        if (gf_invert_matrix(b, invert_matrix, k) < 0)
-                return -1;
+	return gap;	// return 'us'
+}
 
-        // Get decode matrix with only wanted recovery rows
-        for (i = 0; i < nerrs; i++) {
-                if (frag_err_list[i] < k)       // A src err
-                        for (j = 0; j < k; j++)
-                                decode_matrix[k * i + j] =
-                                    invert_matrix[k * frag_err_list[i] + j];
-        }
+/* write [offset, offset + len) of the object behind 'prefix' to stdout, touching only the needed stripes */
+void range_read(const char *prefix, int64_t offset, int64_t len)
+{
+	int		fds[M_K_P_MAX], i, nerrs;
+	int64_t		n, want, done;
+	EC_FRAG_HDR	hdr;
+	EC_STRIPE_ENTRY	*index;
+	u8		*buf;
+
+	if ((nerrs = ec_frag_open_all(prefix, O_RDONLY, fds, &hdr)) < 0) {
+		err_quit("no valid fragment of '%s' found, quit", prefix);
+	}
+	if (nerrs > hdr.p) {
+		err_quit("Too many(%d) fragments lost, must be less(or equal) than [%d], quit", nerrs, hdr.p);
+	}
+	/* slices are where the index says, an object appended to has them past its first index */
+	if ((index = ec_frag_index_read_any(fds, &hdr)) == NULL) {
+		ERR_MSG("no valid stripe index, slices read at their encode offsets");
+	}
+	if ((buf = malloc(RANGE_BUF_SIZE)) == NULL) {
+		ERR_SYS("malloc() error");
+	}
+	for (done = 0; done < len; done += n) {
+		want = len - done < RANGE_BUF_SIZE ? len - done : RANGE_BUF_SIZE;
+		if ((n = ec_read_range(fds, &hdr, index, offset + done, want, buf)) < 0) {
+			ERR_QUIT("read range[%ld, %ld) error", offset + done, offset + done + want);
+		}
+		if (n == 0) {	/* end of the object */
+			break;
+		}
+		if (writen(STDOUT_FILENO, buf, n) != n) {
+			ERR_SYS("writen() error");
+		}
+	}
+	dbg("range[%ld, %ld): [%ld] bytes read, [%d] fragments lost", offset, offset + len, done, nerrs);
+	free(buf);
+	free(index);
+	for (i = 0; i < hdr.k + hdr.p; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+}
 
-        // For non-src (parity) erasures need to multiply encode matrix * invert
-        for (p = 0; p < nerrs; p++) {
-                if (frag_err_list[p] >= k) {    // A parity err
-                        for (i = 0; i < k; i++) {
-                                s = 0;
-                                for (j = 0; j < k; j++)
-                                        s ^= gf_mul(invert_matrix[j * k + i],
-                                                    encode_matrix[k * frag_err_list[p] + j]);
-                                decode_matrix[k * p + i] = s;
-                        }
-                }
-        }
-        return 0;
+/* open every fragment of 'prefix' read-write with its stripe index, for in place changes */
+void object_open_rw(const char *prefix, const char *what, int *fds, EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY **indexes)
+{
+	int		i, nerrs;
+	EC_FRAG_HDR	frag_hdr;
+
+	if ((nerrs = ec_frag_open_all(prefix, O_RDWR, fds, hdr)) < 0) {
+		err_quit("no valid fragment of '%s' found, quit", prefix);
+	}
+	if (nerrs > 0) {
+		err_quit("%d fragments of '%s' lost, %s needs all of them, quit", nerrs, prefix, what);
+	}
+	for (i = 0; i < hdr->k + hdr->p; i++) {
+		/* each fragment's index is checked against its own header */
+		if (ec_frag_hdr_read(fds[i], &frag_hdr) < 0 || (indexes[i] = ec_frag_index_read(fds[i], &frag_hdr)) == NULL) {
+			err_quit("no valid stripe index in '%s.%d', quit", prefix, i);
+		}
+	}
 }
 
-int time_since(struct timeval *tvold)
+/* commit the slices written, then the indexes, then the headers, and close */
+void object_close_rw(const char *prefix, int *fds, EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY **indexes)
 {
-	struct timeval	tvnow;
-	int		gap;
+	int	i;
 
-	gettimeofday(&tvnow, NULL);
-	gap = (tvnow.tv_sec - tvold->tv_sec)*1000*1000 + (tvnow.tv_usec - tvold->tv_usec);
+	if (ec_frag_commit(fds, hdr, indexes) < 0) {
+		ERR_SYS("commit fragments of '%s' error", prefix);
+	}
+	for (i = 0; i < hdr->k + hdr->p; i++) {
+		free(indexes[i]);
+		close(fds[i]);
+	}
+}
 
-	return gap;	// return 'us'
+/*
+ * Overwrite the object behind 'prefix' from 'offset' with stdin, in place:
+ * only the changed ranges of the data slices and of their parity are read
+ * and written, the object size doesn't change.
+ */
+void range_update(const char *prefix, int64_t offset)
+{
+	int		fds[M_K_P_MAX], beyond;
+	int64_t		n, done;
+	EC_FRAG_HDR	hdr;
+	EC_STRIPE_ENTRY	*indexes[M_K_P_MAX];
+	u8		*buf;
+
+	object_open_rw(prefix, "update", fds, &hdr, indexes);
+	if ((buf = malloc(RANGE_BUF_SIZE)) == NULL) {
+		ERR_SYS("malloc() error");
+	}
+	/* past the end of the object: what fits is applied, the indexes are still written back */
+	for (done = 0, beyond = 0; !beyond && (n = readn(STDIN_FILENO, buf, RANGE_BUF_SIZE)) > 0; done += n) {
+		if (offset + done + n > (int64_t)hdr.orig_size) {
+			beyond = 1;
+			n = offset + done < (int64_t)hdr.orig_size ? hdr.orig_size - offset - done : 0;
+		}
+		if (ec_update_range(fds, &hdr, indexes, offset + done, n, buf) < 0) {
+			ERR_SYS("update range[%ld, %ld) error", offset + done, offset + done + n);
+		}
+	}
+	if (n < 0) {
+		ERR_SYS("readn() error");
+	}
+	object_close_rw(prefix, fds, &hdr, indexes);
+	free(buf);
+	if (beyond) {
+		err_quit("update beyond the object size[%ld], only range[%ld, %ld) updated", hdr.orig_size, offset, offset + done);
+	}
+	dbg("range[%ld, %ld) updated", offset, offset + done);
+}
+
+/* encode the k data slices of 'ebi', write the m slices of 'stripe' at 'offset' and record them in the indexes */
+void append_stripe(const int *fds, const EC_FRAG_HDR *hdr, EC_STRIPE_ENTRY **indexes, const EC_ENC_TBLS *enc_tbls,
+		   EC_BUF_INFO *ebi, int64_t stripe, int64_t offset)
+{
+	int		i, su;
+	EC_STRIPE_ENTRY	*entry;
+
+	su = hdr->stripe_unit;
+	ec_encode_data(su, hdr->k, hdr->p, (u8 *)enc_tbls->g_tbls, ebi->frag_ptrs, &ebi->frag_ptrs[hdr->k]);
+	for (i = 0; i < hdr->k + hdr->p; i++) {
+		entry = &indexes[i][stripe];
+		memset(entry, 0, sizeof(EC_STRIPE_ENTRY));
+		entry->offset = offset;
+		entry->csum = ec_frag_csum(hdr, ebi->frag_ptrs[i], su);
+		if (pwriten(fds[i], ebi->frag_ptrs[i], su, offset) != su) {
+			ERR_SYS("pwriten() error");
+		}
+	}
+}
+
+/*
+ * Append stdin to the object behind 'prefix'. Nothing the current headers
+ * and indexes point at is written: the tail stripe, its padding filled, is
+ * re-encoded and written with the new stripes past the old index, the new
+ * index behind them. The commit then switches each fragment from its old
+ * index to the new one, a crash leaves every fragment a valid old or new
+ * object. The old index and tail slice are punched out last. The stripe
+ * unit stays, only the tail stripe is re-encoded: the cost is that of the
+ * appended bytes.
+ */
+void object_append(const char *prefix)
+{
+	int		fds[M_K_P_MAX], i, k, p, m, su, eof;
+	int64_t		n, got, done, room, off, tail, dead, base, slot, nr_alloc, s;
+	EC_FRAG_HDR	hdr, old;
+	EC_STRIPE_ENTRY	*indexes[M_K_P_MAX];
+	EC_BUF_INFO	*ebi;
+	BUF_POOL	*pool;
+	const EC_ENC_TBLS	*enc_tbls;
+
+	object_open_rw(prefix, "append", fds, &hdr, indexes);
+	old = hdr;
+	k = hdr.k;
+	p = hdr.p;
+	m = k + p;
+	su = hdr.stripe_unit;
+	if ((enc_tbls = ec_enc_tables_get(k, p)) == NULL) {
+		ERR_SYS("ec_enc_tables_get() error");
+	}
+	pool = bufpool_create(su, 64, m + p, 0);
+	ebi = alloc_ec_buf(pool, m, k, p, su);
+
+	/* slots for the new slices, page aligned past the old index */
+	base = (old.index_offset + old.nr_stripes * sizeof(EC_STRIPE_ENTRY) + EC_FRAG_HDR_SIZE - 1)
+		/ EC_FRAG_HDR_SIZE * EC_FRAG_HDR_SIZE;
+	slot = 0;
+	done = 0;
+	dead = -1;
+	eof = 0;
+
+	/* the tail stripe, verified (decoded if need be) as read: its padding is zeros, filled from stdin */
+	room = (int64_t)old.nr_stripes * k * su - old.orig_size;
+	if (room > 0) {
+		tail = old.nr_stripes - 1;
+		if (ec_stripe_recover(fds, &hdr, indexes, tail, ebi->frag_ptrs) < 0) {
+			err_quit("tail stripe[%ld] of '%s' can't be read, quit", tail, prefix);
+		}
+		off = old.orig_size - tail * k * su;
+		for (i = off / su, off %= su; i < k && !eof; i++, off = 0) {
+			if ((got = readn(STDIN_FILENO, ebi->frag_ptrs[i] + off, su - off)) < 0) {
+				ERR_SYS("readn() error");
+			}
+			eof = got < su - off;
+			done += got;
+		}
+		if (done > 0) {
+			dead = indexes[0][tail].offset;
+			append_stripe(fds, &hdr, indexes, enc_tbls, ebi, tail, base + slot++ * su);
+		}
+	}
+
+	/* new stripes, k slices of stdin each */
+	nr_alloc = hdr.nr_stripes;
+	while (!eof) {
+		/* a short read ends the input, the rest of the stripe is padding */
+		for (i = 0, n = 0; i < k; i++) {
+			if ((got = eof ? 0 : readn(STDIN_FILENO, ebi->frag_ptrs[i], su)) < 0) {
+				ERR_SYS("readn() error");
+			}
+			eof = got < su;
+			memset(ebi->frag_ptrs[i] + got, 0, su - got);
+			n += got;
+		}
+		if (n == 0) {
+			break;
+		}
+		s = hdr.nr_stripes;
+		if (s == nr_alloc) {
+			nr_alloc = nr_alloc * 2 + 1;
+			for (i = 0; i < m; i++) {
+				if ((indexes[i] = realloc(indexes[i], nr_alloc * sizeof(EC_STRIPE_ENTRY))) == NULL) {
+					ERR_SYS("realloc() error");
+				}
+			}
+		}
+		append_stripe(fds, &hdr, indexes, enc_tbls, ebi, s, base + slot++ * su);
+		hdr.nr_stripes++;
+		done += n;
+	}
+	release_ec_buf(ebi);
+	bufpool_destroy(pool);
+
+	hdr.orig_size += done;
+	if (slot > 0) {
+		hdr.index_offset = base + slot * su;
+		if (ec_frag_commit(fds, &hdr, indexes) < 0) {
+			ERR_SYS("commit fragments of '%s' error", prefix);
+		}
+		/* nothing points at them any more; a filesystem without hole punching keeps them */
+		for (i = 0; i < m; i++) {
+			fallocate(fds[i], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, old.index_offset, base - old.index_offset);
+			if (dead >= 0) {
+				fallocate(fds[i], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, dead, su);
+			}
+		}
+	}
+	for (i = 0; i < m; i++) {
+		free(indexes[i]);
+		close(fds[i]);
+	}
+	msg("[%ld] bytes appended, file_size[%ld], stripes[%ld]", done, hdr.orig_size, hdr.nr_stripes);
 }
 
 int main(int argc, char **argv)
 {
 	int             opt;
-	int		fd, tmpfd;
+	int		fd, tmpfd, wfd[M_K_P_MAX] = {0,};
 	struct stat	st;
-	int64_t		file_size, frag_len;
+	int64_t		file_size, frag_len, stripe_unit, nr_stripes, s, n, offset, bytes, corrupt, total_time;
 	int		m, k, p;
-	int		i, is_decode;
+	int		i, is_decode, is_range, is_update, is_append, is_mmap, aio_depth;
+	int		csum_type, verify, src, nsrcerrs, nbad, ret;
+	int64_t		range_offset, range_len, update_offset;
+	char		*endptr;
 	char		filename[NAME_MAX], tmpname[NAME_MAX];
 	EC_BUF_INFO	*ebi;
+	BUF_POOL	*pool;
+	const EC_ENC_TBLS	*enc_tbls;
+	EC_DEC_TBLS	*dec_tbls = NULL;
+	EC_CTX		*ctx;
+	EC_FRAG_HDR	hdr;
+	EC_STRIPE_ENTRY	*index, *entry, *indexes[M_K_P_MAX];
+	uint64_t	zero_csum, csums[M_K_P_MAX];
+	u8		*map, *srcs[M_K_P_MAX], **outp;
+	char		*cache_file = NULL, *json_file = NULL, *prom_file = NULL;
 	struct timeval	start;
+	EC_STATS	*stats;
+	EC_STAT_SET	*set;
+	uint64_t	t, w;
 
 	is_decode = 0;
+	csum_type = EC_CSUM_CRC32C;
+	verify = 1;
+	is_range = 0;
+	is_update = 0;
+	is_append = 0;
+	update_offset = 0;
+	is_mmap = 0;
+	aio_depth = 0;
+	range_offset = range_len = 0;
 	k = K_DEFAULT;
 	p = P_DEFAULT;
-        while ((opt = getopt(argc, argv, "dk:p:")) != -1)
+	stripe_unit = STRIPE_UNIT_DEFAULT;
+        while ((opt = getopt(argc, argv, "a:Ac:C:dJ:k:Mnp:P:r:s:u:")) != -1)
         {
                 switch (opt)
                 {
+                        case 'a':
+                                aio_depth = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'A':
+                                is_append = 1;
+                                break;
+                        case 'c':
+                                cache_file = optarg;
+                                break;
+                        case 'C':
+                                if ((csum_type = ec_frag_csum_type(optarg)) < 0) {
+                                        err_quit("invalid parameters: checksum['%s'] must be crc32c or crc64", optarg);
+                                }
+                                break;
                         case 'd':
                                 is_decode = 1;
                                 break;
+                        case 'J':
+                                json_file = optarg;
+                                break;
                         case 'k':
                                 k = strtoul(optarg, NULL, 10);
                                 break;
+                        case 'M':
+                                is_mmap = 1;
+                                break;
+                        case 'n':
+                                verify = 0;
+                                break;
                         case 'p':
                                 p = strtoul(optarg, NULL, 10);
                                 break;
+                        case 'P':
+                                prom_file = optarg;
+                                break;
+                        case 'r':
+                                is_range = 1;
+                                range_offset = strtoll(optarg, &endptr, 10);
+                                if (*endptr == ':') {
+                                        range_len = strtoll(endptr + 1, &endptr, 10);
+                                }
+                                if (*endptr != '\0' || range_offset < 0 || range_len <= 0) {
+                                        err_quit("invalid parameters: range['%s'] must be offset:length", optarg);
+                                }
+                                break;
+                        case 's':
+                                stripe_unit = strtoul(optarg, NULL, 10) * 1024;
+                                break;
+                        case 'u':
+                                is_update = 1;
+                                update_offset = strtoll(optarg, &endptr, 10);
+                                if (*endptr != '\0' || update_offset < 0) {
+                                        err_quit("invalid parameters: update offset['%s'] invalid", optarg);
+                                }
+                                break;
                         default:
-                		err_quit("USAGE: %s [-d] [-k k] [-p p] <origin_file | encode_file_prefix>", argv[0]);
+                		err_quit("USAGE: %s [-J stats.json] [-P stats.prom] [-k k] [-p p] [-s stripe_unit(KB)] [-C crc32c|crc64] [-a aio_depth|-M] <origin_file> | [-J stats.json] [-P stats.prom] -d [-n]|-r offset:length [-c decode_cache_file] <encode_file_prefix> | -u offset|-A <encode_file_prefix> < data\n  -n: no slice checksum check; with no data fragment lost, the data is then copied in the kernel (copy_file_range). Checked, it is read and written, parity still isn't read", argv[0]);
 				break;
                 }
         }
@@ -223,14 +466,32 @@ int main(int argc, char **argv)
 	if (m >= M_K_P_MAX || k < 1 || p < 1 ) {
 		err_quit("invalid parameters: (k+p)[%d] or k [%d] or p[%d] invalid", m, k, p);
 	}
+	if (stripe_unit < 1 || stripe_unit > INT_MAX) {
+		err_quit("invalid parameters: stripe_unit[%ld] invalid", stripe_unit);
+	}
+	if (is_mmap && aio_depth > 0) {
+		err_quit("invalid parameters: '-M' and '-a' are exclusive");
+	}
 	if (argc - optind != 1) {
-                err_quit("USAGE: %s [-d] [-k k] [-p p] <origin_file | encode_file_prefix>", argv[0]);
+                err_quit("USAGE: %s [-J stats.json] [-P stats.prom] [-k k] [-p p] [-s stripe_unit(KB)] [-C crc32c|crc64] [-a aio_depth|-M] <origin_file> | [-J stats.json] [-P stats.prom] -d [-n]|-r offset:length [-c decode_cache_file] <encode_file_prefix> | -u offset|-A <encode_file_prefix> < data\n  -n: no slice checksum check; with no data fragment lost, the data is then copied in the kernel (copy_file_range). Checked, it is read and written, parity still isn't read", argv[0]);
         }
 
 	file_size = 0;
 	frag_len = 0;
+	total_time = 0;
 	strncpy(filename, argv[optind], sizeof(filename));
-	if (is_decode == 0) {
+	if (is_range) {
+		ec_dec_cache_init(EC_DEC_CACHE_DEFAULT, cache_file);
+		range_read(filename, range_offset, range_len);
+		ec_dec_cache_release();
+	}
+	else if (is_update) {
+		range_update(filename, update_offset);
+	}
+	else if (is_append) {
+		object_append(filename);
+	}
+	else if (is_decode == 0) {
 		if (lstat(filename, &st) < 0) {
 			ERR_SYS("lstat('%s') error", filename);
 		}
@@ -238,67 +499,200 @@ int main(int argc, char **argv)
 			ERR_SYS("open('%s') error", filename);
 		}
 		file_size = st.st_size;
+		if (file_size == 0) {
+			err_quit("file['%s'] is empty, nothing to encode", filename);
+		}
 		frag_len = file_size / k;
 		if (file_size % k) {
 			frag_len += 1;
 			dbg("**** padding frag for the last fragment");
 		}
-		msg("file['%s'], file_size[%ld], m[%d], k[%d], p[%d], frag_len[%ld]", filename, file_size, m, k, p, frag_len);
-
-		ebi = alloc_ec_buf(m, k, p, frag_len);
-		for (i = 0; i < k; i++) {
-			if (readn(fd, ebi->frag_ptrs[i], frag_len) != frag_len) {
-				ERR_SYS("readn() error)");
+		/* a file smaller than one stripe is a single stripe of just its slices */
+		if (stripe_unit > frag_len) {
+			stripe_unit = frag_len;
+		}
+		/* slices of a mapped origin start on a huge page when the stripe unit allows it */
+		if (is_mmap && stripe_unit >= EC_MAP_HUGEPAGE && stripe_unit % EC_MAP_HUGEPAGE) {
+			stripe_unit = (stripe_unit + EC_MAP_HUGEPAGE - 1) / EC_MAP_HUGEPAGE * EC_MAP_HUGEPAGE;
+			if (stripe_unit > frag_len) {
+				stripe_unit = frag_len;
 			}
+			msg("stripe_unit rounded to [%ld] for huge pages of the mapping", stripe_unit);
 		}
+		nr_stripes = (file_size + k * stripe_unit - 1) / (k * stripe_unit);
+		msg("file['%s'], file_size[%ld], m[%d], k[%d], p[%d], stripe_unit[%ld], stripes[%ld]", filename, file_size, m, k, p, stripe_unit, nr_stripes);
+
+		stats = ec_stats_create("isal-ec", "encode", 1, m);
+		set = &stats->workers[0];
+		t = ec_stat_now();
+		if ((enc_tbls = ec_enc_tables_get(k, p)) == NULL) {
+			ERR_SYS("ec_enc_tables_get() error");
+		}
+		ec_stat_add(set, EC_STAT_TABLES, t, k * p * 32);
+		ec_frag_hdr_init(&hdr, file_size, k, p, 0, stripe_unit, nr_stripes);
+		hdr.csum_type = csum_type;
+		if ((index = malloc(m * nr_stripes * sizeof(EC_STRIPE_ENTRY))) == NULL) {
+			ERR_SYS("malloc() error");
+		}
+		memset(index, 0, m * nr_stripes * sizeof(EC_STRIPE_ENTRY));
 
-		gettimeofday(&start, NULL);
-		gf_gen_cauchy1_matrix(ebi->encode_matrix, m, k);
-		// Initialize g_tbls from encode matrix
-		ec_init_tables(k, p, &(ebi->encode_matrix)[k * k], ebi->g_tbls);
-		// Generate EC parity blocks from sources
-		ec_encode_data(frag_len, k, p, ebi->g_tbls, ebi->frag_ptrs, &(ebi->frag_ptrs)[k]);
-
-		msg("############ encode time: %lld (us) #############", time_since(&start));
-		for (i = 0; i < ebi->m; i++) {
+		for (i = 0; i < m; i++) {
 			snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, i);
-			if ((tmpfd = open(tmpname, O_CREAT | O_RDWR, 0644)) < 0) {
+			if ((wfd[i] = open(tmpname, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
 				ERR_SYS("open('%s') error", tmpname);
 			}
 			dbg("write to file: '%s'", tmpname);
-			if(writen(tmpfd, ebi->frag_ptrs[i], ebi->frag_len) != ebi->frag_len) {
-				ERR_SYS("writen() error");
+		}
+		if (aio_depth > 0) {
+			/* reads, encode and writes of consecutive stripes overlap on libaio */
+			total_time = ec_aio_encode(fd, wfd, &hdr, enc_tbls, index, aio_depth, set);
+		}
+		else {
+			/*
+			 * read one stripe, encode it and write each fragment's slice to 'file.N'.
+			 * With '-M' the data slices are read in place from the mapped origin,
+			 * the buffers only hold parity and the padded last slices.
+			 */
+			if ((ctx = ec_ctx_create(k, p, stripe_unit, csum_type, &ret)) == NULL) {
+				err_quit("ec_ctx_create() error: %s", ec_strerror(ret));
 			}
-			close(tmpfd);
+			pool = bufpool_create(stripe_unit, 64, m + p, 0);
+			ebi = alloc_ec_buf(pool, m, k, p, stripe_unit);
+			map = is_mmap ? ec_origin_map(fd, file_size, MADV_SEQUENTIAL) : NULL;
+			memcpy(srcs, ebi->frag_ptrs, sizeof(srcs));
+			zero_csum = ec_frag_zero_csum(&hdr);
+			for (s = 0; s < nr_stripes; s++) {
+				t = ec_stat_now();
+				/* a hole: zero parity, nothing to read, encode or write */
+				if (ec_stripe_is_hole(fd, &hdr, s)) {
+					ec_frag_sparse_stripe(&hdr, index, s, zero_csum);
+					continue;
+				}
+				if (map != NULL) {
+					ec_origin_stripe(map, &hdr, s, ebi->frag_ptrs, srcs);
+				}
+				else {
+					for (i = 0; i < k; i++) {
+						if ((n = preadn(fd, ebi->frag_ptrs[i], stripe_unit, (s * k + i) * stripe_unit)) < 0) {
+							ERR_SYS("preadn() error)");
+						}
+						if (n < stripe_unit) {	/* padding for the last stripe */
+							memset(ebi->frag_ptrs[i] + n, 0, stripe_unit - n);
+						}
+					}
+				}
+				t = ec_stat_add(set, EC_STAT_READ, t, k * stripe_unit);
+				// Generate EC parity blocks and the slice checksums from sources
+				ec_stripe_encode(ctx, srcs, csums);
+				t = w = ec_stat_add(set, EC_STAT_COMPUTE, t, k * stripe_unit);
+
+				for (i = 0; i < ebi->m; i++) {
+					entry = &index[i * nr_stripes + s];
+					entry->offset = EC_FRAG_STRIPE_OFFSET(&hdr, s);
+					entry->csum = csums[i];
+					if(pwriten(wfd[i], srcs[i], ebi->frag_len, entry->offset) != ebi->frag_len) {
+						ERR_SYS("pwriten() error");
+					}
+					t = ec_stat_frag_add(set, i, EC_STAT_FRAG_WRITE, t, stripe_unit);
+				}
+				ec_stat_count(set, EC_STAT_WRITE, t - w, m * stripe_unit);
+				set->stripes++;
+			}
+			total_time = set->stage[EC_STAT_COMPUTE].sum_ns / 1000;
+			ec_origin_unmap(map, file_size);
+			release_ec_buf(ebi);
+			bufpool_destroy(pool);
+			ec_ctx_destroy(ctx);
 		}
-		release_ec_buf(ebi);
+		msg("############ encode time: %ld (us) #############", total_time);
+		for (i = 0; i < m; i++) {
+			hdr.frag_index = i;
+			if (ec_frag_index_write(wfd[i], &hdr, &index[i * nr_stripes]) < 0
+				|| ec_frag_hdr_write(wfd[i], &hdr) < 0) {
+				ERR_SYS("write fragment header of '%s.%d' error", filename, i);
+			}
+			close(wfd[i]);
+		}
+		free(index);
 		close(fd);
+		ec_stats_export(stats, json_file, prom_file);
+		ec_stats_destroy(stats);
 	}
 	else {
-		// get frag_len
-		for (i = 0; i < m; i++) {
-			snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, i);
-			if (lstat(tmpname, &st) < 0) {
-				DBG("lstat('%s') error, skip it!", tmpname);
-				continue;
-			}
-			frag_len = st.st_size;
-			break;
+		if (ec_frag_open_all(filename, O_RDONLY, wfd, &hdr) < 0) {
+			err_quit("no valid fragment of '%s' found, quit", filename);
 		}
-		ebi = alloc_ec_buf(m, k, p, frag_len);
-		dbg("m[%d], k[%d], p[%d], frag_len[%d]", ebi->m, ebi->k, ebi->p, ebi->frag_len);
-		for (i = 0; i < m; i++) {
-			snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, i);
-			if ((tmpfd = open(tmpname, O_RDONLY)) < 0) {
-				DBG("open('%s') error, skip it....", tmpname);
-				ebi->frag_err_list[ebi->nerrs++] = i;
-				continue;
+		k = hdr.k;
+		p = hdr.p;
+		m = k + p;
+		file_size = hdr.orig_size;
+		stripe_unit = hdr.stripe_unit;
+		nr_stripes = hdr.nr_stripes;
+		/*
+		 * Sparse stripes are holes of the output, sized up front. To verify
+		 * the slices as they are read, every fragment's own index is needed;
+		 * a fragment without one is taken as lost.
+		 */
+		memset(indexes, 0, sizeof(indexes));
+		if (verify) {
+			ec_frag_indexes_read(wfd, &hdr, indexes);
+			for (i = 0, index = NULL; i < m && index == NULL; i++) {
+				index = indexes[i];
 			}
-			//dbg("ebi->frag_ptrs[%d], len:[%d]", i, ebi->frag_len);
-			if(readn(tmpfd, ebi->frag_ptrs[i], ebi->frag_len) != ebi->frag_len) {
-				ERR_SYS("readn() error");
+		}
+		else {
+			index = ec_frag_index_read_any(wfd, &hdr);
+		}
+		if (index == NULL) {
+			ERR_MSG("no valid stripe index, sparse stripes are decoded as data");
+		}
+		if ((tmpfd = open(filename, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
+			ERR_SYS("open('%s') error", filename);
+		}
+		stats = ec_stats_create("isal-ec", "decode", 1, m);
+		set = &stats->workers[0];
+		if (ftruncate(tmpfd, file_size) < 0) {
+			ERR_SYS("ftruncate('%s') error", filename);
+		}
+		for (i = 0; i < k && wfd[i] >= 0; i++)
+			;
+		if (i == k && !verify) {
+			/*
+			 * no data fragment lost: no parity read, no decode, copy the data fragments
+			 * out in the kernel. The copy never reaches user space, so it can't check the
+			 * slice checksums: with them (the default), the loop below reads the same k
+			 * slices and checks each, still without parity or decode.
+			 */
+			gettimeofday(&start, NULL);
+			t = ec_stat_now();
+			if (ec_copy_stripes(wfd, &hdr, index, 0, nr_stripes, tmpfd) < 0) {
+				ERR_SYS("copy data fragments to '%s' error", filename);
 			}
+			/* read and write in one go, counted as writes of the output */
+			ec_stat_add(set, EC_STAT_WRITE, t, file_size);
+			set->stripes = nr_stripes;
+			msg("####### Copy time: %ld (us) #########", time_since(&start));
+			ec_stats_export(stats, json_file, prom_file);
+			ec_stats_destroy(stats);
 			close(tmpfd);
+			free(index);
+			for (i = 0; i < m; i++) {
+				if (wfd[i] >= 0) {
+					close(wfd[i]);
+				}
+			}
+			dbg("decoder ok, no data fragment lost");
+			return 0;
+		}
+		ec_dec_cache_init(EC_DEC_CACHE_DEFAULT, cache_file);
+		pool = bufpool_create(stripe_unit, 64, m + p, 0);
+		ebi = alloc_ec_buf(pool, m, k, p, stripe_unit);
+		dbg("file_size[%ld], m[%d], k[%d], p[%d], stripe_unit[%d], stripes[%ld]", file_size, ebi->m, ebi->k, ebi->p, ebi->frag_len, nr_stripes);
+		for (i = 0, nsrcerrs = 0; i < m; i++) {
+			if (wfd[i] < 0) {
+				ebi->frag_err_list[ebi->nerrs++] = i;
+				nsrcerrs += i < k;
+			}
 		}
 		if (ebi->nerrs > p) {
 			release_ec_buf(ebi);
@@ -312,51 +706,105 @@ int main(int argc, char **argv)
 		//}	
 		//printf("\n####################################\n");
 
-		if (ebi->nerrs > 0) {
-			int	ret;
+		/* lost parity only: nothing to decode, no matrix inversion */
+		if (nsrcerrs > 0) {
 			gettimeofday(&start, NULL);
-			
-			gf_gen_cauchy1_matrix(ebi->encode_matrix, ebi->m, ebi->k);
-			ret = gf_gen_decode_matrix_simple(ebi->encode_matrix, ebi->decode_matrix,
-					 ebi->invert_matrix, ebi->temp_matrix, ebi->decode_index,
-                                          ebi->frag_err_list, ebi->nerrs, k, m);
-			if (ret != 0) {
-				ERR_QUIT("Fail on generate decode matrix, quit, ret[%d]", ret);
+			t = ec_stat_now();
+			dec_tbls = ec_dec_cache_get(k, p, ebi->frag_err_list, ebi->nerrs);
+			if (dec_tbls == NULL) {
+				ERR_QUIT("Fail on generate decode matrix, quit");
 			}
 			//for (i = 0; i < k; i++) {
-			//	dbg("decode_index[%d]: %d", i, ebi->decode_index[i]);
+			//	dbg("decode_index[%d]: %d", i, dec_tbls->decode_index[i]);
 			//}
 			// Pack recovery array pointers as list of valid fragments
 			for (i = 0; i < k; i++) {
-				ebi->recover_srcs[i] = ebi->frag_ptrs[ebi->decode_index[i]];
+				ebi->recover_srcs[i] = ebi->frag_ptrs[dec_tbls->decode_index[i]];
 			}
-			// Recover data
-			//ec_init_tables(k, p, &encode_matrix[k * k], g_tbls);
-			ec_init_tables(k, ebi->nerrs, ebi->decode_matrix, ebi->g_tbls);
-			//ec_encode_data(len, k, nerrs, g_tbls, recover_srcs, recover_outp);
-			ec_encode_data(ebi->frag_len, ebi->k, ebi->nerrs, ebi->g_tbls, ebi->recover_srcs, ebi->recover_outp);
+			ec_stat_add(set, EC_STAT_TABLES, t, ebi->nerrs * k * 32);
+			total_time += time_since(&start);
 		}
+		corrupt = 0;
 
 		// save frag buffer , don't memcpy()
 		for (i = 0; i < ebi->m; i++) {
 			ebi->recover_frag_ptrs[i] = ebi->frag_ptrs[i];
 		}
-		for (i = 0; i < ebi->nerrs; i++) {
-			ebi->recover_frag_ptrs[ebi->frag_err_list[i]] = ebi->recover_outp[i];
+		for (i = 0; i < nsrcerrs; i++) {
+			ebi->recover_frag_ptrs[dec_tbls->frag_err_list[i]] = ebi->recover_outp[i];
 		}
 
-		msg("####### Recovery time: %ld (us) #########", time_since(&start));
-		snprintf(tmpname, sizeof(tmpname), "%s", filename);
-		if ((tmpfd = open(tmpname, O_CREAT | O_RDWR, 0644)) < 0) {
-			ERR_SYS("open('%s') error", tmpname);
-		}
-		for (i = 0; i < ebi->k; i++) {
-			if(writen(tmpfd, ebi->recover_frag_ptrs[i], ebi->frag_len) != ebi->frag_len) {
-				ERR_SYS("writen() error");
+		for (s = 0; s < nr_stripes; s++) {
+			if (index != NULL && (index[s].flags & EC_STRIPE_SPARSE)) {
+				continue;
+			}
+			/* k reads: the data fragments, or the decode sources if data is lost; each slice verified as read */
+			t = w = ec_stat_now();
+			for (i = 0, nbad = 0; i < k; i++) {
+				src = nsrcerrs > 0 ? dec_tbls->decode_index[i] : i;
+				//dbg("ebi->frag_ptrs[%d], len:[%d]", src, ebi->frag_len);
+				if(preadn(wfd[src], ebi->frag_ptrs[src], ebi->frag_len, EC_FRAG_SLICE_OFFSET(&hdr, index, s)) != ebi->frag_len) {
+					ERR_SYS("preadn() error");
+				}
+				if (verify && !ec_frag_slice_ok(&hdr, indexes[src], s, ebi->frag_ptrs[src])) {
+					nbad++;
+				}
+				t = ec_stat_frag_add(set, src, EC_STAT_FRAG_READ, t, stripe_unit);
+			}
+			ec_stat_count(set, EC_STAT_READ, t - w, k * stripe_unit);
+			outp = ebi->recover_frag_ptrs;
+			if (nbad > 0) {
+				/* a corrupt slice: an erasure of this stripe, decoded from the other fragments */
+				if ((nbad = ec_stripe_recover(wfd, &hdr, indexes, s, ebi->frag_ptrs)) < 0) {
+					err_quit("stripe[%ld] can't be recovered, quit", s);
+				}
+				corrupt += nbad;
+				outp = ebi->frag_ptrs;
+				t = ec_stat_add(set, EC_STAT_COMPUTE, t, k * stripe_unit);
 			}
+			else if (nsrcerrs > 0) {
+				// Recover the lost data fragments only, lost parity isn't needed for the output
+				ec_encode_data(ebi->frag_len, ebi->k, nsrcerrs, dec_tbls->g_tbls, ebi->recover_srcs, ebi->recover_outp);
+				t = ec_stat_add(set, EC_STAT_COMPUTE, t, k * stripe_unit);
+			}
+			/* trim the padding of the last stripe */
+			for (i = 0, bytes = 0; i < ebi->k; i++) {
+				offset = (s * k + i) * stripe_unit;
+				if (offset >= file_size) {
+					break;
+				}
+				n = file_size - offset < stripe_unit ? file_size - offset : stripe_unit;
+				if(pwriten(tmpfd, outp[i], n, offset) != n) {
+					ERR_SYS("pwriten() error");
+				}
+				bytes += n;
+			}
+			ec_stat_add(set, EC_STAT_WRITE, t, bytes);
+			set->stripes++;
+		}
+		total_time += set->stage[EC_STAT_COMPUTE].sum_ns / 1000;
+		msg("####### Recovery time: %ld (us) #########", total_time);
+		if (corrupt > 0) {
+			msg("[%ld] corrupt slices decoded as erasures", corrupt);
 		}
 		close(tmpfd);
+		if (!verify) {
+			free(index);
+		}
+		for (i = 0; i < m; i++) {
+			free(indexes[i]);
+		}
+		for (i = 0; i < m; i++) {
+			if (wfd[i] >= 0) {
+				close(wfd[i]);
+			}
+		}
+		ec_dec_cache_put(dec_tbls);
+		ec_dec_cache_release();
 		release_ec_buf(ebi);
+		bufpool_destroy(pool);
+		ec_stats_export(stats, json_file, prom_file);
+		ec_stats_destroy(stats);
 		dbg("decoder ok");
 	}
 	return 0;
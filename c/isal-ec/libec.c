@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <isa-l.h>
+
+#include "ec-table.h"
+#include "libec.h"
+
+struct ec_ctx {
+	int		k;
+	int		p;
+	int		m;
+	int		stripe_unit;
+	int		csum_type;
+	const EC_ENC_TBLS	*enc_tbls;	/* shared, never freed */
+};
+
+/* NULL with *err set on failure, 'err' may be NULL */
+EC_CTX *ec_ctx_create(int k, int p, int stripe_unit, int csum_type, int *err)
+{
+	EC_CTX	*ctx;
+	int	ret = EC_ERR_INVAL;
+
+	if (k < 1 || p < 1 || k + p >= M_K_P_MAX || stripe_unit < 1
+		|| (csum_type != EC_CSUM_NONE && csum_type != EC_CSUM_CRC32C && csum_type != EC_CSUM_CRC64)) {
+		goto err;
+	}
+	ret = EC_ERR_NOMEM;
+	if ((ctx = malloc(sizeof(EC_CTX))) == NULL) {
+		goto err;
+	}
+	if ((ctx->enc_tbls = ec_enc_tables_get(k, p)) == NULL) {
+		free(ctx);
+		goto err;
+	}
+	ctx->k = k;
+	ctx->p = p;
+	ctx->m = k + p;
+	ctx->stripe_unit = stripe_unit;
+	ctx->csum_type = csum_type;
+	if (err != NULL) {
+		*err = EC_OK;
+	}
+	return ctx;
+err:
+	if (err != NULL) {
+		*err = ret;
+	}
+	return NULL;
+}
+
+void ec_ctx_destroy(EC_CTX *ctx)
+{
+	free(ctx);
+}
+
+uint64_t ec_slice_csum(const EC_CTX *ctx, const unsigned char *buf)
+{
+	if (ctx->csum_type == EC_CSUM_CRC64) {
+		return crc64_ecma_refl(0, buf, ctx->stripe_unit);
+	}
+	return crc32_iscsi((unsigned char *)buf, ctx->stripe_unit, 0xFFFFFFFF);
+}
+
+/* parity of frags[0..k) into frags[k..m), and the m slice checksums if 'csums' isn't NULL */
+int ec_stripe_encode(const EC_CTX *ctx, unsigned char **frags, uint64_t *csums)
+{
+	int	i;
+
+	if (frags == NULL || (csums != NULL && ctx->csum_type == EC_CSUM_NONE)) {
+		return EC_ERR_INVAL;
+	}
+	ec_encode_data(ctx->stripe_unit, ctx->k, ctx->p, (u8 *)ctx->enc_tbls->g_tbls, frags, &frags[ctx->k]);
+	if (csums != NULL) {
+		for (i = 0; i < ctx->m; i++) {
+			csums[i] = ec_slice_csum(ctx, frags[i]);
+		}
+	}
+	return EC_OK;
+}
+
+/*
+ * Rebuild the slices of 'err_list', data or parity, in place from the others.
+ * frags[] of the erased slices are the output buffers.
+ */
+int ec_stripe_decode(const EC_CTX *ctx, unsigned char **frags, const unsigned char *err_list, int nerrs)
+{
+	u8		*recover_srcs[M_K_P_MAX], *recover_outp[M_K_P_MAX], seen[M_K_P_MAX];
+	EC_DEC_TBLS	*dec_tbls;
+	int		i;
+
+	if (nerrs == 0) {
+		return EC_OK;
+	}
+	if (frags == NULL || err_list == NULL || nerrs < 0) {
+		return EC_ERR_INVAL;
+	}
+	memset(seen, 0, ctx->m);
+	for (i = 0; i < nerrs; i++) {
+		if (err_list[i] >= ctx->m || seen[err_list[i]]++) {
+			return EC_ERR_INVAL;
+		}
+	}
+	if (nerrs > ctx->p) {
+		return EC_ERR_TOO_MANY_ERASURES;
+	}
+	errno = 0;
+	if ((dec_tbls = ec_dec_cache_get(ctx->k, ctx->p, err_list, nerrs)) == NULL) {
+		return errno == ENOMEM ? EC_ERR_NOMEM : EC_ERR_DECODE;
+	}
+	for (i = 0; i < ctx->k; i++) {
+		recover_srcs[i] = frags[dec_tbls->decode_index[i]];
+	}
+	/* row r of the tables recovers the r-th of the sorted list */
+	for (i = 0; i < nerrs; i++) {
+		recover_outp[i] = frags[dec_tbls->frag_err_list[i]];
+	}
+	ec_encode_data(ctx->stripe_unit, ctx->k, nerrs, dec_tbls->g_tbls, recover_srcs, recover_outp);
+	ec_dec_cache_put(dec_tbls);
+	return EC_OK;
+}
+
+/*
+ * Verify the slices not in 'err_list' against the m checksums of their encode,
+ * and rebuild the corrupt ones together with the erased ones. Returns the
+ * number of slices rebuilt.
+ */
+int ec_stripe_repair(const EC_CTX *ctx, unsigned char **frags, const uint64_t *csums,
+		     const unsigned char *err_list, int nerrs)
+{
+	u8	bad[M_K_P_MAX], erased[M_K_P_MAX];
+	int	i, nbad, ret;
+
+	if (ctx->csum_type == EC_CSUM_NONE || frags == NULL || csums == NULL
+		|| nerrs < 0 || nerrs > ctx->m || (nerrs > 0 && err_list == NULL)) {
+		return EC_ERR_INVAL;
+	}
+	memset(erased, 0, ctx->m);
+	for (i = 0; i < nerrs; i++) {
+		if (err_list[i] >= ctx->m) {
+			return EC_ERR_INVAL;
+		}
+		erased[err_list[i]] = 1;
+	}
+	if (nerrs > 0) {
+		memcpy(bad, err_list, nerrs);
+	}
+	for (i = 0, nbad = nerrs; i < ctx->m; i++) {
+		if (!erased[i] && ec_slice_csum(ctx, frags[i]) != csums[i]) {
+			bad[nbad++] = i;
+		}
+	}
+	if ((ret = ec_stripe_decode(ctx, frags, bad, nbad)) < 0) {
+		return ret;
+	}
+	return nbad;
+}
+
+const char *ec_strerror(int err)
+{
+	switch (err) {
+	case EC_OK:
+		return "success";
+	case EC_ERR_INVAL:
+		return "invalid argument";
+	case EC_ERR_NOMEM:
+		return "out of memory";
+	case EC_ERR_TOO_MANY_ERASURES:
+		return "more than p slices lost or corrupt";
+	case EC_ERR_DECODE:
+		return "erasure pattern can't be decoded";
+	}
+	return "unknown error";
+}
+
+void ec_cache_init(int max_entries, const char *path)
+{
+	ec_dec_cache_init(max_entries, path);
+}
+
+void ec_cache_release(void)
+{
+	ec_dec_cache_release();
+}
+
+void ec_set_log(void (*log)(const char *msg))
+{
+	ec_table_set_log(log);
+}
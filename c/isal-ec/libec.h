@@ -0,0 +1,60 @@
+#ifndef __LIBEC_H__
+#define __LIBEC_H__
+
+#include <stdint.h>
+
+/*
+ * libec: stripe level erasure coding of isal-ec for embedding in a process.
+ * A context holds one (k, p, stripe_unit, checksum) profile, all calls work
+ * on caller-owned buffers of stripe_unit bytes, frags[0..k) are the data
+ * slices and frags[k..k+p) the parity slices of one stripe. Nothing exits
+ * the process, errors are returned as negative EC_ERR_* codes.
+ *
+ * A context is read-only after ec_ctx_create(): any number of threads may
+ * use the same one at the same time. Encode tables and the decode table
+ * cache are shared by all contexts of the process.
+ *
+ * The decode table cache keeps the tables of the last 64 erasure patterns
+ * decoded. ec_cache_init() bounds it to 'max_entries' (<= 0 keeps the
+ * bound) and loads the cache file 'path' if not NULL, ec_cache_release()
+ * saves it back and frees every entry. A cache file that can't be read or
+ * written is otherwise ignored.
+ *
+ * libec prints nothing. Its messages (cache files ignored or not saved,
+ * tables generated) are passed one line at a time, without newline, to
+ * the hook of ec_set_log(), NULL drops them (the default).
+ *
+ * Only the calls below are exported from libec.so and libec.a. Of the
+ * tools, isal-ec's synchronous encode goes through them; decode, the aio
+ * encode and thread-isal-ec keep one set of tables across stripes (NUMA
+ * local in thread-isal-ec) and call ec-table directly.
+ */
+
+#define EC_API			__attribute__((visibility("default")))
+
+#define EC_OK			0
+#define EC_ERR_INVAL		(-1)	/* bad profile, buffer or erasure list */
+#define EC_ERR_NOMEM		(-2)
+#define EC_ERR_TOO_MANY_ERASURES	(-3)	/* more than p slices lost or corrupt */
+#define EC_ERR_DECODE		(-4)	/* no decode matrix for the erasure pattern */
+
+/* slice checksums, also the csum_type of the fragment header (ec-frag.h) */
+#define EC_CSUM_NONE		0
+#define EC_CSUM_CRC32C		1	/* crc32_iscsi */
+#define EC_CSUM_CRC64		2	/* crc64_ecma_refl */
+
+typedef struct ec_ctx EC_CTX;
+
+EC_API EC_CTX	*ec_ctx_create(int k, int p, int stripe_unit, int csum_type, int *err);
+EC_API void	ec_ctx_destroy(EC_CTX *ctx);
+EC_API int	ec_stripe_encode(const EC_CTX *ctx, unsigned char **frags, uint64_t *csums);
+EC_API int	ec_stripe_decode(const EC_CTX *ctx, unsigned char **frags, const unsigned char *err_list, int nerrs);
+EC_API int	ec_stripe_repair(const EC_CTX *ctx, unsigned char **frags, const uint64_t *csums,
+				 const unsigned char *err_list, int nerrs);
+EC_API uint64_t	ec_slice_csum(const EC_CTX *ctx, const unsigned char *buf);
+EC_API const char	*ec_strerror(int err);
+EC_API void	ec_cache_init(int max_entries, const char *path);
+EC_API void	ec_cache_release(void);
+EC_API void	ec_set_log(void (*log)(const char *msg));
+
+#endif
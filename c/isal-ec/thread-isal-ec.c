@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <limits.h>
 #include <libaio.h>
@@ -18,12 +19,15 @@
 
 #include "common.h"
 #include "error.h"
+#include "bufpool.h"
+#include "ec-table.h"
+#include "ec-frag.h"
+#include "ec-numa.h"
+#include "ec-stats.h"
 
-#define M_K_P_MAX	255
 #define K_DEFAULT	6
 #define P_DEFAULT	3
-
-typedef unsigned char u8;
+#define STRIPE_UNIT_DEFAULT	(1024 * 1024)	// 1M per fragment
 
 typedef struct erasure_code_buf_info {
 	int		m;
@@ -37,17 +41,11 @@ typedef struct erasure_code_buf_info {
         unsigned char	frag_err_list[M_K_P_MAX];
 	int		nerrs;
       	unsigned char	*recover_frag_ptrs[M_K_P_MAX];
-	
-	// Coefficient matrices
-	unsigned char	*encode_matrix;
-	unsigned char	*decode_matrix;
-	unsigned char 	*invert_matrix;
-	unsigned char	*temp_matrix;
-	unsigned char	*g_tbls;
-	unsigned char	decode_index[M_K_P_MAX];
+	BUF_POOL	*pool;		/* frag_ptrs and recover_outp come from it */
 } EC_BUF_INFO;
 
-EC_BUF_INFO* alloc_ec_buf(int m, int k, int p, int frag_len)
+/* m + p buffers of frag_len from 'pool', it must be created for at least frag_len */
+EC_BUF_INFO* alloc_ec_buf(BUF_POOL *pool, int m, int k, int p, int frag_len)
 {
 	int	i;
 	EC_BUF_INFO	*ebi;
@@ -62,30 +60,20 @@ EC_BUF_INFO* alloc_ec_buf(int m, int k, int p, int frag_len)
 	ebi->p = p;
 	ebi->frag_len = frag_len;
 	ebi->nerrs = 0;
-	
-        // Allocate coding matrices
-        ebi->encode_matrix = malloc(m * k);
-        ebi->decode_matrix = malloc(m * k);
-        ebi->invert_matrix = malloc(m * k);
-        ebi->temp_matrix = malloc(m * k);
-        ebi->g_tbls = malloc(k * p * 32);
-
-        if (ebi->encode_matrix == NULL || ebi->decode_matrix == NULL || ebi->invert_matrix == NULL
-		|| ebi->temp_matrix == NULL || ebi->g_tbls == NULL) {
-		ERR_SYS("malloc() error");
-        }
+	ebi->pool = pool;
+
 	// alloc for frag
 	for (i = 0; i < m; i++) {
-		ebi->frag_ptrs[i] = malloc(ebi->frag_len);
+		ebi->frag_ptrs[i] = bufpool_get(pool);
 		if (ebi->frag_ptrs[i] == NULL) {
-			ERR_SYS("malloc() error");
+			ERR_QUIT("buffer pool exhausted");
 		}
 	}
 	// alloc for recover_outp
 	for (i = 0; i < p; i++) {
-		ebi->recover_outp[i] = malloc(ebi->frag_len);
+		ebi->recover_outp[i] = bufpool_get(pool);
 		if (ebi->recover_outp[i] == NULL) {
-			ERR_SYS("malloc() error");
+			ERR_QUIT("buffer pool exhausted");
 		}
 	}
 	return ebi;
@@ -98,21 +86,11 @@ void release_ec_buf(EC_BUF_INFO *ebi)
 	if (ebi == NULL) {
 		return;
 	}
-	if (ebi->encode_matrix) free(ebi->encode_matrix);
-	if (ebi->decode_matrix) free(ebi->decode_matrix);
-	if (ebi->invert_matrix) free(ebi->invert_matrix);
-	if (ebi->temp_matrix) free(ebi->temp_matrix);
-	if (ebi->g_tbls) free(ebi->g_tbls);
-
 	for (i = 0; i < ebi->m; i++) {
-		if (ebi->frag_ptrs[i] != NULL) {
-			free(ebi->frag_ptrs[i]);
-		}
+		bufpool_put(ebi->pool, ebi->frag_ptrs[i]);
 	}
 	for (i = 0; i < ebi->p; i++) {
-		if (ebi->recover_outp[i] != NULL) {
-			free(ebi->recover_outp[i]);
-		}
+		bufpool_put(ebi->pool, ebi->recover_outp[i]);
 	}
 	free(ebi);
 
@@ -120,70 +98,13 @@ void release_ec_buf(EC_BUF_INFO *ebi)
 }
 
 
-static int gf_gen_decode_matrix_simple(u8 * encode_matrix,
-                                       u8 * decode_matrix,
-                                       u8 * invert_matrix,
-                                       u8 * temp_matrix,
-                                       u8 * decode_index, u8 * frag_err_list, int nerrs, int k,
-                                       int m)
-{
-        int i, j, p, r;
-        int nsrcerrs = 0;
-        u8 s, *b = temp_matrix;
-        u8 frag_in_err[M_K_P_MAX];
-
-        memset(frag_in_err, 0, sizeof(frag_in_err));
-
-        // Order the fragments in erasure for easier sorting
-        for (i = 0; i < nerrs; i++) {
-                if (frag_err_list[i] < k)
-                        nsrcerrs++;
-                frag_in_err[frag_err_list[i]] = 1;
-        }
-
-        // Construct b (matrix that encoded remaining frags) by removing erased rows
-        for (i = 0, r = 0; i < k; i++, r++) {
-                while (frag_in_err[r])
-                        r++;
-                for (j = 0; j < k; j++)
-                        b[k * i + j] = encode_matrix[k * r + j];
-                decode_index[i] = r;
-        }
-
-        // Invert matrix to get recovery matrix
-        if (gf_invert_matrix(b, invert_matrix, k) < 0)
-                return -1;
-
-        // Get decode matrix with only wanted recovery rows
-        for (i = 0; i < nerrs; i++) {
-                if (frag_err_list[i] < k)       // A src err
-                        for (j = 0; j < k; j++)
-                                decode_matrix[k * i + j] =
-                                    invert_matrix[k * frag_err_list[i] + j];
-        }
-
-        // For non-src (parity) erasures need to multiply encode matrix * invert
-        for (p = 0; p < nerrs; p++) {
-                if (frag_err_list[p] >= k) {    // A parity err
-                        for (i = 0; i < k; i++) {
-                                s = 0;
-                                for (j = 0; j < k; j++)
-                                        s ^= gf_mul(invert_matrix[j * k + i],
-                                                    encode_matrix[k * frag_err_list[p] + j]);
-                                decode_matrix[k * p + i] = s;
-                        }
-                }
-        }
-        return 0;
-}
-
-int time_since(struct timeval *tvold)
+int64_t time_since(struct timeval *tvold)
 {
 	struct timeval	tvnow;
-	int		gap;
+	int64_t		gap;
 
 	gettimeofday(&tvnow, NULL);
-	gap = (tvnow.tv_sec - tvold->tv_sec)*1000*1000 + (tvnow.tv_usec - tvold->tv_usec);
+	gap = (int64_t)(tvnow.tv_sec - tvold->tv_sec)*1000*1000 + (tvnow.tv_usec - tvold->tv_usec);
 
 	return gap;	// return 'us'
 }
@@ -192,24 +113,154 @@ typedef struct erasure_sharding_index_info {
         int     m;
         int     k;
         int     p;
-        int     frag_len;
-        int     fd;
-	int	wfd[M_K_P_MAX];
-	int	block_len;
-	int64_t	offset;
-        int     index;
+        int     frag_len;	/* stripe unit: bytes of one fragment in one stripe */
+        int     fd;		/* encode: origin file, decode: output file */
+	int	wfd[M_K_P_MAX];	/* fragment files, -1 if lost */
+        int     index;		/* worker index, also the index of its stripe queue */
         int	time;
+	int64_t	stripes;	/* stripes encoded/decoded by this worker */
+	int64_t	corrupt;	/* decode, verify: bad slices found */
+	EC_FRAG_HDR	*hdr;		/* fragment layout, shared read-only */
+	EC_STRIPE_ENTRY	*frag_index;	/* encode: m * nr_stripes, workers fill their own stripes; decode, verify: any fragment's, or NULL */
+	EC_STRIPE_ENTRY	**indexes;	/* decode, verify: every fragment's own index to verify slices against, NULL not to verify */
+	uint64_t	zero_csum;	/* encode only: slice checksum of sparse stripes */
+	const u8	*map;		/* encode only: mapped origin ('-M'), NULL to preadn */
+	const EC_ENC_TBLS	*enc_tbls;	/* encode, verify: shared read-only by all workers */
+	EC_DEC_TBLS	*dec_tbls;	/* decode only: decode_index and g_tbls shared read-only, NULL if no erasure */
+	BUF_POOL	*pool;		/* stripe buffers of all workers, or of this one if pinned */
+	int		cpu;		/* '-N': cpu the worker is pinned to, -1 if not pinned */
+	int		node;		/* '-N': NUMA node of 'cpu' */
+	EC_STAT_SET	*stats;		/* counters of this worker, set 0 also has the table setup of main() */
 } THREAD_BLOCK_INFO;
 
-int		nr_cpus;
-void *pthread_encode_ec_block(void *arg)
+/*
+ * Per-worker queue of stripes [begin, end). The owner takes stripes from the
+ * front, idle workers steal the back half of a victim's remaining range.
+ */
+typedef struct stripe_range_queue {
+	pthread_mutex_t	lock;
+	int64_t		begin;
+	int64_t		end;
+} STRIPE_QUEUE;
+
+int		nr_threads;
+STRIPE_QUEUE	*stripe_queue;
+
+void stripe_queue_init(int64_t nr_stripes)
+{
+	int	i;
+
+	stripe_queue = malloc(nr_threads * sizeof(STRIPE_QUEUE));
+	if (NULL == stripe_queue) {
+		ERR_SYS("malloc(STRIPE_QUEUE) error");
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_mutex_init(&stripe_queue[i].lock, NULL);
+		stripe_queue[i].begin = nr_stripes * i / nr_threads;
+		stripe_queue[i].end = nr_stripes * (i + 1) / nr_threads;
+	}
+}
+
+void stripe_queue_release(void)
+{
+	int	i;
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_mutex_destroy(&stripe_queue[i].lock);
+	}
+	free(stripe_queue);
+	stripe_queue = NULL;
+}
+
+/* return the next stripe for worker 'self', or -1 when no stripe is left anywhere */
+int64_t stripe_queue_pop(int self)
+{
+	STRIPE_QUEUE	*q, *victim;
+	int64_t		stripe, half;
+	int		i;
+
+	q = &stripe_queue[self];
+	pthread_mutex_lock(&q->lock);
+	if (q->begin < q->end) {
+		stripe = q->begin++;
+		pthread_mutex_unlock(&q->lock);
+		return stripe;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	/* own queue is empty, steal from the others */
+	for (i = 1; i < nr_threads; i++) {
+		victim = &stripe_queue[(self + i) % nr_threads];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->begin >= victim->end) {
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		half = (victim->end - victim->begin + 1) / 2;
+		victim->end -= half;
+		stripe = victim->end;
+		pthread_mutex_unlock(&victim->lock);
+
+		pthread_mutex_lock(&q->lock);
+		q->begin = stripe + 1;
+		q->end = stripe + half;
+		pthread_mutex_unlock(&q->lock);
+		return stripe;
+	}
+	return -1;
+}
+
+/*
+ * '-N': pin the calling worker to its cpu, then create its own stripe buffers
+ * and a copy of 'g_tbls' (len bytes) from here. Both are first touched by
+ * the pinned thread, so they sit on its node and ec_encode_data doesn't read
+ * across sockets. Returns the g_tbls the worker uses, 'g_tbls' if not pinned.
+ * 'g_tbls' may be NULL, then only the buffers are set up.
+ */
+u8 *worker_numa_setup(THREAD_BLOCK_INFO *t_block_info, const u8 *g_tbls, int len)
+{
+	u8	*local_tbls;
+
+	if (t_block_info->cpu < 0) {
+		return (u8 *)g_tbls;
+	}
+	if (ec_numa_pin(t_block_info->cpu) < 0) {
+		ERR_MSG("pin worker[%d] to cpu[%d] error", t_block_info->index, t_block_info->cpu);
+	}
+	t_block_info->pool = bufpool_create(t_block_info->frag_len, 64, t_block_info->m + t_block_info->p, BUFPOOL_POPULATE);
+	if (g_tbls == NULL) {	/* decode with no erasure */
+		return NULL;
+	}
+	if (posix_memalign((void **)&local_tbls, 64, len) != 0) {
+		ERR_QUIT("posix_memalign() error");
+	}
+	memcpy(local_tbls, g_tbls, len);
+	DBG("worker[%d]: cpu[%d], node[%d]", t_block_info->index, t_block_info->cpu, t_block_info->node);
+	return local_tbls;
+}
+
+void worker_numa_release(THREAD_BLOCK_INFO *t_block_info, u8 *g_tbls)
+{
+	if (t_block_info->cpu < 0) {
+		return;
+	}
+	bufpool_destroy(t_block_info->pool);
+	t_block_info->pool = NULL;
+	free(g_tbls);
+}
+
+void *pthread_encode_ec_worker(void *arg)
 {
 	THREAD_BLOCK_INFO *t_block_info = (THREAD_BLOCK_INFO *)arg;
 	int	m, k, p, frag_len, index;
 	int	fd, i;
-	int64_t	offset;
+	int64_t	stripe, offset, n;
+	EC_FRAG_HDR	*hdr = t_block_info->hdr;
+	EC_STRIPE_ENTRY	*entry;
 	EC_BUF_INFO	*ebi;
-	struct timeval	start;
+	EC_STAT_SET	*stats = t_block_info->stats;
+	u8		*srcs[M_K_P_MAX], *g_tbls;
+	uint64_t	t, w;
 	
 	m = t_block_info->m;
 	k = t_block_info->k;
@@ -217,68 +268,432 @@ void *pthread_encode_ec_block(void *arg)
 	frag_len = t_block_info->frag_len;
 	index = t_block_info->index;
 	fd = t_block_info->fd;
-	offset = t_block_info->offset;
 
+	t = ec_stat_now();
+	g_tbls = worker_numa_setup(t_block_info, t_block_info->enc_tbls->g_tbls, k * p * 32);
+	ec_stat_add(stats, EC_STAT_TABLES, t, k * p * 32);
+	ebi = alloc_ec_buf(t_block_info->pool, m, k, p, frag_len);
+	/* data slices of a mapped origin are encoded in place */
+	memcpy(srcs, ebi->frag_ptrs, sizeof(srcs));
+
+	t = ec_stat_now();
+	while ((stripe = stripe_queue_pop(index)) >= 0) {
+		t = ec_stat_add(stats, EC_STAT_QUEUE_WAIT, t, 0);
+		/* a hole: zero parity, nothing to read, encode or write */
+		if (ec_stripe_is_hole(fd, hdr, stripe)) {
+			ec_frag_sparse_stripe(hdr, t_block_info->frag_index, stripe, t_block_info->zero_csum);
+			t = ec_stat_now();	/* the lseek() isn't queue wait */
+			continue;
+		}
+		offset = stripe * k * frag_len;
+		//DBG("ptid[%ld], index[%d], stripe[%ld], offset[%lld]", pthread_self(), index, stripe, offset);
+		if (t_block_info->map != NULL) {
+			ec_origin_stripe(t_block_info->map, hdr, stripe, ebi->frag_ptrs, srcs);
+		}
+		else {
+			for (i = 0; i < k; i++) {
+				if ((n = preadn(fd, ebi->frag_ptrs[i], frag_len, offset + i * frag_len)) < 0) {
+					ERR_SYS("preadn() error)");
+				}
+				if (n < frag_len) {	/* padding for the last stripe */
+					memset(ebi->frag_ptrs[i] + n, 0, frag_len - n);
+				}
+			}
+		}
+		t = ec_stat_add(stats, EC_STAT_READ, t, (int64_t)k * frag_len);
+
+		// Generate EC parity blocks from sources
+		ec_encode_data(frag_len, k, p, g_tbls, srcs, &srcs[k]);
+		t = w = ec_stat_add(stats, EC_STAT_COMPUTE, t, (int64_t)k * frag_len);
+
+		for (i = 0; i < ebi->m; i++) {
+			entry = &t_block_info->frag_index[i * hdr->nr_stripes + stripe];
+			entry->offset = EC_FRAG_STRIPE_OFFSET(hdr, stripe);
+			entry->csum = ec_frag_csum(hdr, srcs[i], ebi->frag_len);
+			if(pwriten(t_block_info->wfd[i], srcs[i], ebi->frag_len, entry->offset) != ebi->frag_len) {
+				ERR_SYS("writen() error");
+			}
+			t = ec_stat_frag_add(stats, i, EC_STAT_FRAG_WRITE, t, frag_len);
+		}
+		ec_stat_count(stats, EC_STAT_WRITE, t - w, (int64_t)m * frag_len);
+		t_block_info->stripes++;
+	}
+	t_block_info->time = stats->stage[EC_STAT_COMPUTE].sum_ns / 1000;
+	stats->stripes = t_block_info->stripes;
+	release_ec_buf(ebi);
+	worker_numa_release(t_block_info, g_tbls);
+	
+	return NULL;
+}
+
+void *pthread_decode_ec_worker(void *arg)
+{
+	THREAD_BLOCK_INFO *t_block_info = (THREAD_BLOCK_INFO *)arg;
+	EC_DEC_TBLS	*dec_tbls = t_block_info->dec_tbls;
+	int	m, k, p, frag_len, index, nsrcerrs, nbad;
+	int	i, src;
+	int64_t	stripe, offset, n, bytes;
+	EC_FRAG_HDR	*hdr = t_block_info->hdr;
+	EC_BUF_INFO	*ebi;
+	EC_STAT_SET	*stats = t_block_info->stats;
+	EC_STRIPE_ENTRY	**indexes = t_block_info->indexes;
+	u8		*g_tbls, **outp;
+	uint64_t	t, r;
 
-	//DBG("ptid[%ld], m[%d], k[%d], p[%d], frag_len[%d], offset[%lld], index[%d]", pthread_self(), m, k, p, frag_len, offset, index);
-	ebi = alloc_ec_buf(m, k, p, frag_len);
+	m = t_block_info->m;
+	k = t_block_info->k;
+	p = t_block_info->p;
+	frag_len = t_block_info->frag_len;
+	index = t_block_info->index;
+	nsrcerrs = dec_tbls ? dec_tbls->nsrcerrs : 0;
+
+	if (nsrcerrs == 0 && indexes == NULL) {
+		/* all data fragments present, checksums not checked (-n): copy them out in the kernel, parity isn't read */
+		t = ec_stat_now();
+		while ((stripe = stripe_queue_pop(index)) >= 0) {
+			t = ec_stat_add(stats, EC_STAT_QUEUE_WAIT, t, 0);
+			if (ec_copy_stripes(t_block_info->wfd, hdr, t_block_info->frag_index, stripe, 1, t_block_info->fd) < 0) {
+				ERR_SYS("copy stripe[%ld] error", stripe);
+			}
+			/* read and write in one go, counted as writes of the output */
+			t = ec_stat_add(stats, EC_STAT_WRITE, t, (int64_t)k * frag_len);
+			t_block_info->stripes++;
+		}
+		stats->stripes = t_block_info->stripes;
+		return NULL;
+	}
+
+	t = ec_stat_now();
+	g_tbls = worker_numa_setup(t_block_info, dec_tbls ? dec_tbls->g_tbls : NULL, dec_tbls ? dec_tbls->nerrs * k * 32 : 0);
+	ec_stat_add(stats, EC_STAT_TABLES, t, dec_tbls ? dec_tbls->nerrs * k * 32 : 0);
+	ebi = alloc_ec_buf(t_block_info->pool, m, k, p, frag_len);
 	for (i = 0; i < k; i++) {
-		if (preadn(fd, ebi->frag_ptrs[i], frag_len, offset + i * frag_len) != frag_len) {
-			ERR_SYS("preadn() error)");
+		ebi->recover_frag_ptrs[i] = ebi->frag_ptrs[i];
+		if (nsrcerrs > 0) {
+			ebi->recover_srcs[i] = ebi->frag_ptrs[dec_tbls->decode_index[i]];
 		}
 	}
+	for (i = 0; i < nsrcerrs; i++) {
+		ebi->recover_frag_ptrs[dec_tbls->frag_err_list[i]] = ebi->recover_outp[i];
+	}
 
-	gettimeofday(&start, NULL);
-	gf_gen_cauchy1_matrix(ebi->encode_matrix, m, k);
-	// Initialize g_tbls from encode matrix
-	ec_init_tables(k, p, &(ebi->encode_matrix)[k * k], ebi->g_tbls);
-	// Generate EC parity blocks from sources
-	ec_encode_data(frag_len, k, p, ebi->g_tbls, ebi->frag_ptrs, &(ebi->frag_ptrs)[k]);
+	t = ec_stat_now();
+	while ((stripe = stripe_queue_pop(index)) >= 0) {
+		t = ec_stat_add(stats, EC_STAT_QUEUE_WAIT, t, 0);
+		/* a hole of the output, sized by main() */
+		if (t_block_info->frag_index != NULL && (t_block_info->frag_index[stripe].flags & EC_STRIPE_SPARSE)) {
+			t = ec_stat_now();
+			continue;
+		}
+		/* k reads per stripe: the data fragments, or the decode sources if data is lost; each slice verified as read */
+		for (i = 0, r = t, nbad = 0; i < k; i++) {
+			src = nsrcerrs > 0 ? dec_tbls->decode_index[i] : i;
+			if (preadn(t_block_info->wfd[src], ebi->frag_ptrs[src], frag_len, EC_FRAG_SLICE_OFFSET(hdr, t_block_info->frag_index, stripe)) != frag_len) {
+				ERR_SYS("preadn() error");
+			}
+			if (indexes != NULL && !ec_frag_slice_ok(hdr, indexes[src], stripe, ebi->frag_ptrs[src])) {
+				nbad++;
+			}
+			t = ec_stat_frag_add(stats, src, EC_STAT_FRAG_READ, t, frag_len);
+		}
+		ec_stat_count(stats, EC_STAT_READ, t - r, (int64_t)k * frag_len);
+		outp = ebi->recover_frag_ptrs;
+		if (nbad > 0) {
+			/* a corrupt slice: an erasure of this stripe, decoded from the other fragments */
+			if ((nbad = ec_stripe_recover(t_block_info->wfd, hdr, indexes, stripe, ebi->frag_ptrs)) < 0) {
+				err_quit("stripe[%ld] can't be recovered, quit", stripe);
+			}
+			t_block_info->corrupt += nbad;
+			outp = ebi->frag_ptrs;
+			t = ec_stat_add(stats, EC_STAT_COMPUTE, t, (int64_t)k * frag_len);
+		}
+		else if (nsrcerrs > 0) {
+			// Recover the lost data fragments only, lost parity isn't needed for the output
+			ec_encode_data(frag_len, k, nsrcerrs, g_tbls, ebi->recover_srcs, ebi->recover_outp);
+			t = ec_stat_add(stats, EC_STAT_COMPUTE, t, (int64_t)k * frag_len);
+		}
+		/* trim the padding of the last stripe */
+		for (i = 0, bytes = 0; i < k; i++) {
+			offset = (stripe * k + i) * frag_len;
+			if (offset >= hdr->orig_size) {
+				break;
+			}
+			n = hdr->orig_size - offset < frag_len ? hdr->orig_size - offset : frag_len;
+			if (pwriten(t_block_info->fd, outp[i], n, offset) != n) {
+				ERR_SYS("pwriten() error");
+			}
+			bytes += n;
+		}
+		t = ec_stat_add(stats, EC_STAT_WRITE, t, bytes);
+		t_block_info->stripes++;
+	}
+	t_block_info->time = stats->stage[EC_STAT_COMPUTE].sum_ns / 1000;
+	stats->stripes = t_block_info->stripes;
+	release_ec_buf(ebi);
+	worker_numa_release(t_block_info, g_tbls);
 
-	t_block_info->time = time_since(&start);
-	for (i = 0; i < ebi->m; i++) {
-		//DBG("ptid[%ld], wfd[%d]: %d, index[%d], pwriten(offset): %lld, write_len:[%ld]", pthread_self(), i, t_block_info->wfd[i], index, index*frag_len, ebi->frag_len);
-		if(pwriten(t_block_info->wfd[i], ebi->frag_ptrs[i], ebi->frag_len, index * frag_len) != ebi->frag_len) {
-			ERR_SYS("writen() error");
+	return NULL;
+}
+
+/*
+ * Compare the parity re-encoded into 'outp' with the stored parity slices of
+ * 'stripe' that passed their checksum. If some of them agree with the data,
+ * the others are bad. If none does, a data slice is more likely bad than all
+ * of them: each data slice is in turn recovered from the others, the one
+ * whose recovery makes the stored parity agree is reported. That takes two
+ * good parity slices. Returns the number of bad slices.
+ */
+static int verify_parity(const EC_FRAG_HDR *hdr, const u8 *g_tbls, u8 **bufs, u8 **outp, const int *ok,
+			 int64_t stripe, u8 *scratch)
+{
+	int		i, j, d, k, p, su, nerrs, nbad, nok, bad[M_K_P_MAX];
+	u8		err_list[M_K_P_MAX], *srcs[M_K_P_MAX];
+	EC_DEC_TBLS	*dec_tbls;
+
+	k = hdr->k;
+	p = hdr->p;
+	su = hdr->stripe_unit;
+	for (j = 0, nbad = 0, nok = 0; j < p; j++) {
+		bad[j] = ok[k + j] && memcmp(bufs[k + j], outp[j], su) != 0;
+		nok += ok[k + j];
+		nbad += bad[j];
+	}
+	if (nbad == 0) {
+		return 0;
+	}
+	if (nbad < nok || nok < 2) {
+		for (j = 0; j < p; j++) {
+			if (bad[j] && nbad < nok) {
+				ERR_MSG("fragment[%d], stripe[%ld]: parity doesn't match the data", k + j, stripe);
+			}
+			else if (bad[j]) {	/* a single good parity slice can't tell */
+				ERR_MSG("fragment[%d], stripe[%ld]: parity doesn't match the data, or a data slice is bad", k + j, stripe);
+			}
+		}
+		return nbad;
+	}
+	for (d = 0; d < k; d++) {
+		for (j = 0, nerrs = 0, err_list[nerrs++] = d; j < p; j++) {
+			if (!ok[k + j]) {
+				err_list[nerrs++] = k + j;
+			}
+		}
+		if ((dec_tbls = ec_dec_cache_get(k, p, err_list, nerrs)) == NULL) {
+			break;
+		}
+		for (i = 0; i < k; i++) {
+			srcs[i] = bufs[dec_tbls->decode_index[i]];
+		}
+		ec_encode_data(su, k, 1, dec_tbls->g_tbls, srcs, &scratch);
+		ec_dec_cache_put(dec_tbls);
+
+		memcpy(srcs, bufs, k * sizeof(u8 *));
+		srcs[d] = scratch;
+		ec_encode_data(su, k, p, (u8 *)g_tbls, srcs, outp);
+		for (j = 0; j < p && (!ok[k + j] || memcmp(bufs[k + j], outp[j], su) == 0); j++)
+			;
+		if (j == p) {
+			ERR_MSG("fragment[%d], stripe[%ld]: data doesn't match the parity", d, stripe);
+			return 1;
 		}
 	}
+	ERR_MSG("stripe[%ld]: parity doesn't match the data, bad slice not located", stripe);
+	return nbad;
+}
+
+/*
+ * '-V': check every stripe, nothing is written. Each slice is verified
+ * against the checksum in its own fragment's index as it is read; when the
+ * k data slices are good, the parity is re-encoded into scratch buffers and
+ * compared with the stored one. Bad slices are reported by fragment and
+ * stripe. Pages are dropped from the cache once checked, so that a scrub
+ * doesn't evict everything else.
+ */
+void *pthread_verify_ec_worker(void *arg)
+{
+	THREAD_BLOCK_INFO *t_block_info = (THREAD_BLOCK_INFO *)arg;
+	EC_STAT_SET	*stats = t_block_info->stats;
+	EC_STRIPE_ENTRY	**indexes = t_block_info->indexes;
+	EC_FRAG_HDR	*hdr = t_block_info->hdr;
+	int	m, k, p, frag_len, index, i, nbad, ok[M_K_P_MAX];
+	int64_t	stripe, offset;
+	EC_BUF_INFO	*ebi;
+	u8		*g_tbls, *scratch;
+	uint64_t	t, r;
+
+	m = t_block_info->m;
+	k = t_block_info->k;
+	p = t_block_info->p;
+	frag_len = t_block_info->frag_len;
+	index = t_block_info->index;
+
+	t = ec_stat_now();
+	g_tbls = worker_numa_setup(t_block_info, t_block_info->enc_tbls->g_tbls, k * p * 32);
+	ec_stat_add(stats, EC_STAT_TABLES, t, k * p * 32);
+	/* frag_ptrs hold the m stored slices, recover_outp the re-encoded parity */
+	ebi = alloc_ec_buf(t_block_info->pool, m, k, p, frag_len);
+	if (posix_memalign((void **)&scratch, 64, frag_len) != 0) {
+		ERR_QUIT("posix_memalign() error");
+	}
+
+	t = ec_stat_now();
+	while ((stripe = stripe_queue_pop(index)) >= 0) {
+		t = ec_stat_add(stats, EC_STAT_QUEUE_WAIT, t, 0);
+		offset = t_block_info->frag_index[stripe].offset;
+		for (i = 0, r = t, nbad = 0; i < m; i++) {
+			ok[i] = 0;
+			if (t_block_info->wfd[i] < 0) {	/* lost, reported by main() */
+				continue;
+			}
+			if (preadn(t_block_info->wfd[i], ebi->frag_ptrs[i], frag_len, offset) != frag_len) {
+				ERR_MSG("fragment[%d], stripe[%ld]: read error", i, stripe);
+				nbad++;
+				continue;
+			}
+			posix_fadvise(t_block_info->wfd[i], offset, frag_len, POSIX_FADV_DONTNEED);
+			if (!ec_frag_slice_ok(hdr, indexes[i], stripe, ebi->frag_ptrs[i])) {
+				ERR_MSG("fragment[%d], stripe[%ld]: checksum mismatch", i, stripe);
+				nbad++;
+			}
+			else {
+				ok[i] = 1;
+			}
+			t = ec_stat_frag_add(stats, i, EC_STAT_FRAG_READ, t, frag_len);
+		}
+		ec_stat_count(stats, EC_STAT_READ, t - r, (int64_t)m * frag_len);
+
+		/* parity can only be re-encoded from good data, the zero slices of a sparse stripe need none */
+		for (i = 0; i < k && ok[i]; i++)
+			;
+		if (i == k && !(t_block_info->frag_index[stripe].flags & EC_STRIPE_SPARSE)) {
+			ec_encode_data(frag_len, k, p, g_tbls, ebi->frag_ptrs, ebi->recover_outp);
+			nbad += verify_parity(hdr, g_tbls, ebi->frag_ptrs, ebi->recover_outp, ok, stripe, scratch);
+			t = ec_stat_add(stats, EC_STAT_COMPUTE, t, (int64_t)k * frag_len);
+		}
+		t_block_info->corrupt += nbad;
+		t_block_info->stripes++;
+	}
+	t_block_info->time = stats->stage[EC_STAT_COMPUTE].sum_ns / 1000;
+	stats->stripes = t_block_info->stripes;
+	free(scratch);
 	release_ec_buf(ebi);
-	
+	worker_numa_release(t_block_info, g_tbls);
+
 	return NULL;
 }
 
+/* run 'worker' on nr_threads threads until all stripe queues are drained, return the max worker time */
+int run_stripe_workers(pthread_t *ptid, THREAD_BLOCK_INFO *t_block_info, void *(*worker)(void *))
+{
+	int	i, total_time;
+	struct timeval	start;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&ptid[i], NULL, worker, &t_block_info[i]) != 0) {
+			ERR_QUIT("pthread_create() error");
+		}
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(ptid[i], NULL);
+	}
+	msg("WALL TIME: %ld (us)", time_since(&start));
+
+	total_time = 0;
+	for (i = 0; i < nr_threads; i++) {
+		DBG("worker[%d]: stripes[%ld], time[%d] (us)", i, t_block_info[i].stripes, t_block_info[i].time);
+		if (t_block_info[i].time > total_time) {
+			total_time = t_block_info[i].time;
+		}
+	}
+	return total_time;
+}
+
 int main(int argc, char **argv)
 {
 	int             opt;
-	int		fd, tmpfd, wfd[M_K_P_MAX] = {0,};
+	int		fd, wfd[M_K_P_MAX] = {0,};
 	struct stat	st;
-	int64_t		file_size, block_len, frag_len;
+	int64_t		file_size, frag_len, stripe_unit, nr_stripes, total_time;
 	int		m, k, p;
-	int		i, is_decode, total_time;
+	int		i, is_decode, is_verify, is_mmap, is_numa, csum_type, verify, status;
+	int64_t		corrupt;
 	char		filename[NAME_MAX], tmpname[NAME_MAX];
-	EC_BUF_INFO	*ebi;
+	u8		frag_err_list[M_K_P_MAX];
+	int		nerrs, nsrcerrs;
+	EC_DEC_TBLS	*dec_tbls = NULL;
+	EC_FRAG_HDR	hdr;
+	BUF_POOL	*pool;
+	EC_STRIPE_ENTRY	*frag_index = NULL, *indexes[M_K_P_MAX];
+	uint64_t	zero_csum;
+	u8		*map;
+	char		*cache_file = NULL, *json_file = NULL, *prom_file = NULL;
 	struct timeval	start;
 	pthread_t 	*ptid;
 	THREAD_BLOCK_INFO	*t_block_info;
+	EC_NUMA_TOPO	topo;
+	const EC_ENC_TBLS	*enc_tbls;
+	EC_STATS	*stats;
+	uint64_t	t;
 
 	is_decode = 0;
+	is_verify = 0;
+	status = 0;
+	csum_type = EC_CSUM_CRC32C;
+	verify = 1;
+	is_mmap = 0;
+	is_numa = 0;
 	k = K_DEFAULT;
 	p = P_DEFAULT;
-        while ((opt = getopt(argc, argv, "dk:p:")) != -1)
+	stripe_unit = STRIPE_UNIT_DEFAULT;
+	nr_threads = get_nprocs();
+        while ((opt = getopt(argc, argv, "c:C:dJ:k:MnNp:P:s:t:V")) != -1)
         {
                 switch (opt)
                 {
+                        case 'c':
+                                cache_file = optarg;
+                                break;
+                        case 'C':
+                                if ((csum_type = ec_frag_csum_type(optarg)) < 0) {
+                                        err_quit("invalid parameters: checksum['%s'] must be crc32c or crc64", optarg);
+                                }
+                                break;
                         case 'd':
                                 is_decode = 1;
                                 break;
+                        case 'J':
+                                json_file = optarg;
+                                break;
                         case 'k':
                                 k = strtoul(optarg, NULL, 10);
                                 break;
+                        case 'M':
+                                is_mmap = 1;
+                                break;
+                        case 'n':
+                                verify = 0;
+                                break;
+                        case 'N':
+                                is_numa = 1;
+                                break;
                         case 'p':
                                 p = strtoul(optarg, NULL, 10);
                                 break;
+                        case 'P':
+                                prom_file = optarg;
+                                break;
+                        case 's':
+                                stripe_unit = strtoul(optarg, NULL, 10) * 1024;
+                                break;
+                        case 't':
+                                nr_threads = strtoul(optarg, NULL, 10);
+                                break;
+                        case 'V':
+                                is_verify = 1;
+                                break;
                         default:
-                		err_quit("USAGE: %s [-d] [-k k] [-p p] <origin_file | encode_file_prefix>", argv[0]);
+                		err_quit("USAGE: %s [-t threads] [-N] [-J stats.json] [-P stats.prom] [-k k] [-p p] [-s stripe_unit(KB)] [-C crc32c|crc64] [-M] <origin_file> | [-t threads] [-N] [-J stats.json] [-P stats.prom] -d [-n] [-c decode_cache_file] <encode_file_prefix> | [-t threads] [-N] [-J stats.json] [-P stats.prom] -V <encode_file_prefix>\n  -n: no slice checksum check; with no data fragment lost, the data is then copied in the kernel (copy_file_range). Checked, it is read and written, parity still isn't read", argv[0]);
 				break;
                 }
         }
@@ -286,26 +701,100 @@ int main(int argc, char **argv)
 	if (m >= M_K_P_MAX || k < 1 || p < 1 ) {
 		err_quit("invalid parameters: (k+p)[%d] or k [%d] or p[%d] invalid", m, k, p);
 	}
+	if (stripe_unit < 1 || stripe_unit > INT_MAX || nr_threads < 1) {
+		err_quit("invalid parameters: stripe_unit[%ld] or threads[%d] invalid", stripe_unit, nr_threads);
+	}
 	if (argc - optind != 1) {
-                err_quit("USAGE: %s [-d] [-k k] [-p p] <origin_file | encode_file_prefix>", argv[0]);
+                err_quit("USAGE: %s [-t threads] [-N] [-J stats.json] [-P stats.prom] [-k k] [-p p] [-s stripe_unit(KB)] [-C crc32c|crc64] [-M] <origin_file> | [-t threads] [-N] [-J stats.json] [-P stats.prom] -d [-n] [-c decode_cache_file] <encode_file_prefix> | [-t threads] [-N] [-J stats.json] [-P stats.prom] -V <encode_file_prefix>\n  -n: no slice checksum check; with no data fragment lost, the data is then copied in the kernel (copy_file_range). Checked, it is read and written, parity still isn't read", argv[0]);
         }
 
-	nr_cpus = get_nprocs();
-	ptid = malloc(nr_cpus * sizeof(pthread_t));
+	ptid = malloc(nr_threads * sizeof(pthread_t));
 	if (NULL == ptid) {
 		ERR_SYS("malloc(pthread_t) error");
 	}
-	memset(ptid, 0, nr_cpus * sizeof(pthread_t));
-	t_block_info = malloc(nr_cpus * sizeof(THREAD_BLOCK_INFO));
+	memset(ptid, 0, nr_threads * sizeof(pthread_t));
+	t_block_info = malloc(nr_threads * sizeof(THREAD_BLOCK_INFO));
 	if (NULL == t_block_info) {
 		ERR_SYS("malloc(THREAD_BLOCK_INFO) error");
 	}
-	memset(t_block_info, 0, nr_cpus * sizeof(THREAD_BLOCK_INFO));
+	memset(t_block_info, 0, nr_threads * sizeof(THREAD_BLOCK_INFO));
+	/* workers go round robin over the NUMA nodes, each allocates its buffers on its node */
+	ec_numa_topo_init(&topo);
+	ec_numa_topo_report(&topo);
+	for (i = 0; i < nr_threads; i++) {
+		t_block_info[i].cpu = is_numa ? ec_numa_worker_cpu(&topo, i, &t_block_info[i].node) : -1;
+	}
 
 	file_size = 0;
 	frag_len = 0;
 	strncpy(filename, argv[optind], sizeof(filename));
-	if (is_decode == 0) {
+	if (is_verify) {
+		if (ec_frag_open_all(filename, O_RDONLY, wfd, &hdr) < 0) {
+			err_quit("no valid fragment of '%s' found, quit", filename);
+		}
+		k = hdr.k;
+		p = hdr.p;
+		m = k + p;
+		stripe_unit = hdr.stripe_unit;
+		nr_stripes = hdr.nr_stripes;
+		msg("verify '%s': file_size[%ld], m[%d], k[%d], p[%d], stripe_unit[%ld], stripes[%ld], threads[%d]", filename, hdr.orig_size, m, k, p, stripe_unit, nr_stripes, nr_threads);
+		ec_frag_indexes_read(wfd, &hdr, indexes);
+		for (i = 0; i < m && frag_index == NULL; i++) {
+			frag_index = indexes[i];
+		}
+		for (i = 0, nerrs = 0; i < m; i++) {
+			if (wfd[i] < 0) {
+				ERR_MSG("fragment[%d] lost, its slices are not checked", i);
+				nerrs++;
+			}
+			else {
+				posix_fadvise(wfd[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+			}
+		}
+
+		stats = ec_stats_create("thread-isal-ec", "verify", nr_threads, m);
+		t = ec_stat_now();
+		if ((enc_tbls = ec_enc_tables_get(k, p)) == NULL) {
+			ERR_SYS("ec_enc_tables_get() error");
+		}
+		ec_stat_add(&stats->workers[0], EC_STAT_TABLES, t, k * p * 32);
+		stripe_queue_init(nr_stripes);
+		pool = is_numa ? NULL : bufpool_create(stripe_unit, 64, nr_threads * (m + p), 0);
+		for (i = 0; i < nr_threads; i++) {
+			t_block_info[i].m = m;
+			t_block_info[i].k = k;
+			t_block_info[i].p = p;
+			t_block_info[i].frag_len = stripe_unit;
+			t_block_info[i].fd = -1;
+			memcpy(t_block_info[i].wfd, wfd, sizeof(wfd));
+			t_block_info[i].index = i;
+			t_block_info[i].hdr = &hdr;
+			t_block_info[i].pool = pool;
+			t_block_info[i].enc_tbls = enc_tbls;
+			t_block_info[i].indexes = indexes;
+			t_block_info[i].frag_index = frag_index;
+			t_block_info[i].stats = &stats->workers[i];
+		}
+		total_time = run_stripe_workers(ptid, t_block_info, pthread_verify_ec_worker);
+		for (i = 0, corrupt = 0; i < nr_threads; i++) {
+			corrupt += t_block_info[i].corrupt;
+		}
+		msg("verify: stripes[%ld], bad slices[%ld], lost fragments[%d], verify time[%ld] (us)", nr_stripes, corrupt, nerrs, total_time);
+		stripe_queue_release();
+		bufpool_destroy(pool);
+		for (i = 0; i < m; i++) {
+			if (wfd[i] >= 0) {
+				close(wfd[i]);
+			}
+			free(indexes[i]);
+		}
+		ec_dec_cache_release();
+		ec_stats_export(stats, json_file, prom_file);
+		ec_stats_destroy(stats);
+		/* scripts scrubbing many objects only look at the exit status */
+		status = corrupt > 0 || nerrs > 0;
+	}
+	else if (is_decode == 0) {
 		if (lstat(filename, &st) < 0) {
 			ERR_SYS("lstat('%s') error", filename);
 		}
@@ -313,132 +802,192 @@ int main(int argc, char **argv)
 			ERR_SYS("open('%s') error", filename);
 		}
 		file_size = st.st_size;
-		block_len = file_size / nr_cpus;
-		frag_len = block_len / k;
-		//msg("file['%s'], file_size[%ld], m[%d], k[%d], p[%d], block_len[%ld], frag_len[%ld], nr_cpus[%d]", filename, file_size, m, k, p, block_len, frag_len, nr_cpus);
+		if (file_size == 0) {
+			err_quit("file['%s'] is empty, nothing to encode", filename);
+		}
+		frag_len = (file_size + k - 1) / k;
+		if (stripe_unit > frag_len) {
+			stripe_unit = frag_len;
+		}
+		/* slices of a mapped origin start on a huge page when the stripe unit allows it */
+		if (is_mmap && stripe_unit >= EC_MAP_HUGEPAGE && stripe_unit % EC_MAP_HUGEPAGE) {
+			stripe_unit = (stripe_unit + EC_MAP_HUGEPAGE - 1) / EC_MAP_HUGEPAGE * EC_MAP_HUGEPAGE;
+			if (stripe_unit > frag_len) {
+				stripe_unit = frag_len;
+			}
+			msg("stripe_unit rounded to [%ld] for huge pages of the mapping", stripe_unit);
+		}
+		nr_stripes = (file_size + k * stripe_unit - 1) / (k * stripe_unit);
+		msg("file['%s'], file_size[%ld], m[%d], k[%d], p[%d], stripe_unit[%ld], stripes[%ld], threads[%d]", filename, file_size, m, k, p, stripe_unit, nr_stripes, nr_threads);
 
+		ec_frag_hdr_init(&hdr, file_size, k, p, 0, stripe_unit, nr_stripes);
+		hdr.csum_type = csum_type;
+		if ((frag_index = malloc(m * nr_stripes * sizeof(EC_STRIPE_ENTRY))) == NULL) {
+			ERR_SYS("malloc() error");
+		}
+		memset(frag_index, 0, m * nr_stripes * sizeof(EC_STRIPE_ENTRY));
+		zero_csum = ec_frag_zero_csum(&hdr);
 		for (i = 0; i < m; i++) {
 			snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, i);
-			if ((wfd[i] = open(tmpname, O_CREAT | O_RDWR, 0644)) < 0) {
+			if ((wfd[i] = open(tmpname, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
 				ERR_SYS("open('%s') error", tmpname);
 			}
 			DBG("file:[%s], wfd[%d]: %d", tmpname, i, wfd[i]);
 		}
 
-		for (i = 0; i < nr_cpus; i++) {
+		stats = ec_stats_create("thread-isal-ec", "encode", nr_threads, m);
+		t = ec_stat_now();
+		if ((enc_tbls = ec_enc_tables_get(k, p)) == NULL) {
+			ERR_SYS("ec_enc_tables_get() error");
+		}
+		ec_stat_add(&stats->workers[0], EC_STAT_TABLES, t, k * p * 32);
+		stripe_queue_init(nr_stripes);
+		pool = is_numa ? NULL : bufpool_create(stripe_unit, 64, nr_threads * (m + p), 0);
+		/* every worker walks its stripe range forward */
+		map = is_mmap ? ec_origin_map(fd, file_size, MADV_SEQUENTIAL) : NULL;
+		for (i = 0; i < nr_threads; i++) {
 			t_block_info[i].m = m;
 			t_block_info[i].k = k;
 			t_block_info[i].p = p;
-			t_block_info[i].frag_len = frag_len;
-			t_block_info[i].block_len = block_len;
+			t_block_info[i].frag_len = stripe_unit;
 			t_block_info[i].fd = fd;
 			memcpy(t_block_info[i].wfd, wfd, sizeof(wfd));
-			t_block_info[i].offset = i*block_len;
 			t_block_info[i].index = i;
 			t_block_info[i].time = 0;
-
-			pthread_create(&ptid[i], NULL, pthread_encode_ec_block, &t_block_info[i]);
-		}	
-
-		for (i = 0; i < nr_cpus; i++) {
-			pthread_join(ptid[i], NULL);
+			t_block_info[i].stripes = 0;
+			t_block_info[i].hdr = &hdr;
+			t_block_info[i].pool = pool;
+			t_block_info[i].frag_index = frag_index;
+			t_block_info[i].zero_csum = zero_csum;
+			t_block_info[i].map = map;
+			t_block_info[i].enc_tbls = enc_tbls;
+			t_block_info[i].stats = &stats->workers[i];
 		}	
+		total_time = run_stripe_workers(ptid, t_block_info, pthread_encode_ec_worker);
+		stripe_queue_release();
+		ec_origin_unmap(map, file_size);
+		bufpool_destroy(pool);
 		close(fd);
 		for ( i = 0; i < m; i++) {
-			close(wfd[i]);
-		}
-		total_time = 0;
-		for (i = 0; i < nr_cpus; i++) {
-			if (t_block_info[i].time > total_time) {
-				total_time = t_block_info[i].time;
+			hdr.frag_index = i;
+			if (ec_frag_index_write(wfd[i], &hdr, &frag_index[i * nr_stripes]) < 0
+				|| ec_frag_hdr_write(wfd[i], &hdr) < 0) {
+				ERR_SYS("write fragment header of '%s.%d' error", filename, i);
 			}
+			close(wfd[i]);
 		}
-		msg("COST TIME: %lld (us)", total_time);
+		free(frag_index);
+		msg("COST TIME: %ld (us)", total_time);
+		ec_stats_export(stats, json_file, prom_file);
+		ec_stats_destroy(stats);
 	}
 	else {
-		// get frag_len
-		for (i = 0; i < m; i++) {
-			snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, i);
-			if (lstat(tmpname, &st) < 0) {
-				DBG("lstat('%s') error, skip it!", tmpname);
-				continue;
+		if (ec_frag_open_all(filename, O_RDONLY, wfd, &hdr) < 0) {
+			err_quit("no valid fragment of '%s' found, quit", filename);
+		}
+		k = hdr.k;
+		p = hdr.p;
+		m = k + p;
+		stripe_unit = hdr.stripe_unit;
+		nr_stripes = hdr.nr_stripes;
+		dbg("file_size[%ld], m[%d], k[%d], p[%d], stripe_unit[%ld], stripes[%ld], threads[%d]", hdr.orig_size, m, k, p, stripe_unit, nr_stripes, nr_threads);
+		/* slices are verified against their own fragment's index, a fragment without one is taken as lost */
+		memset(indexes, 0, sizeof(indexes));
+		if (verify) {
+			ec_frag_indexes_read(wfd, &hdr, indexes);
+			for (i = 0; i < m && frag_index == NULL; i++) {
+				frag_index = indexes[i];
 			}
-			frag_len = st.st_size;
-			break;
 		}
-		ebi = alloc_ec_buf(m, k, p, frag_len);
-		dbg("m[%d], k[%d], p[%d], frag_len[%d]", ebi->m, ebi->k, ebi->p, ebi->frag_len);
+		else {
+			frag_index = ec_frag_index_read_any(wfd, &hdr);
+		}
+		if (frag_index == NULL) {
+			ERR_MSG("no valid stripe index, sparse stripes are decoded as data");
+		}
+		nerrs = nsrcerrs = 0;
 		for (i = 0; i < m; i++) {
-			snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, i);
-			if ((wfd[i] = open(tmpname, O_RDONLY)) < 0) {
-				DBG("open('%s') error, skip it....", tmpname);
-				ebi->frag_err_list[ebi->nerrs++] = i;
-				continue;
+			if (wfd[i] < 0) {
+				frag_err_list[nerrs++] = i;
+				nsrcerrs += i < k;
 			}
-			//dbg("ebi->frag_ptrs[%d], len:[%d]", i, ebi->frag_len);
-			if(readn(wfd[i], ebi->frag_ptrs[i], ebi->frag_len) != ebi->frag_len) {
-				ERR_SYS("readn() error");
-			}
-			close(wfd[i]);
 		}
-		if (ebi->nerrs > p) {
-			release_ec_buf(ebi);
-			err_quit("Too many(%d) fragments lost, must be less(or equal) than [%d], quit", ebi->nerrs, p);
+		if (nerrs > p) {
+			err_quit("Too many(%d) fragments lost, must be less(or equal) than [%d], quit", nerrs, p);
 		}
 
-		//printf("####################################\n");
-		//dbg("total [%d] fragment lost:", ebi->nerrs);
-		//for (i = 0; i < ebi->nerrs; i++) {
-		//	printf(" %d ", ebi->frag_err_list[i]);
-		//}	
-		//printf("\n####################################\n");
-
-		if (ebi->nerrs > 0) {
-			int	ret;
+		total_time = 0;
+		stats = ec_stats_create("thread-isal-ec", "decode", nr_threads, m);
+		ec_dec_cache_init(EC_DEC_CACHE_DEFAULT, cache_file);
+		/* lost parity only: nothing to decode, no matrix inversion */
+		if (nsrcerrs > 0) {
 			gettimeofday(&start, NULL);
-			
-			gf_gen_cauchy1_matrix(ebi->encode_matrix, ebi->m, ebi->k);
-			ret = gf_gen_decode_matrix_simple(ebi->encode_matrix, ebi->decode_matrix,
-					 ebi->invert_matrix, ebi->temp_matrix, ebi->decode_index,
-                                          ebi->frag_err_list, ebi->nerrs, k, m);
-			if (ret != 0) {
-				ERR_QUIT("Fail on generate decode matrix, quit, ret[%d]", ret);
-			}
-			//for (i = 0; i < k; i++) {
-			//	dbg("decode_index[%d]: %d", i, ebi->decode_index[i]);
-			//}
-			// Pack recovery array pointers as list of valid fragments
-			for (i = 0; i < k; i++) {
-				ebi->recover_srcs[i] = ebi->frag_ptrs[ebi->decode_index[i]];
+			t = ec_stat_now();
+			// one decode table set for all workers
+			dec_tbls = ec_dec_cache_get(k, p, frag_err_list, nerrs);
+			if (dec_tbls == NULL) {
+				ERR_QUIT("Fail on generate decode matrix, quit");
 			}
-			// Recover data
-			//ec_init_tables(k, p, &encode_matrix[k * k], g_tbls);
-			ec_init_tables(k, ebi->nerrs, ebi->decode_matrix, ebi->g_tbls);
-			//ec_encode_data(len, k, nerrs, g_tbls, recover_srcs, recover_outp);
-			ec_encode_data(ebi->frag_len, ebi->k, ebi->nerrs, ebi->g_tbls, ebi->recover_srcs, ebi->recover_outp);
+			ec_stat_add(&stats->workers[0], EC_STAT_TABLES, t, nerrs * k * 32);
+			total_time = time_since(&start);
 		}
 
-		// save frag buffer , don't memcpy()
-		for (i = 0; i < ebi->m; i++) {
-			ebi->recover_frag_ptrs[i] = ebi->frag_ptrs[i];
-		}
-		for (i = 0; i < ebi->nerrs; i++) {
-			ebi->recover_frag_ptrs[ebi->frag_err_list[i]] = ebi->recover_outp[i];
-		}
-
-		msg("####### Recovery time: %ld (us) #########", time_since(&start));
 		snprintf(tmpname, sizeof(tmpname), "%s", filename);
-		if ((tmpfd = open(tmpname, O_CREAT | O_RDWR, 0644)) < 0) {
+		if ((fd = open(tmpname, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
 			ERR_SYS("open('%s') error", tmpname);
 		}
-		for (i = 0; i < ebi->k; i++) {
-			if(writen(tmpfd, ebi->recover_frag_ptrs[i], ebi->frag_len) != ebi->frag_len) {
-				ERR_SYS("writen() error");
+		/* sized up front: sparse stripes are left as holes */
+		if (ftruncate(fd, hdr.orig_size) < 0) {
+			ERR_SYS("ftruncate('%s') error", tmpname);
+		}
+		stripe_queue_init(nr_stripes);
+		pool = is_numa ? NULL : bufpool_create(stripe_unit, 64, nr_threads * (m + p), 0);
+		for (i = 0; i < nr_threads; i++) {
+			t_block_info[i].m = m;
+			t_block_info[i].k = k;
+			t_block_info[i].p = p;
+			t_block_info[i].frag_len = stripe_unit;
+			t_block_info[i].fd = fd;
+			memcpy(t_block_info[i].wfd, wfd, sizeof(wfd));
+			t_block_info[i].index = i;
+			t_block_info[i].time = 0;
+			t_block_info[i].stripes = 0;
+			t_block_info[i].hdr = &hdr;
+			t_block_info[i].pool = pool;
+			t_block_info[i].dec_tbls = dec_tbls;
+			t_block_info[i].frag_index = frag_index;
+			t_block_info[i].indexes = verify ? indexes : NULL;
+			t_block_info[i].stats = &stats->workers[i];
+		}
+		total_time += run_stripe_workers(ptid, t_block_info, pthread_decode_ec_worker);
+		msg("####### Recovery time: %ld (us) #########", total_time);
+		for (i = 0, corrupt = 0; i < nr_threads; i++) {
+			corrupt += t_block_info[i].corrupt;
+		}
+		if (corrupt > 0) {
+			msg("[%ld] corrupt slices decoded as erasures", corrupt);
+		}
+		stripe_queue_release();
+		bufpool_destroy(pool);
+		if (!verify) {
+			free(frag_index);
+		}
+		for (i = 0; i < m; i++) {
+			free(indexes[i]);
+		}
+		close(fd);
+		for (i = 0; i < m; i++) {
+			if (wfd[i] >= 0) {
+				close(wfd[i]);
 			}
 		}
-		close(tmpfd);
-		release_ec_buf(ebi);
+		ec_dec_cache_put(dec_tbls);
+		ec_dec_cache_release();
+		ec_stats_export(stats, json_file, prom_file);
+		ec_stats_destroy(stats);
 		dbg("decoder ok");
 	}
-	return 0;
+	free(t_block_info);
+	free(ptid);
+	return status;
 }